@@ -0,0 +1,250 @@
+/*
+ * qp_bench: Microbenchmarks for QP hot paths
+ *
+ * Usage: qp_bench [-t max_threads] [-n iterations] [-f filter]
+ *
+ * Each benchmark runs with 1, 2, 4 ... max_threads threads (default is
+ * twice the number of CPUs) and prints one JSON object per line:
+ *
+ *     {"bench":"print_loc","sink":"buffer","threads":4,"iters":...,
+ *      "ns_per_call":...,"calls_per_sec":...}
+ *
+ * ns_per_call is wall time per call from the point of view of one thread,
+ * calls_per_sec is the aggregate throughput of all threads.
+ *
+ * Output sinks are selected at runtime:
+ * - null: arguments are not even formatted, measures macro overhead
+ * - buffer: vsnprintf into a per-thread buffer
+ * - stderr: QP_PRINT_IMPL_STDERR with stderr redirected to /dev/null
+ * - ring: QP_PRINT_IMPL_RING draining to /dev/null
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+enum bench_sink {
+    SINK_NULL,
+    SINK_BUFFER,
+    SINK_STDERR,
+    SINK_RING,
+    SINK_COUNT,
+};
+
+static const char *sink_names[SINK_COUNT] = {
+    "null", "buffer", "stderr", "ring",
+};
+
+static enum bench_sink bench_sink;
+static __thread char bench_buffer[512];
+
+static int bench_buffer_print(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+#define QP_PRINT(str, ...) do { \
+        switch (bench_sink) { \
+        case SINK_BUFFER: \
+            bench_buffer_print(str, ## __VA_ARGS__); \
+            break; \
+        case SINK_STDERR: \
+            QP_PRINT_IMPL_STDERR(str, ## __VA_ARGS__); \
+            break; \
+        case SINK_RING: \
+            QP_PRINT_IMPL_RING(str, ## __VA_ARGS__); \
+            break; \
+        default: \
+            break; \
+        } \
+    } while (0)
+
+#define QP_TIME_HEADER QP_TIME_HEADER_5_6
+#include "qp.h"
+
+static int bench_buffer_print(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(bench_buffer, sizeof(bench_buffer), fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+/* Benchmarked operations, each is called in a loop by every thread */
+
+static void op_print_loc(unsigned long i)
+{
+    QP_PRINT_LOC("i=%lu str=%s\n", i, "hello");
+}
+
+static void op_ratelimit(unsigned long i)
+{
+    if (QP_RATELIMIT(1000))
+        QP_PRINT_LOC("i=%lu\n", i);
+}
+
+static void op_print_ratelimit(unsigned long i)
+{
+    QP_PRINT_RATELIMIT("i=%lu\n", i);
+}
+
+static void op_profile_region(unsigned long i)
+{
+    QP_PROFILE_REGION_BEGIN();
+    __asm__ __volatile__("" : : "r" (i) : "memory");
+    QP_PROFILE_REGION_END("bench");
+}
+
+static void op_dump_hex_buffer(unsigned long i)
+{
+    static const unsigned char buf[64] = {
+        0x45, 0x00, 0x00, 0x40, 0x12, 0x34, 0x40, 0x00,
+        0x40, 0x06, 0xab, 0xcd, 0x0a, 0x00, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x02,
+    };
+
+    QP_DUMP_HEX_BUFFER(buf, sizeof(buf));
+}
+
+static void op_dump_var(unsigned long i)
+{
+    int val = i;
+
+    QP_DUMP_VAR(val);
+}
+
+struct bench {
+    const char *name;
+    void (*op)(unsigned long i);
+    /* Benchmark output through every sink, otherwise only null */
+    bool all_sinks;
+    /* Divide default iteration count for expensive operations */
+    unsigned int iters_div;
+};
+
+static const struct bench benches[] = {
+    { "print_loc", op_print_loc, true, 1 },
+    { "ratelimit", op_ratelimit, false, 1 },
+    { "print_ratelimit", op_print_ratelimit, false, 1 },
+    { "profile_region", op_profile_region, false, 1 },
+    { "dump_hex_buffer", op_dump_hex_buffer, true, 16 },
+    { "dump_var", op_dump_var, true, 1 },
+};
+
+struct bench_run {
+    const struct bench *bench;
+    unsigned long iters;
+    pthread_barrier_t barrier;
+};
+
+static void *bench_thread(void *arg)
+{
+    struct bench_run *run = arg;
+    unsigned long i;
+
+    pthread_barrier_wait(&run->barrier);
+    for (i = 0; i < run->iters; ++i)
+        run->bench->op(i);
+    return NULL;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_run(const struct bench *bench, unsigned int nthreads, unsigned long iters)
+{
+    struct bench_run run = {
+        .bench = bench,
+        .iters = iters,
+    };
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    unsigned long long start, elapsed;
+    unsigned int i;
+
+    pthread_barrier_init(&run.barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, bench_thread, &run)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    start = now_ns();
+    pthread_barrier_wait(&run.barrier);
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - start;
+    pthread_barrier_destroy(&run.barrier);
+    free(threads);
+
+    printf("{\"bench\":\"%s\",\"sink\":\"%s\",\"threads\":%u,\"iters\":%lu,"
+            "\"ns_per_call\":%.2f,\"calls_per_sec\":%.0f}\n",
+            bench->name, sink_names[bench_sink], nthreads, iters,
+            (double)elapsed / iters,
+            (double)iters * nthreads * 1e9 / (elapsed ?: 1));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iters = 1000000;
+    unsigned int max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    const char *filter = NULL;
+    unsigned int i, nthreads;
+    int devnull, opt;
+
+    while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iters = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t max_threads] [-n iterations] [-f filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!max_threads)
+        max_threads = 1;
+
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0 || dup2(devnull, STDERR_FILENO) < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    qp_ring_set_fd(devnull);
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        const struct bench *bench = &benches[i];
+        int sink;
+
+        if (filter && !strstr(bench->name, filter))
+            continue;
+        for (sink = 0; sink < (bench->all_sinks ? SINK_COUNT : 1); ++sink) {
+            bench_sink = sink;
+            for (nthreads = 1; ; nthreads *= 2) {
+                if (nthreads > max_threads)
+                    nthreads = max_threads;
+                bench_run(bench, nthreads, iters / bench->iters_div);
+                if (nthreads == max_threads)
+                    break;
+            }
+        }
+    }
+    qp_ring_flush();
+
+    return 0;
+}
@@ -22,6 +22,7 @@
  *      should be defined to "".
  * - #QP_RATELIMIT_INTERVAL
  * - #QP_TIME_HEADER
+ * - #QP_TIMEBASE
  * - #QP_MILITIME_NOW
  * - #QP_NANOTIME_NOW
  */
@@ -43,12 +44,154 @@
         #include <stdlib.h>
         #include <errno.h>
         #include <sys/time.h>
+        #include <time.h>
         #include <execinfo.h>
         #include <pthread.h>
         #include <linux/if_packet.h>
+        #include <stdarg.h>
+        #include <stddef.h>
+        #include <stdint.h>
+        #include <string.h>
+        #include <unistd.h>
+        #include <sched.h>
+        #include <fcntl.h>
+        #include <fnmatch.h>
+        #include <sys/stat.h>
+        #include <sys/mman.h>
+        #include <limits.h>
+        #include <signal.h>
+        #include <link.h>
+        #include <sys/syscall.h>
+        #include <linux/perf_event.h>
     #endif
 #endif
 
+#if defined(__GLIBC__) && !defined(QP_PROJECT_LINUX_KERNEL)
+    #define QP_PROJECT_GLIBC
+#endif
+
+/** Storage class for state shared by all users of qp.h
+ *
+ * In userspace this is a weak definition so that there is only one copy per
+ * program regardless of how many translation units include qp.h. Kernel
+ * modules get a private copy per translation unit.
+ */
+#ifndef QP_GLOBAL
+    #if defined(QP_PROJECT_LINUX_KERNEL)
+        #define QP_GLOBAL static __maybe_unused
+    #else
+        #define QP_GLOBAL __attribute__((weak))
+    #endif
+#endif
+
+#ifndef unlikely
+    #define unlikely(x) __builtin_expect(!!(x), 0)
+#endif
+#ifndef likely
+    #define likely(x) __builtin_expect(!!(x), 1)
+#endif
+
+/* Atomics based on GCC builtins, usable from both kernel and userspace: */
+#define QP_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define QP_ATOMIC_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define QP_ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define QP_ATOMIC_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define QP_ATOMIC_ADD(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_RELAXED)
+#define QP_ATOMIC_XCHG(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+/** Compare and exchange, on failure the current value is stored in *expected */
+#define QP_ATOMIC_CAS(ptr, expected, desired) \
+        __atomic_compare_exchange_n((ptr), (expected), (desired), 0, \
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+/* Preprocessor helpers for iterating over variadic macro arguments: */
+#define QP__CAT_(a, b) a ## b
+#define QP__CAT(a, b) QP__CAT_(a, b)
+#define QP__STRINGIFY_(x) #x
+#define QP__STRINGIFY(x) QP__STRINGIFY_(x)
+
+/** Number of variadic arguments (up to 64, zero arguments supported) */
+#define QP__NARGS(...) QP__NARGS_(_, ## __VA_ARGS__, \
+        64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, \
+        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, \
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, \
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, \
+        0)
+#define QP__NARGS_( \
+        _0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, \
+        _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, \
+        _32, _33, _34, _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, \
+        _48, _49, _50, _51, _52, _53, _54, _55, _56, _57, _58, _59, _60, _61, _62, _63, \
+        _64, \
+        N, ...) N
+
+/** Expand m(x) for each variadic argument x */
+#define QP__FOR_EACH(m, ...) QP__CAT(QP__FOR_EACH_, QP__NARGS(__VA_ARGS__))(m, __VA_ARGS__)
+#define QP__FOR_EACH_0(m, ...)
+#define QP__FOR_EACH_1(m, x) m(x)
+#define QP__FOR_EACH_2(m, x, ...) m(x) QP__FOR_EACH_1(m, __VA_ARGS__)
+#define QP__FOR_EACH_3(m, x, ...) m(x) QP__FOR_EACH_2(m, __VA_ARGS__)
+#define QP__FOR_EACH_4(m, x, ...) m(x) QP__FOR_EACH_3(m, __VA_ARGS__)
+#define QP__FOR_EACH_5(m, x, ...) m(x) QP__FOR_EACH_4(m, __VA_ARGS__)
+#define QP__FOR_EACH_6(m, x, ...) m(x) QP__FOR_EACH_5(m, __VA_ARGS__)
+#define QP__FOR_EACH_7(m, x, ...) m(x) QP__FOR_EACH_6(m, __VA_ARGS__)
+#define QP__FOR_EACH_8(m, x, ...) m(x) QP__FOR_EACH_7(m, __VA_ARGS__)
+#define QP__FOR_EACH_9(m, x, ...) m(x) QP__FOR_EACH_8(m, __VA_ARGS__)
+#define QP__FOR_EACH_10(m, x, ...) m(x) QP__FOR_EACH_9(m, __VA_ARGS__)
+#define QP__FOR_EACH_11(m, x, ...) m(x) QP__FOR_EACH_10(m, __VA_ARGS__)
+#define QP__FOR_EACH_12(m, x, ...) m(x) QP__FOR_EACH_11(m, __VA_ARGS__)
+#define QP__FOR_EACH_13(m, x, ...) m(x) QP__FOR_EACH_12(m, __VA_ARGS__)
+#define QP__FOR_EACH_14(m, x, ...) m(x) QP__FOR_EACH_13(m, __VA_ARGS__)
+#define QP__FOR_EACH_15(m, x, ...) m(x) QP__FOR_EACH_14(m, __VA_ARGS__)
+#define QP__FOR_EACH_16(m, x, ...) m(x) QP__FOR_EACH_15(m, __VA_ARGS__)
+#define QP__FOR_EACH_17(m, x, ...) m(x) QP__FOR_EACH_16(m, __VA_ARGS__)
+#define QP__FOR_EACH_18(m, x, ...) m(x) QP__FOR_EACH_17(m, __VA_ARGS__)
+#define QP__FOR_EACH_19(m, x, ...) m(x) QP__FOR_EACH_18(m, __VA_ARGS__)
+#define QP__FOR_EACH_20(m, x, ...) m(x) QP__FOR_EACH_19(m, __VA_ARGS__)
+#define QP__FOR_EACH_21(m, x, ...) m(x) QP__FOR_EACH_20(m, __VA_ARGS__)
+#define QP__FOR_EACH_22(m, x, ...) m(x) QP__FOR_EACH_21(m, __VA_ARGS__)
+#define QP__FOR_EACH_23(m, x, ...) m(x) QP__FOR_EACH_22(m, __VA_ARGS__)
+#define QP__FOR_EACH_24(m, x, ...) m(x) QP__FOR_EACH_23(m, __VA_ARGS__)
+#define QP__FOR_EACH_25(m, x, ...) m(x) QP__FOR_EACH_24(m, __VA_ARGS__)
+#define QP__FOR_EACH_26(m, x, ...) m(x) QP__FOR_EACH_25(m, __VA_ARGS__)
+#define QP__FOR_EACH_27(m, x, ...) m(x) QP__FOR_EACH_26(m, __VA_ARGS__)
+#define QP__FOR_EACH_28(m, x, ...) m(x) QP__FOR_EACH_27(m, __VA_ARGS__)
+#define QP__FOR_EACH_29(m, x, ...) m(x) QP__FOR_EACH_28(m, __VA_ARGS__)
+#define QP__FOR_EACH_30(m, x, ...) m(x) QP__FOR_EACH_29(m, __VA_ARGS__)
+#define QP__FOR_EACH_31(m, x, ...) m(x) QP__FOR_EACH_30(m, __VA_ARGS__)
+#define QP__FOR_EACH_32(m, x, ...) m(x) QP__FOR_EACH_31(m, __VA_ARGS__)
+#define QP__FOR_EACH_33(m, x, ...) m(x) QP__FOR_EACH_32(m, __VA_ARGS__)
+#define QP__FOR_EACH_34(m, x, ...) m(x) QP__FOR_EACH_33(m, __VA_ARGS__)
+#define QP__FOR_EACH_35(m, x, ...) m(x) QP__FOR_EACH_34(m, __VA_ARGS__)
+#define QP__FOR_EACH_36(m, x, ...) m(x) QP__FOR_EACH_35(m, __VA_ARGS__)
+#define QP__FOR_EACH_37(m, x, ...) m(x) QP__FOR_EACH_36(m, __VA_ARGS__)
+#define QP__FOR_EACH_38(m, x, ...) m(x) QP__FOR_EACH_37(m, __VA_ARGS__)
+#define QP__FOR_EACH_39(m, x, ...) m(x) QP__FOR_EACH_38(m, __VA_ARGS__)
+#define QP__FOR_EACH_40(m, x, ...) m(x) QP__FOR_EACH_39(m, __VA_ARGS__)
+#define QP__FOR_EACH_41(m, x, ...) m(x) QP__FOR_EACH_40(m, __VA_ARGS__)
+#define QP__FOR_EACH_42(m, x, ...) m(x) QP__FOR_EACH_41(m, __VA_ARGS__)
+#define QP__FOR_EACH_43(m, x, ...) m(x) QP__FOR_EACH_42(m, __VA_ARGS__)
+#define QP__FOR_EACH_44(m, x, ...) m(x) QP__FOR_EACH_43(m, __VA_ARGS__)
+#define QP__FOR_EACH_45(m, x, ...) m(x) QP__FOR_EACH_44(m, __VA_ARGS__)
+#define QP__FOR_EACH_46(m, x, ...) m(x) QP__FOR_EACH_45(m, __VA_ARGS__)
+#define QP__FOR_EACH_47(m, x, ...) m(x) QP__FOR_EACH_46(m, __VA_ARGS__)
+#define QP__FOR_EACH_48(m, x, ...) m(x) QP__FOR_EACH_47(m, __VA_ARGS__)
+#define QP__FOR_EACH_49(m, x, ...) m(x) QP__FOR_EACH_48(m, __VA_ARGS__)
+#define QP__FOR_EACH_50(m, x, ...) m(x) QP__FOR_EACH_49(m, __VA_ARGS__)
+#define QP__FOR_EACH_51(m, x, ...) m(x) QP__FOR_EACH_50(m, __VA_ARGS__)
+#define QP__FOR_EACH_52(m, x, ...) m(x) QP__FOR_EACH_51(m, __VA_ARGS__)
+#define QP__FOR_EACH_53(m, x, ...) m(x) QP__FOR_EACH_52(m, __VA_ARGS__)
+#define QP__FOR_EACH_54(m, x, ...) m(x) QP__FOR_EACH_53(m, __VA_ARGS__)
+#define QP__FOR_EACH_55(m, x, ...) m(x) QP__FOR_EACH_54(m, __VA_ARGS__)
+#define QP__FOR_EACH_56(m, x, ...) m(x) QP__FOR_EACH_55(m, __VA_ARGS__)
+#define QP__FOR_EACH_57(m, x, ...) m(x) QP__FOR_EACH_56(m, __VA_ARGS__)
+#define QP__FOR_EACH_58(m, x, ...) m(x) QP__FOR_EACH_57(m, __VA_ARGS__)
+#define QP__FOR_EACH_59(m, x, ...) m(x) QP__FOR_EACH_58(m, __VA_ARGS__)
+#define QP__FOR_EACH_60(m, x, ...) m(x) QP__FOR_EACH_59(m, __VA_ARGS__)
+#define QP__FOR_EACH_61(m, x, ...) m(x) QP__FOR_EACH_60(m, __VA_ARGS__)
+#define QP__FOR_EACH_62(m, x, ...) m(x) QP__FOR_EACH_61(m, __VA_ARGS__)
+#define QP__FOR_EACH_63(m, x, ...) m(x) QP__FOR_EACH_62(m, __VA_ARGS__)
+#define QP__FOR_EACH_64(m, x, ...) m(x) QP__FOR_EACH_63(m, __VA_ARGS__)
+
 /**
  * End-of-line terminator.
  *
@@ -106,6 +249,339 @@
         } \
     } while (0)
 
+#ifdef QP_PROJECT_GLIBC
+/* Asynchronous ring buffer output.
+ *
+ * Every thread gets a private single-producer single-consumer ring of
+ * fixed-size message slots. Producers format directly into a slot and a
+ * background thread copies finished messages out and writes them to a file
+ * descriptor. Rings are never freed: when a thread exits its ring is recycled
+ * by the next new thread.
+ */
+
+/** Number of message slots in each per-thread ring (must be a power of 2) */
+#ifndef QP_RING_SLOTS
+    #define QP_RING_SLOTS 256
+#endif
+
+/** Maximum length of one message, longer messages are truncated */
+#ifndef QP_RING_MSG_SIZE
+    #define QP_RING_MSG_SIZE 256
+#endif
+
+/** Drain thread sleep time when all rings are empty */
+#ifndef QP_RING_DRAIN_INTERVAL_US
+    #define QP_RING_DRAIN_INTERVAL_US 1000
+#endif
+
+/** Ring overflow policy: discard the message being printed */
+#define QP_RING_OVERFLOW_DROP_NEW 0
+/** Ring overflow policy: discard the oldest message still in the ring */
+#define QP_RING_OVERFLOW_DROP_OLD 1
+/** Ring overflow policy: wait for the drain thread to make room */
+#define QP_RING_OVERFLOW_BLOCK 2
+
+/** Default ring overflow policy, can be changed with qp_ring_set_overflow */
+#ifndef QP_RING_OVERFLOW
+    #define QP_RING_OVERFLOW QP_RING_OVERFLOW_DROP_NEW
+#endif
+
+struct qp_ring_slot {
+    unsigned int len;
+    char data[];
+};
+
+struct qp_ring {
+    struct qp_ring *next;
+    int in_use;
+    unsigned int mask;
+    unsigned int slot_size;
+    /* Producer position, only written by the owner thread. */
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long long dropped;
+    /* Consumer position, also advanced by the producer for DROP_OLD. */
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long long reported_dropped;
+    char buf[] __attribute__((aligned(64)));
+};
+
+struct qp_ring_state {
+    struct qp_ring *list;
+    int fd;
+    int overflow;
+    pthread_once_t once;
+    pthread_key_t key;
+    pthread_mutex_t drain_lock;
+    pthread_t thread;
+    int thread_running;
+    /* Optional formatter for drop reports, for non-text output streams */
+    size_t (*format_drops)(char *buf, size_t size, struct qp_ring *ring,
+            unsigned long long delta, unsigned long long total);
+};
+
+QP_GLOBAL struct qp_ring_state qp_ring_state = {
+    .fd = STDERR_FILENO,
+    .overflow = QP_RING_OVERFLOW,
+    .once = PTHREAD_ONCE_INIT,
+    .drain_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+QP_GLOBAL __thread struct qp_ring *qp_ring_self;
+
+/** Write an entire buffer, retrying on EINTR and partial writes */
+static inline int qp_write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static inline struct qp_ring_slot *qp_ring_slot(struct qp_ring *ring, unsigned long pos)
+{
+    return (struct qp_ring_slot *)(ring->buf + (pos & ring->mask) * ring->slot_size);
+}
+
+/** Move all pending messages from all rings to the output fd
+ *
+ * Must be called with drain_lock held. Returns number of bytes written.
+ */
+static inline size_t qp_ring_drain_locked(void)
+{
+    char out[16384];
+    size_t outlen = 0, total = 0;
+    struct qp_ring *ring;
+
+    for (ring = QP_ATOMIC_LOAD_ACQUIRE(&qp_ring_state.list); ring; ring = ring->next) {
+        unsigned long tail = QP_ATOMIC_LOAD_ACQUIRE(&ring->tail);
+        unsigned long long dropped;
+
+        while (tail != QP_ATOMIC_LOAD_ACQUIRE(&ring->head)) {
+            struct qp_ring_slot *slot = qp_ring_slot(ring, tail);
+            size_t len = QP_ATOMIC_LOAD(&slot->len);
+
+            if (len > ring->slot_size - sizeof(*slot))
+                len = ring->slot_size - sizeof(*slot);
+            if (outlen + len > sizeof(out)) {
+                qp_write_all(qp_ring_state.fd, out, outlen);
+                total += outlen;
+                outlen = 0;
+            }
+            memcpy(out + outlen, slot->data, len);
+            /* Only keep the copy if the producer did not drop it meanwhile */
+            if (QP_ATOMIC_CAS(&ring->tail, &tail, tail + 1)) {
+                outlen += len;
+                ++tail;
+            }
+        }
+
+        dropped = QP_ATOMIC_LOAD(&ring->dropped);
+        if (unlikely(dropped != ring->reported_dropped)) {
+            if (outlen + 128 > sizeof(out)) {
+                qp_write_all(qp_ring_state.fd, out, outlen);
+                total += outlen;
+                outlen = 0;
+            }
+            if (qp_ring_state.format_drops)
+                outlen += qp_ring_state.format_drops(out + outlen, 128, ring,
+                        dropped - ring->reported_dropped, dropped);
+            else
+                outlen += snprintf(out + outlen, 128,
+                        "qp_ring: ring=%p dropped=%llu total_dropped=%llu\n",
+                        ring, dropped - ring->reported_dropped, dropped);
+            ring->reported_dropped = dropped;
+        }
+    }
+    if (outlen) {
+        qp_write_all(qp_ring_state.fd, out, outlen);
+        total += outlen;
+    }
+
+    return total;
+}
+
+/** Synchronously write out everything pending in all rings */
+static inline void qp_ring_flush(void)
+{
+    pthread_mutex_lock(&qp_ring_state.drain_lock);
+    qp_ring_drain_locked();
+    pthread_mutex_unlock(&qp_ring_state.drain_lock);
+}
+
+static inline void *qp_ring_drain_thread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        size_t written;
+
+        pthread_mutex_lock(&qp_ring_state.drain_lock);
+        written = qp_ring_drain_locked();
+        pthread_mutex_unlock(&qp_ring_state.drain_lock);
+        if (!written)
+            usleep(QP_RING_DRAIN_INTERVAL_US);
+    }
+    return NULL;
+}
+
+static inline void qp_ring_thread_exit(void *arg)
+{
+    struct qp_ring *ring = (struct qp_ring *)arg;
+
+    QP_ATOMIC_STORE_RELEASE(&ring->in_use, 0);
+}
+
+static inline void qp_ring_init_once(void)
+{
+    pthread_key_create(&qp_ring_state.key, qp_ring_thread_exit);
+    atexit(qp_ring_flush);
+#ifndef QP_RING_NO_DRAIN_THREAD
+    if (!pthread_create(&qp_ring_state.thread, NULL, qp_ring_drain_thread, NULL)) {
+        pthread_detach(qp_ring_state.thread);
+        qp_ring_state.thread_running = 1;
+    }
+#endif
+}
+
+/** Get the ring of the current thread, claiming or allocating it on first use */
+static inline struct qp_ring *qp_ring_get(void)
+{
+    struct qp_ring *ring = qp_ring_self;
+    size_t slot_size;
+
+    if (likely(ring))
+        return ring;
+
+    pthread_once(&qp_ring_state.once, qp_ring_init_once);
+    for (ring = QP_ATOMIC_LOAD_ACQUIRE(&qp_ring_state.list); ring; ring = ring->next) {
+        int expected = 0;
+        if (QP_ATOMIC_LOAD(&ring->in_use) == 0 &&
+                QP_ATOMIC_CAS(&ring->in_use, &expected, 1))
+            break;
+    }
+    if (!ring) {
+        slot_size = (sizeof(struct qp_ring_slot) + QP_RING_MSG_SIZE + 7) & ~7ul;
+        ring = (struct qp_ring *)calloc(1, sizeof(*ring) + QP_RING_SLOTS * slot_size);
+        if (!ring)
+            return NULL;
+        ring->in_use = 1;
+        ring->mask = QP_RING_SLOTS - 1;
+        ring->slot_size = slot_size;
+        ring->next = QP_ATOMIC_LOAD(&qp_ring_state.list);
+        while (!QP_ATOMIC_CAS(&qp_ring_state.list, &ring->next, ring))
+            ;
+    }
+    pthread_setspecific(qp_ring_state.key, ring);
+    qp_ring_self = ring;
+
+    return ring;
+}
+
+/** Reserve the next slot in the ring according to the overflow policy
+ *
+ * Returns NULL if the message should be dropped.
+ */
+static inline struct qp_ring_slot *qp_ring_reserve(struct qp_ring *ring)
+{
+    unsigned long head = ring->head;
+    unsigned long tail = QP_ATOMIC_LOAD_ACQUIRE(&ring->tail);
+
+    while (unlikely(head - tail > ring->mask)) {
+        int overflow = QP_ATOMIC_LOAD(&qp_ring_state.overflow);
+
+        if (overflow == QP_RING_OVERFLOW_DROP_OLD) {
+            if (QP_ATOMIC_CAS(&ring->tail, &tail, tail + 1)) {
+                QP_ATOMIC_STORE(&ring->dropped, ring->dropped + 1);
+                break;
+            }
+        } else if (overflow == QP_RING_OVERFLOW_BLOCK) {
+            if (qp_ring_state.thread_running)
+                sched_yield();
+            else
+                qp_ring_flush();
+            tail = QP_ATOMIC_LOAD_ACQUIRE(&ring->tail);
+        } else {
+            QP_ATOMIC_STORE(&ring->dropped, ring->dropped + 1);
+            return NULL;
+        }
+    }
+
+    return qp_ring_slot(ring, head);
+}
+
+/** Publish the message in the reserved slot, len may exceed the slot like the
+ *  return value of vsnprintf
+ */
+static inline void qp_ring_commit(struct qp_ring *ring, struct qp_ring_slot *slot, size_t len)
+{
+    size_t capacity = ring->slot_size - sizeof(*slot);
+
+    /* Truncated, end the line in place of the terminating NUL */
+    if (len >= capacity) {
+        slot->data[capacity - 1] = '\n';
+        len = capacity;
+    }
+    QP_ATOMIC_STORE(&slot->len, len);
+    QP_ATOMIC_STORE_RELEASE(&ring->head, ring->head + 1);
+}
+
+__attribute__((format(printf, 1, 2)))
+static inline int qp_ring_printf(const char *fmt, ...)
+{
+    struct qp_ring *ring = qp_ring_get();
+    struct qp_ring_slot *slot;
+    va_list args;
+    int ret;
+
+    if (unlikely(!ring))
+        return -ENOMEM;
+    slot = qp_ring_reserve(ring);
+    if (!slot)
+        return 0;
+    va_start(args, fmt);
+    ret = vsnprintf(slot->data, ring->slot_size - sizeof(*slot), fmt, args);
+    va_end(args);
+    if (ret < 0)
+        ret = 0;
+    qp_ring_commit(ring, slot, ret);
+
+    return ret;
+}
+
+/** Change output file descriptor for all rings (default is stderr) */
+static inline void qp_ring_set_fd(int fd)
+{
+    pthread_mutex_lock(&qp_ring_state.drain_lock);
+    qp_ring_state.fd = fd;
+    pthread_mutex_unlock(&qp_ring_state.drain_lock);
+}
+
+/** Change ring overflow policy, one of the QP_RING_OVERFLOW_* values */
+static inline void qp_ring_set_overflow(int overflow)
+{
+    QP_ATOMIC_STORE(&qp_ring_state.overflow, overflow);
+}
+#endif /* QP_PROJECT_GLIBC */
+
+/** Print implementation using per-thread rings and a background writer
+ *
+ * This only costs formatting into memory on the calling thread, the write
+ * syscalls are done by a drain thread which is started on first use. If the
+ * ring of a thread is full then #QP_RING_OVERFLOW decides what happens. Drop
+ * counters are reported in the output stream.
+ *
+ * If QP_RING_NO_DRAIN_THREAD is defined then output is only written by
+ * calling qp_ring_flush(). Pending output is also flushed at exit.
+ */
+#define QP_PRINT_IMPL_RING(str, ...) do { \
+        qp_ring_printf(str, ## __VA_ARGS__); \
+    } while (0)
+
 /** Print implementation using standard linux printk */
 #define QP_PRINT_IMPL_LINUX_KERNEL(str, ...) printk(str, ## __VA_ARGS__)
 /** Print implementation using linux trace_printk */
@@ -123,7 +599,11 @@
  */
 #ifdef QP_PRINT
     /* external */
+    #define QP__PRINT_EXTERNAL
 
+#elif defined(QP_BINLOG)
+    /* binary logging */
+    #define QP_PRINT QP_PRINT_IMPL_BINLOG
 #elif defined(__KERNEL__)
     /* kernel default */
     #define QP_PRINT QP_PRINT_IMPL_LINUX_KERNEL
@@ -175,12 +655,294 @@
     #define QP_PRINT_LOC_MARKER ""
 #endif
 
-#define QP_PRINT_LOC(str, ...) do { \
+/* Location header of QP_PRINT_LOC.
+ *
+ * The line number is part of the format string. In userspace the time header
+ * comes preformatted from qp_time_header(), so printf only copies strings.
+ */
+#if defined(QP_PROJECT_GLIBC) && QP_TIME_HEADER != QP_TIME_HEADER_NONE
+    #define QP__TIME_HEADER_CACHE 1
+    #define QP__LOC_HEADER_INI
+    #define QP__LOC_HEADER_FMT \
+        "%s" QP_PRINT_LOC_MARKER "%s(" QP__STRINGIFY(__LINE__) "): "
+    #define QP__LOC_HEADER_ARG \
+        qp_time_header(), __func__
+#else
+    #define QP__LOC_HEADER_INI QP_TIME_HEADER_INI
+    #define QP__LOC_HEADER_FMT \
+        QP_TIME_HEADER_FMT QP_PRINT_LOC_MARKER "%s(" QP__STRINGIFY(__LINE__) "): "
+    #define QP__LOC_HEADER_ARG \
+        QP_TIME_HEADER_ARG __func__
+#endif
+
+/** Static description of a print location.
+ *
+ * Sites are placed in the "qp_sites" linker section so that the full table
+ * can be enumerated at runtime between __start_qp_sites and __stop_qp_sites.
+ */
+struct qp_site {
+    const char *fmt;
+    const char *file;
+    const char *func;
+    unsigned int line;
+    unsigned int flags;
+    /* Bitmask of %s arguments, filled on first use by binary logging */
+    unsigned long long str_args;
+    /* 1 if enabled, 0 if disabled, -1 if not yet evaluated */
+    int enabled;
+} __attribute__((aligned(8)));
+
+/** Site format is preceded by a location header with func and line arguments */
+#define QP_SITE_LOC 1
+/** Site str_args has been computed */
+#define QP_SITE_STR_ARGS 2
+/** Site is enabled unless matched by a dynamic debug query */
+#define QP_SITE_DEFAULT_ON 4
+
+/** Initial state of sites with dynamic debug: disabled unless requested */
+#ifndef QP_DYNAMIC_DEBUG_DEFAULT
+    #define QP_DYNAMIC_DEBUG_DEFAULT 0
+#endif
+
+#ifdef QP_DYNAMIC_DEBUG
+    #define QP__SITE_ENABLED_INIT -1
+    #define QP__SITE_DEFAULT_FLAGS (QP_DYNAMIC_DEBUG_DEFAULT ? QP_SITE_DEFAULT_ON : 0)
+    /** Check if a site is enabled, costs one branch when disabled */
+    #define QP_SITE_ENABLED(site) ({ \
+            int qp_site_enabled = QP_ATOMIC_LOAD(&(site)->enabled); \
+            likely(qp_site_enabled > 0) ? 1 : \
+            likely(qp_site_enabled == 0) ? 0 : \
+            qp_dyndbg_site_init(site); \
+        })
+#else
+    #define QP__SITE_ENABLED_INIT 1
+    #define QP__SITE_DEFAULT_FLAGS QP_SITE_DEFAULT_ON
+    #define QP_SITE_ENABLED(site) 1
+#endif
+
+#define QP__SITE_DEFINE(name, str, site_flags) \
+        static struct qp_site name \
+        __attribute__((section("qp_sites"), used, aligned(8))) = { \
+            .fmt = (str), \
+            .file = __FILE__, \
+            .func = __func__, \
+            .line = __LINE__, \
+            .flags = (site_flags) | QP__SITE_DEFAULT_FLAGS, \
+            .enabled = QP__SITE_ENABLED_INIT, \
+        }
+
+extern struct qp_site __start_qp_sites[] __attribute__((weak));
+extern struct qp_site __stop_qp_sites[] __attribute__((weak));
+
+/* Structured output.
+ *
+ * With QP_OUTPUT_FORMAT set to QP_OUTPUT_LOGFMT or QP_OUTPUT_JSON every
+ * QP_PRINT_LOC becomes one record with fixed fields: "ts" (only with a time
+ * header, in seconds), "func" and "line", then the fields of the macro and
+ * the formatted message as "msg". Ratelimit and profile reports, QP_DUMP_VAR
+ * and the QP_DUMP_*_HDR network dumps emit their values as separate fields,
+ * the field parts of their formats are concatenated at compile time with
+ * #QP_KV and #QP_KV_STR. Only the message is escaped at runtime. Multi-line
+ * dumps assembled with QP_LINE_PRINT stay human-readable.
+ */
+#define QP_OUTPUT_HUMAN 0
+#define QP_OUTPUT_LOGFMT 1
+#define QP_OUTPUT_JSON 2
+
+/** Output format of QP_PRINT_LOC records */
+#ifndef QP_OUTPUT_FORMAT
+    #define QP_OUTPUT_FORMAT QP_OUTPUT_HUMAN
+#endif
+
+#if QP_OUTPUT_FORMAT != QP_OUTPUT_HUMAN && defined(QP_BINLOG)
+    #error "QP_BINLOG records are formatted by qpdecode, QP_OUTPUT_FORMAT must be QP_OUTPUT_HUMAN"
+#endif
+
+/** Size of one formatted structured record, longer records are truncated */
+#ifndef QP_REC_SIZE
+    #ifdef QP_PROJECT_LINUX_KERNEL
+        #define QP_REC_SIZE 256
+    #else
+        #define QP_REC_SIZE 1024
+    #endif
+#endif
+
+#if QP_TIME_HEADER == QP_TIME_HEADER_5_6
+    #define QP__REC_TS_FMT "%lu.%06lu"
+#elif QP_TIME_HEADER == QP_TIME_HEADER_4_3
+    #define QP__REC_TS_FMT "%lu.%03lu"
+#endif
+
+/** Separates the fields of a structured record from its message */
+#define QP__REC_MSG_SEP "\036"
+
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_JSON
+    /** Numeric field, fmt must print a JSON number (or true/false) */
+    #define QP_KV(key, fmt) ",\"" key "\":" fmt
+    /** String field, fmt must not print quotes or backslashes */
+    #define QP_KV_STR(key, fmt) ",\"" key "\":\"" fmt "\""
+    #ifdef QP__REC_TS_FMT
+        #define QP__REC_HEAD_FMT "{\"ts\":" QP__REC_TS_FMT ",\"func\":\"%s\",\"line\":%d"
+    #else
+        #define QP__REC_HEAD_FMT "{\"func\":\"%s\",\"line\":%d"
+    #endif
+#else
+    #define QP_KV(key, fmt) " " key "=" fmt
+    #define QP_KV_STR(key, fmt) " " key "=\"" fmt "\""
+    #ifdef QP__REC_TS_FMT
+        #define QP__REC_HEAD_FMT "ts=" QP__REC_TS_FMT " func=%s line=%d"
+    #else
+        #define QP__REC_HEAD_FMT "func=%s line=%d"
+    #endif
+#endif
+
+#if QP_OUTPUT_FORMAT != QP_OUTPUT_HUMAN
+/** Append c to a quoted value, returns 0 if it does not fit */
+static inline int qp_rec_put_escaped(char **pos, char *end, char c)
+{
+    static const char hex[] = "0123456789abcdef";
+    char esc = c == '\n' ? 'n' : c == '\t' ? 't' : c == '\r' ? 'r' :
+            c == '"' || c == '\\' ? c : 0;
+    char *p = *pos;
+
+    if (esc || (unsigned char)c < 0x20) {
+        if (end - p < (esc ? 2 : 6))
+            return 0;
+        *p++ = '\\';
+        if (esc) {
+            *p++ = esc;
+        } else {
+            memcpy(p, "u00", 3);
+            p[3] = hex[(unsigned char)c >> 4];
+            p[4] = hex[c & 0xf];
+            p += 5;
+        }
+    } else {
+        if (end - p < 1)
+            return 0;
+        *p++ = c;
+    }
+    *pos = p;
+
+    return 1;
+}
+
+/** Turn "head fields QP__REC_MSG_SEP message" into a record.
+ *
+ * The message is added as field key after removing trailing newlines and
+ * escaping it. The record always ends with the closing brace (JSON) and a
+ * newline, even if it had to be truncated.
+ */
+static inline void qp_rec_finish(const char *buf, const char *key, char *out, size_t size)
+{
+    const char *msg = strchr(buf, QP__REC_MSG_SEP[0]);
+    size_t head_len = msg ? (size_t)(msg - buf) : strlen(buf);
+    size_t msg_len = 0, key_len = strlen(key);
+    /* Closing quote, brace, newline and NUL */
+    char *end = out + size - 4;
+    char *pos = out;
+
+    if (msg) {
+        ++msg;
+        msg_len = strlen(msg);
+        while (msg_len && msg[msg_len - 1] == '\n')
+            --msg_len;
+    }
+    if (head_len > (size_t)(end - pos))
+        head_len = end - pos;
+    memcpy(pos, buf, head_len);
+    pos += head_len;
+    if (msg_len && (size_t)(end - pos) > key_len + 4) {
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_JSON
+        pos += sprintf(pos, ",\"%s\":\"", key);
+#else
+        pos += sprintf(pos, " %s=\"", key);
+#endif
+        while (msg_len-- && qp_rec_put_escaped(&pos, end, *msg))
+            ++msg;
+        *pos++ = '"';
+    }
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_JSON
+    *pos++ = '}';
+#endif
+    *pos++ = '\n';
+    *pos = '\0';
+}
+
+/* Print a structured record, the message is added as field key */
+#define QP__PRINT_REC(fields, key, str, ...) do { \
+        char qp_rec_buf[QP_REC_SIZE]; \
+        char qp_rec_out[QP_REC_SIZE]; \
         QP_TIME_HEADER_INI \
-        QP_PRINT(QP_TIME_HEADER_FMT QP_PRINT_LOC_MARKER "%s(%d): " str, \
+        snprintf(qp_rec_buf, sizeof(qp_rec_buf), \
+                QP__REC_HEAD_FMT fields QP__REC_MSG_SEP str, \
                 QP_TIME_HEADER_ARG \
                 __func__, __LINE__, ## __VA_ARGS__); \
+        qp_rec_finish(qp_rec_buf, key, qp_rec_out, sizeof(qp_rec_out)); \
+        QP_PRINT("%s", qp_rec_out); \
     } while (0)
+#endif
+
+/* Print for a specific site, the site is only used by binary logging. */
+#ifdef QP_BINLOG
+    #define QP__PRINT_LOC_SITE(site, str, ...) QP_BINLOG_WRITE(site, __VA_ARGS__)
+#elif QP_OUTPUT_FORMAT != QP_OUTPUT_HUMAN
+    #define QP__PRINT_LOC_SITE(site, str, ...) \
+            QP__PRINT_REC("", "msg", str, ## __VA_ARGS__)
+#else
+    #define QP__PRINT_LOC_SITE(site, str, ...) do { \
+            QP__LOC_HEADER_INI \
+            QP_PRINT(QP__LOC_HEADER_FMT str, \
+                    QP__LOC_HEADER_ARG, ## __VA_ARGS__); \
+        } while (0)
+#endif
+
+/** Print with a "func(line): " header
+ *
+ * With QP_DYNAMIC_DEBUG or QP_BINLOG each location is described by a static
+ * #qp_site. Dynamic debug allows enabling and disabling individual sites at
+ * runtime, see qp_dyndbg_control().
+ */
+#if defined(QP_BINLOG) || defined(QP_DYNAMIC_DEBUG)
+    #define QP_PRINT_LOC(str, ...) do { \
+            QP__SITE_DEFINE(qp_loc_site, QP_PRINT_LOC_MARKER "%s(%d): " str, QP_SITE_LOC); \
+            if (QP_SITE_ENABLED(&qp_loc_site)) \
+                QP__PRINT_LOC_SITE(&qp_loc_site, str, ## __VA_ARGS__); \
+        } while (0)
+#else
+    #define QP_PRINT_LOC(str, ...) QP__PRINT_LOC_SITE(NULL, str, ## __VA_ARGS__)
+#endif
+
+/** Print values with QP_PRINT_LOC, as the fields of a structured record
+ *
+ * human is used for QP_OUTPUT_HUMAN, fields is made of #QP_KV and
+ * #QP_KV_STR with the same conversions in the same order. The message str
+ * and its arguments follow the field arguments.
+ */
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_HUMAN
+    #define QP_PRINT_FIELDS_MSG(human, fields, str, ...) \
+            QP_PRINT_LOC(human str, ## __VA_ARGS__)
+    /* Only structured records include str, as field key */
+    #define QP__PRINT_FIELDS_KEY(human, fields, key, str, ...) \
+            QP_PRINT_LOC(human, ## __VA_ARGS__)
+#elif defined(QP_DYNAMIC_DEBUG)
+    #define QP__PRINT_FIELDS_KEY(human, fields, key, str, ...) do { \
+            QP__SITE_DEFINE(qp_loc_site, QP_PRINT_LOC_MARKER "%s(%d): " human str, QP_SITE_LOC); \
+            if (QP_SITE_ENABLED(&qp_loc_site)) \
+                QP__PRINT_REC(fields, key, str, ## __VA_ARGS__); \
+        } while (0)
+#else
+    #define QP__PRINT_FIELDS_KEY(human, fields, key, str, ...) \
+            QP__PRINT_REC(fields, key, str, ## __VA_ARGS__)
+#endif
+#if QP_OUTPUT_FORMAT != QP_OUTPUT_HUMAN
+    #define QP_PRINT_FIELDS_MSG(human, fields, str, ...) \
+            QP__PRINT_FIELDS_KEY(human, fields, "msg", str, ## __VA_ARGS__)
+#endif
+
+/** #QP_PRINT_FIELDS_MSG without message, human must end with a newline */
+#define QP_PRINT_FIELDS(human, fields, ...) \
+        QP_PRINT_FIELDS_MSG(human, fields, "", ## __VA_ARGS__)
 
 /** Print source code location without any other message. */
 #define QP_TRACE() QP_PRINT_LOC("trace" QP_NL)
@@ -205,6 +967,272 @@
             QP_PRINT_LOC(__VA_ARGS__); \
     } while (0)
 
+/* Line assembly.
+ *
+ * Output made of several pieces per line (like hex dumps) is collected in a
+ * per-thread buffer and passed to QP_PRINT one record at a time, so that it
+ * costs one write instead of one per piece and lines from different threads
+ * do not interleave. A record is emitted when a newline is appended, when the
+ * buffer is full or on QP_LINE_FLUSH. Between QP_LINE_HOLD and QP_LINE_FLUSH
+ * newlines do not emit, so a whole multi-line dump becomes a single record.
+ *
+ * The buffer belongs to the translation unit, so it is always emitted through
+ * the QP_PRINT of the file which assembled it. Output left unterminated when
+ * a thread exits is printed with #QP_LINE_EXIT_PRINT.
+ *
+ * The kernel and binary logging pass every piece straight to QP_PRINT.
+ */
+#ifndef QP_LINE_ASSEMBLY
+    #if defined(QP_PROJECT_GLIBC) && !defined(QP_BINLOG)
+        #define QP_LINE_ASSEMBLY 1
+    #else
+        #define QP_LINE_ASSEMBLY 0
+    #endif
+#endif
+
+/** Size of the per-thread line buffer, longer records use the heap */
+#ifndef QP_LINE_SIZE
+    #define QP_LINE_SIZE 4096
+#endif
+
+/** Print leftovers of the line buffer at thread exit.
+ *
+ * This runs outside of any QP macro so it can't use a QP_PRINT which refers
+ * to local variables. Defaults to QP_PRINT unless it was defined externally.
+ */
+#ifndef QP_LINE_EXIT_PRINT
+    #ifdef QP__PRINT_EXTERNAL
+        #define QP_LINE_EXIT_PRINT QP_PRINT_IMPL_STDERR
+    #else
+        #define QP_LINE_EXIT_PRINT QP_PRINT
+    #endif
+#endif
+
+#if QP_LINE_ASSEMBLY
+struct qp_line {
+    /* Assembled length and length of the record ready to be emitted */
+    size_t len;
+    size_t flush_len;
+    int hold;
+    /* The exit key points to this buffer */
+    int exit_set;
+    /* Replaces buf while a record is too long for it */
+    char *heap;
+    char buf[QP_LINE_SIZE];
+};
+
+/* Static: every file has its own QP_PRINT */
+static __thread struct qp_line qp_line_self __attribute__((unused));
+
+static struct {
+    pthread_once_t once;
+    pthread_key_t key;
+} qp_line_exit_key __attribute__((unused)) = {
+    .once = PTHREAD_ONCE_INIT,
+};
+
+/** Print and drop unterminated output of an exiting thread */
+static inline void qp_line_exit(void *arg)
+{
+    struct qp_line *line = (struct qp_line *)arg;
+
+    if (line->len)
+        QP_LINE_EXIT_PRINT("%.*s", (int)line->len, line->buf);
+    line->len = 0;
+    line->hold = 0;
+}
+
+/* exit() does not run key destructors for the calling thread */
+static inline void qp_line_atexit(void)
+{
+    qp_line_exit(&qp_line_self);
+}
+
+static inline void qp_line_exit_key_init_once(void)
+{
+    pthread_key_create(&qp_line_exit_key.key, qp_line_exit);
+    atexit(qp_line_atexit);
+}
+
+static inline void qp_line_exit_set(void)
+{
+    pthread_once(&qp_line_exit_key.once, qp_line_exit_key_init_once);
+    pthread_setspecific(qp_line_exit_key.key, &qp_line_self);
+    qp_line_self.exit_set = 1;
+}
+
+/** Assembled data of the calling thread */
+static inline const char *qp_line_data(void)
+{
+    return qp_line_self.heap ? qp_line_self.heap : qp_line_self.buf;
+}
+
+static inline const char *qp_line_last_nl(const char *buf, size_t len)
+{
+    while (len--)
+        if (buf[len] == '\n')
+            return buf + len;
+    return NULL;
+}
+
+/** Append formatted output, returns 1 if a record is ready for QP_PRINT */
+static inline int qp_line_vappend(const char *fmt, va_list args)
+{
+    struct qp_line *line = &qp_line_self;
+    size_t start = line->len;
+    const char *nl;
+    va_list copy;
+    int ret;
+
+    if (unlikely(!line->exit_set))
+        qp_line_exit_set();
+    va_copy(copy, args);
+    ret = vsnprintf(line->buf + start, sizeof(line->buf) - start, fmt, copy);
+    va_end(copy);
+    if (ret < 0)
+        return 0;
+
+    if (start + ret < sizeof(line->buf)) {
+        line->len += ret;
+        if (line->hold)
+            return 0;
+        nl = qp_line_last_nl(line->buf + start, ret);
+        if (!nl)
+            return 0;
+        line->flush_len = nl - line->buf + 1;
+        return 1;
+    }
+
+    /* Buffer full: emit everything up to the last newline */
+    line->heap = malloc(start + ret + 1);
+    if (!line->heap) {
+        line->len = line->flush_len = sizeof(line->buf) - 1;
+        return 1;
+    }
+    memcpy(line->heap, line->buf, start);
+    vsnprintf(line->heap + start, ret + 1, fmt, args);
+    line->len += ret;
+    nl = qp_line_last_nl(line->heap, line->len);
+    if (nl && line->len - (nl - line->heap + 1) < sizeof(line->buf))
+        line->flush_len = nl - line->heap + 1;
+    else
+        line->flush_len = line->len;
+
+    return 1;
+}
+
+static inline int qp_line_append(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static inline int qp_line_append(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = qp_line_vappend(fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+/** Drop the record returned by qp_line_data after it was printed */
+static inline void qp_line_consume(void)
+{
+    struct qp_line *line = &qp_line_self;
+
+    line->len -= line->flush_len;
+    memmove(line->buf, qp_line_data() + line->flush_len, line->len);
+    line->flush_len = 0;
+    free(line->heap);
+    line->heap = NULL;
+}
+
+#define QP__LINE_EMIT() do { \
+        QP_PRINT("%.*s", (int)qp_line_self.flush_len, qp_line_data()); \
+        qp_line_consume(); \
+    } while (0)
+
+/** Append to the line of the current thread, like QP_PRINT(QP_CONT str) */
+#define QP_LINE_PRINT(str, ...) do { \
+        if (qp_line_append(str, ## __VA_ARGS__)) \
+            QP__LINE_EMIT(); \
+    } while (0)
+
+/** Start collecting a multi-line record */
+#define QP_LINE_HOLD() do { \
+        qp_line_self.hold = 1; \
+    } while (0)
+
+/** Emit anything assembled so far and end QP_LINE_HOLD */
+#define QP_LINE_FLUSH() do { \
+        qp_line_self.hold = 0; \
+        if (qp_line_self.len) { \
+            qp_line_self.flush_len = qp_line_self.len; \
+            QP__LINE_EMIT(); \
+        } \
+    } while (0)
+
+#define QP__LINE_PRINT_LOC(str, ...) do { \
+        QP__LOC_HEADER_INI \
+        QP_LINE_PRINT(QP__LOC_HEADER_FMT str, \
+                QP__LOC_HEADER_ARG, ## __VA_ARGS__); \
+    } while (0)
+
+/** Start a line with a "func(line): " header, like QP_PRINT_LOC
+ *
+ * Dynamic debug only gates this header, dumps with a body use the
+ * QP__DUMP_SITE_* macros below instead.
+ */
+#ifdef QP_DYNAMIC_DEBUG
+    #define QP_LINE_PRINT_LOC(str, ...) do { \
+            QP__SITE_DEFINE(qp_loc_site, QP_PRINT_LOC_MARKER "%s(%d): " str, QP_SITE_LOC); \
+            if (QP_SITE_ENABLED(&qp_loc_site)) \
+                QP__LINE_PRINT_LOC(str, ## __VA_ARGS__); \
+        } while (0)
+#else
+    #define QP_LINE_PRINT_LOC(str, ...) QP__LINE_PRINT_LOC(str, ## __VA_ARGS__)
+#endif
+#else
+    #define QP_LINE_PRINT(str, ...) QP_PRINT(QP_CONT str, ## __VA_ARGS__)
+    #define QP_LINE_PRINT_LOC(str, ...) QP_PRINT_LOC(str, ## __VA_ARGS__)
+    #define QP_LINE_HOLD() do { } while (0)
+    #define QP_LINE_FLUSH() do { } while (0)
+#endif /* QP_LINE_ASSEMBLY */
+
+/* Multi-part dumps.
+ *
+ * A dump made of a header and body lines is described by a single site which
+ * is declared first in its do { } while (0). With dynamic debug
+ * QP__DUMP_SITE_CHECK skips the whole dump when that site is disabled, the
+ * header is then printed for the same site by QP__DUMP_PRINT_LOC or
+ * QP__DUMP_LINE_PRINT_LOC.
+ */
+#if defined(QP_BINLOG) || defined(QP_DYNAMIC_DEBUG)
+    #define QP__DUMP_SITE_DECLARE(str) \
+        struct qp_site *qp_dump_site __attribute__((unused)) = ({ \
+            QP__SITE_DEFINE(qp_dump_loc_site, QP_PRINT_LOC_MARKER "%s(%d): " str, QP_SITE_LOC); \
+            &qp_dump_loc_site; \
+        })
+#else
+    #define QP__DUMP_SITE_DECLARE(str) \
+        struct qp_site *qp_dump_site __attribute__((unused)) = NULL
+#endif
+
+/* Leave the enclosing do { } while (0) if the dump site is disabled */
+#define QP__DUMP_SITE_CHECK() \
+        if (!QP_SITE_ENABLED(qp_dump_site)) \
+            break
+
+#define QP__DUMP_PRINT_LOC(str, ...) \
+        QP__PRINT_LOC_SITE(qp_dump_site, str, ## __VA_ARGS__)
+
+#if QP_LINE_ASSEMBLY
+    #define QP__DUMP_LINE_PRINT_LOC(str, ...) QP__LINE_PRINT_LOC(str, ## __VA_ARGS__)
+#else
+    #define QP__DUMP_LINE_PRINT_LOC(str, ...) QP__DUMP_PRINT_LOC(str, ## __VA_ARGS__)
+#endif
+
 #ifdef QP_PROJECT_LINUX_KERNEL
     #if !defined(LINUX_VERSION_CODE)
         #warning Defined __KERNEL__ but no LINUX_VERSION_CODE, please include <linux/version.h>
@@ -214,6 +1242,38 @@
     #endif
 #endif
 
+/* Timebase selection for #QP_NANOTIME_NOW and #QP_MILITIME_NOW: */
+#define QP_TIMEBASE_MONOTONIC 1
+#define QP_TIMEBASE_MONOTONIC_RAW 2
+#define QP_TIMEBASE_REALTIME 3
+#define QP_TIMEBASE_TSC 4
+
+/** Clock used for timestamps and profiling
+ *
+ * - QP_TIMEBASE_MONOTONIC: clock_gettime(CLOCK_MONOTONIC), served by the vDSO
+ * - QP_TIMEBASE_MONOTONIC_RAW: not subject to NTP frequency adjustment
+ * - QP_TIMEBASE_REALTIME: wall clock, can step backwards
+ * - QP_TIMEBASE_TSC: rdtscp calibrated against CLOCK_MONOTONIC at startup,
+ *      falls back to CLOCK_MONOTONIC without an invariant TSC
+ *
+ * The kernel always uses ktime, which is already TSC-based where possible.
+ */
+#ifndef QP_TIMEBASE
+    #define QP_TIMEBASE QP_TIMEBASE_MONOTONIC
+#endif
+
+#if QP_TIMEBASE == QP_TIMEBASE_MONOTONIC_RAW
+    #define QP_TIMEBASE_CLOCK CLOCK_MONOTONIC_RAW
+#elif QP_TIMEBASE == QP_TIMEBASE_REALTIME
+    #define QP_TIMEBASE_CLOCK CLOCK_REALTIME
+#else
+    #define QP_TIMEBASE_CLOCK CLOCK_MONOTONIC
+#endif
+
+#if QP_TIMEBASE == QP_TIMEBASE_TSC && !defined(__x86_64__)
+    #warning QP_TIMEBASE_TSC is only supported on x86_64, using CLOCK_MONOTONIC
+#endif
+
 /* Milisecond timing: */
 #define QP_MILITIME_NOW_ktime() ({ \
         u64 _nowns = ktime_get_ns(); \
@@ -228,11 +1288,7 @@
     #define QP_MILITIME_NOW() (((jiffies) * 1000) / HZ)
 #else
     /* userspace default */
-    #define QP_MILITIME_NOW() ({ \
-            struct timeval tv; \
-            gettimeofday(&tv, 0); \
-            ((QP_MILITIME_T)tv.tv_sec * 1000lu + (tv.tv_usec / 1000)); \
-    })
+    #define QP_MILITIME_NOW() ((QP_MILITIME_T)(QP_NANOTIME_NOW() / 1000000))
 #endif
 
 #ifndef QP_MILITIME_T
@@ -247,60 +1303,858 @@
         #include <linux/hrtimer.h>
     #endif
     #define QP_NANOTIME_T s64
-    /* Based on generic ktime. */
-    #define QP_NANOTIME_NOW() (ktime_to_ns(ktime_get_real()))
+    #if QP_KERNEL_VERSION_OLDER_THAN(3, 17, 0)
+        #define QP_NANOTIME_NOW() (ktime_to_ns(ktime_get()))
+    #elif QP_TIMEBASE == QP_TIMEBASE_MONOTONIC_RAW
+        #define QP_NANOTIME_NOW() ((s64)ktime_get_raw_ns())
+    #elif QP_TIMEBASE == QP_TIMEBASE_REALTIME
+        #define QP_NANOTIME_NOW() ((s64)ktime_get_real_ns())
+    #else
+        #define QP_NANOTIME_NOW() ((s64)ktime_get_ns())
+    #endif
 #else
     #define QP_NANOTIME_T unsigned long long
     /* userspace default */
-    #define QP_NANOTIME_NOW() ({ \
-            struct timeval tv; \
-            gettimeofday(&tv, NULL); \
-            (((QP_NANOTIME_T)tv.tv_sec) * 1000000000LLU + (tv.tv_usec * 1000LLU)); \
+    #define QP_NANOTIME_NOW_CLOCK() ({ \
+            struct timespec _ts; \
+            clock_gettime(QP_TIMEBASE_CLOCK, &_ts); \
+            (((QP_NANOTIME_T)_ts.tv_sec) * 1000000000LLU + _ts.tv_nsec); \
     })
+    #if QP_TIMEBASE == QP_TIMEBASE_TSC && defined(__x86_64__)
+        #define QP_NANOTIME_NOW() qp_tsc_nanotime()
+    #else
+        #define QP_NANOTIME_NOW() QP_NANOTIME_NOW_CLOCK()
+    #endif
 #endif
 
 #ifndef QP_NANOTIME_T
 #define QP_NANOTIME_T unsigned long
 #endif
 
-#ifdef QP_NO_LOCKS
-    /* Nothing .*/
-#elif defined(__KERNEL__)
-    #if !defined(CONFIG_SMP)
-        #define QP_NO_LOCKS
-    #elif defined(DEFINE_SPINLOCK)
-        #define QP_LOCK_DEFINE(lock) DEFINE_SPINLOCK((lock))
-    #elif defined(SPIN_LOCK_UNLOCKED)
-        #define QP_LOCK_DEFINE(lock) spinlock_t lock = SPIN_LOCK_UNLOCKED
-    #else
-        #warning Kernel spinlocks not supported
-        #define QP_NO_LOCKS
-    #endif
+#if defined(QP_PROJECT_GLIBC) && defined(__x86_64__)
+/* TSC timebase.
+ *
+ * Ticks are converted as ns = base_ns + ((tsc - base_tsc) * mult >> shift),
+ * with mult and shift measured against CLOCK_MONOTONIC over
+ * #QP_TSC_CALIBRATE_US at startup. This is only accurate if the TSC is
+ * invariant (constant rate across frequency changes and idle states), which
+ * is checked with cpuid. Otherwise CLOCK_MONOTONIC is used directly.
+ */
 
-    #ifndef QP_NO_LOCKS
-        #define QP_LOCK(lock) unsigned long flags##lock; spin_lock_irqsave(&lock, flags##lock)
-        #define QP_UNLOCK(lock) spin_unlock_irqrestore(&lock, flags##lock)
-    #endif
-#elif defined(_POSIX_THREADS)
-    #define QP_LOCK_DEFINE(lock) pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER
-    #define QP_LOCK(lock) pthread_mutex_lock(&lock)
-    #define QP_UNLOCK(lock) pthread_mutex_unlock(&lock)
-#elif !defined(QP_LOCK_DEFINE)
-    //#warning "locking not supported"
-    #define QP_NO_LOCKS
+/** Duration of TSC calibration */
+#ifndef QP_TSC_CALIBRATE_US
+    #define QP_TSC_CALIBRATE_US 10000
 #endif
 
-#ifdef QP_NO_LOCKS
-    #define QP_LOCK_DEFINE(lock) struct { } lock __attribute__((unused))
-    #define QP_LOCK(lock)
-    #define QP_UNLOCK(lock)
+#define QP_TSC_SHIFT 24
+
+struct qp_tsc_state {
+    pthread_once_t once;
+    /* 1 if TSC is usable, -1 for fallback, 0 before calibration */
+    int state;
+    unsigned int mult;
+    unsigned long long base_tsc;
+    unsigned long long base_ns;
+};
+
+QP_GLOBAL struct qp_tsc_state qp_tsc_state = {
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static inline unsigned long long qp_tsc_read(void)
+{
+    unsigned int aux;
+
+    return __builtin_ia32_rdtscp(&aux);
+}
+
+/** Check cpuid for invariant TSC and rdtscp */
+static inline int qp_tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    __asm__ __volatile__("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (0x80000000), "c" (0));
+    if (eax < 0x80000007)
+        return 0;
+    __asm__ __volatile__("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (0x80000001), "c" (0));
+    if (!(edx & (1u << 27)))
+        return 0;
+    __asm__ __volatile__("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (0x80000007), "c" (0));
+    return !!(edx & (1u << 8));
+}
+
+static inline void qp_tsc_calibrate(void)
+{
+    unsigned long long tsc0, tsc1, ns0, ns1;
+    unsigned __int128 mult;
+
+    if (getenv("QP_TSC_DISABLE") || !qp_tsc_invariant()) {
+        QP_ATOMIC_STORE_RELEASE(&qp_tsc_state.state, -1);
+        return;
+    }
+    ns0 = QP_NANOTIME_NOW_CLOCK();
+    tsc0 = qp_tsc_read();
+    usleep(QP_TSC_CALIBRATE_US);
+    ns1 = QP_NANOTIME_NOW_CLOCK();
+    tsc1 = qp_tsc_read();
+    mult = ((unsigned __int128)(ns1 - ns0) << QP_TSC_SHIFT) / (tsc1 - tsc0 ?: 1);
+    if (tsc1 <= tsc0 || !mult || mult > 0xffffffffu) {
+        QP_ATOMIC_STORE_RELEASE(&qp_tsc_state.state, -1);
+        return;
+    }
+    qp_tsc_state.mult = mult;
+    qp_tsc_state.base_tsc = tsc1;
+    qp_tsc_state.base_ns = ns1;
+    QP_ATOMIC_STORE_RELEASE(&qp_tsc_state.state, 1);
+}
+
+static inline unsigned long long qp_tsc_nanotime(void)
+{
+    int state = QP_ATOMIC_LOAD_ACQUIRE(&qp_tsc_state.state);
+
+    if (unlikely(!state)) {
+        pthread_once(&qp_tsc_state.once, qp_tsc_calibrate);
+        state = QP_ATOMIC_LOAD_ACQUIRE(&qp_tsc_state.state);
+    }
+    if (likely(state > 0))
+        return qp_tsc_state.base_ns + (unsigned long long)(
+                ((unsigned __int128)(qp_tsc_read() - qp_tsc_state.base_tsc) *
+                 qp_tsc_state.mult) >> QP_TSC_SHIFT);
+
+    return QP_NANOTIME_NOW_CLOCK();
+}
+
+#if QP_TIMEBASE == QP_TIMEBASE_TSC
+/* Calibrate before main rather than on the first timed region */
+__attribute__((constructor)) static void qp_tsc_init(void)
+{
+    pthread_once(&qp_tsc_state.once, qp_tsc_calibrate);
+}
 #endif
+#endif /* QP_PROJECT_GLIBC && __x86_64__ */
 
-#ifndef unlikely
-    #define unlikely(x) __builtin_expect(!!(x), 0)
+/* Decimal formatting.
+ *
+ * Digits are written backwards from the end of a buffer, two at a time with
+ * a digit pair lookup table.
+ */
+static const char qp_dec_pairs[] __attribute__((unused)) =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+/** Write the last width decimal digits of val, zero padded, ending before end */
+static inline void qp_fmt_dec_pad(char *end, unsigned long val, unsigned int width)
+{
+    for (; width >= 2; width -= 2) {
+        end -= 2;
+        memcpy(end, &qp_dec_pairs[val % 100 * 2], 2);
+        val /= 100;
+    }
+    if (width)
+        *--end = '0' + val % 10;
+}
+
+/** Write val in decimal ending before end, returns the first digit */
+static inline char *qp_fmt_dec(char *end, unsigned long long val)
+{
+    unsigned int rem;
+
+    while (val >= 100) {
+#ifdef QP_PROJECT_LINUX_KERNEL
+        rem = do_div(val, 100);
+#else
+        rem = val % 100;
+        val /= 100;
 #endif
-#ifndef likely
-    #define likely(x) __builtin_expect(!!(x), 1)
+        end -= 2;
+        memcpy(end, &qp_dec_pairs[rem * 2], 2);
+    }
+    if (val >= 10) {
+        end -= 2;
+        memcpy(end, &qp_dec_pairs[val * 2], 2);
+    } else {
+        *--end = '0' + val;
+    }
+
+    return end;
+}
+
+#ifdef QP__TIME_HEADER_CACHE
+/* Time header formatting.
+ *
+ * The text of the time header is kept per thread and only reformatted when
+ * the millisecond changes. With QP_TIME_HEADER_5_6 the microsecond digits are
+ * patched in on every call. The result is the same as QP_TIME_HEADER_FMT.
+ */
+#if QP_TIME_HEADER == QP_TIME_HEADER_5_6
+    #define QP__TIME_HEADER_SEC_DIGITS 5
+    #define QP__TIME_HEADER_SUB_DIGITS 6
+    #define QP__TIME_HEADER_SELF qp_time_header_5_6_self
+#else
+    #define QP__TIME_HEADER_SEC_DIGITS 4
+    #define QP__TIME_HEADER_SUB_DIGITS 3
+    #define QP__TIME_HEADER_SELF qp_time_header_4_3_self
+#endif
+
+struct qp_time_header {
+    unsigned long msec;
+    char text[16];
+};
+
+/* One per format, files built with different settings can share a program */
+QP_GLOBAL __thread struct qp_time_header QP__TIME_HEADER_SELF;
+
+/** Time header text of the calling thread for the current time */
+static inline const char *qp_time_header(void)
+{
+    struct qp_time_header *hdr = &QP__TIME_HEADER_SELF;
+    char *sub = hdr->text + 2 + QP__TIME_HEADER_SEC_DIGITS;
+#if QP_TIME_HEADER == QP_TIME_HEADER_5_6
+    unsigned long usec = ((unsigned long)QP_NANOTIME_NOW()) / 1000;
+    unsigned long msec = usec / 1000;
+#else
+    unsigned long msec = QP_MILITIME_NOW();
+#endif
+
+    if (unlikely(msec != hdr->msec || !hdr->text[0])) {
+        hdr->msec = msec;
+        hdr->text[0] = '[';
+        qp_fmt_dec_pad(sub - 1, msec / 1000, QP__TIME_HEADER_SEC_DIGITS);
+        sub[-1] = '.';
+        qp_fmt_dec_pad(sub + 3, msec, 3);
+        sub[QP__TIME_HEADER_SUB_DIGITS] = ']';
+        sub[QP__TIME_HEADER_SUB_DIGITS + 1] = ' ';
+    }
+#if QP_TIME_HEADER == QP_TIME_HEADER_5_6
+    qp_fmt_dec_pad(sub + 6, usec, 3);
+#endif
+
+    return hdr->text;
+}
+#endif /* QP__TIME_HEADER_CACHE */
+
+#ifdef QP_PROJECT_GLIBC
+/* Deferred binary logging.
+ *
+ * Instead of formatting, each print stores the index of its #qp_site, a
+ * nanosecond timestamp and the raw bytes of its arguments into the per-thread
+ * ring used by #QP_PRINT_IMPL_RING. The output file starts with a copy of the
+ * site table so that the "qpdecode" tool can do all the formatting offline.
+ *
+ * File layout (native byte order):
+ * - struct qp_binlog_file_hdr
+ * - nsites entries of struct qp_binlog_site_hdr each followed by the fmt,
+ *   file and func strings (not NUL-terminated)
+ * - records: struct qp_binlog_rec_hdr followed by arguments
+ *
+ * Each argument starts with one byte containing QP_BINLOG_ARG_* in the high
+ * nibble and log2 of the size in the low nibble, followed by the raw bytes.
+ * Arguments consumed by %s are copied by value instead: QP_BINLOG_ARG_STR is
+ * followed by a 16-bit length and the characters.
+ */
+
+#define QP_BINLOG_MAGIC "QPBINLOG"
+#define QP_BINLOG_VERSION 1
+
+#define QP_BINLOG_ARG_INT 1
+#define QP_BINLOG_ARG_REAL 2
+#define QP_BINLOG_ARG_PTR 3
+#define QP_BINLOG_ARG_STR 4
+
+/** Record flag: not all arguments fit in QP_RING_MSG_SIZE */
+#define QP_BINLOG_REC_TRUNCATED 1
+
+/** Site index used for ring drop reports (two INT arguments) */
+#define QP_BINLOG_SITE_DROPS 0xffffffffu
+
+/** Output file name, can be overridden with the QP_BINLOG_FILE env var */
+#ifndef QP_BINLOG_FILE
+    #define QP_BINLOG_FILE "qp.binlog"
+#endif
+
+struct qp_binlog_file_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t time_header;
+    uint32_t nsites;
+    uint32_t reserved;
+};
+
+struct qp_binlog_site_hdr {
+    uint32_t line;
+    uint32_t flags;
+    uint16_t fmt_len;
+    uint16_t file_len;
+    uint16_t func_len;
+    uint16_t reserved;
+};
+
+struct qp_binlog_rec_hdr {
+    uint32_t site;
+    uint16_t len;
+    uint16_t flags;
+    uint64_t ts;
+};
+
+struct qp_binlog_writer {
+    struct qp_ring *ring;
+    struct qp_ring_slot *slot;
+    char *pos;
+    char *end;
+    unsigned long long str_args;
+};
+
+QP_GLOBAL pthread_once_t qp_binlog_once = PTHREAD_ONCE_INIT;
+QP_GLOBAL int qp_binlog_fd = -1;
+
+static inline void qp_binlog_put_site_str(char **pos, const char *str, uint16_t len)
+{
+    memcpy(*pos, str, len);
+    *pos += len;
+}
+
+/** Write file header and site table, must happen before any record */
+static inline int qp_binlog_write_sites(int fd)
+{
+    struct qp_binlog_file_hdr hdr = {
+        .magic = QP_BINLOG_MAGIC,
+        .version = QP_BINLOG_VERSION,
+        .time_header = QP_TIME_HEADER,
+    };
+    struct qp_site *site;
+    char buf[4096];
+    char *pos = buf;
+
+    hdr.nsites = __start_qp_sites ? __stop_qp_sites - __start_qp_sites : 0;
+    if (qp_write_all(fd, (const char *)&hdr, sizeof(hdr)))
+        return -1;
+    for (site = __start_qp_sites; site && site < __stop_qp_sites; ++site) {
+        struct qp_binlog_site_hdr shdr = {
+            .line = site->line,
+            .flags = site->flags,
+            .fmt_len = strnlen(site->fmt, 1024),
+            .file_len = strnlen(site->file, 1024),
+            .func_len = strnlen(site->func, 1024),
+        };
+        if (pos + sizeof(shdr) + 3 * 1024 > buf + sizeof(buf)) {
+            if (qp_write_all(fd, buf, pos - buf))
+                return -1;
+            pos = buf;
+        }
+        memcpy(pos, &shdr, sizeof(shdr));
+        pos += sizeof(shdr);
+        qp_binlog_put_site_str(&pos, site->fmt, shdr.fmt_len);
+        qp_binlog_put_site_str(&pos, site->file, shdr.file_len);
+        qp_binlog_put_site_str(&pos, site->func, shdr.func_len);
+    }
+
+    return qp_write_all(fd, buf, pos - buf);
+}
+
+static inline size_t qp_binlog_format_drops(char *buf, size_t size,
+        struct qp_ring *ring, unsigned long long delta, unsigned long long total)
+{
+    struct qp_binlog_rec_hdr hdr = {
+        .site = QP_BINLOG_SITE_DROPS,
+        .len = sizeof(hdr) + 2 * (1 + sizeof(uint64_t)),
+        .ts = QP_NANOTIME_NOW(),
+    };
+    uint64_t vals[2] = { delta, total };
+    char *pos = buf;
+    int i;
+
+    (void)ring;
+    if (size < hdr.len)
+        return 0;
+    memcpy(pos, &hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+    for (i = 0; i < 2; ++i) {
+        *pos++ = (QP_BINLOG_ARG_INT << 4) | 3;
+        memcpy(pos, &vals[i], sizeof(vals[i]));
+        pos += sizeof(vals[i]);
+    }
+
+    return pos - buf;
+}
+
+static inline void qp_binlog_init_once(void)
+{
+    const char *path = getenv("QP_BINLOG_FILE");
+    int fd;
+
+    fd = open(path ? path : QP_BINLOG_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || qp_binlog_write_sites(fd)) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    qp_binlog_fd = fd;
+    pthread_mutex_lock(&qp_ring_state.drain_lock);
+    qp_ring_state.format_drops = qp_binlog_format_drops;
+    pthread_mutex_unlock(&qp_ring_state.drain_lock);
+    qp_ring_set_fd(fd);
+}
+
+/** Find which arguments of a printf format are consumed by %s conversions
+ *
+ * Only those are copied by value, other pointers (like %p) are just numbers.
+ * The func argument of a location header is not stored so it is skipped.
+ */
+static inline unsigned long long qp_binlog_scan_fmt(const char *fmt, int skip)
+{
+    unsigned long long mask = 0;
+    int argi = -skip;
+
+    while (*fmt) {
+        if (*fmt++ != '%')
+            continue;
+        if (*fmt == '%') {
+            ++fmt;
+            continue;
+        }
+        while (*fmt && strchr("-+ #0'123456789.*hlLqjzt", *fmt)) {
+            if (*fmt == '*')
+                ++argi;
+            ++fmt;
+        }
+        if (*fmt == 's' && argi >= 0 && argi < 64)
+            mask |= 1ull << argi;
+        if (*fmt) {
+            ++fmt;
+            ++argi;
+        }
+    }
+
+    return mask;
+}
+
+/** Start a record for a site, returns false if the record must be skipped */
+static inline int qp_binlog_begin(struct qp_binlog_writer *w, struct qp_site *site)
+{
+    struct qp_binlog_rec_hdr *hdr;
+
+    pthread_once(&qp_binlog_once, qp_binlog_init_once);
+    if (unlikely(qp_binlog_fd < 0))
+        return 0;
+    w->ring = qp_ring_get();
+    if (unlikely(!w->ring))
+        return 0;
+    w->slot = qp_ring_reserve(w->ring);
+    if (!w->slot)
+        return 0;
+    hdr = (struct qp_binlog_rec_hdr *)w->slot->data;
+    hdr->site = site - __start_qp_sites;
+    hdr->flags = 0;
+    hdr->ts = QP_NANOTIME_NOW();
+    if (unlikely(!(QP_ATOMIC_LOAD_ACQUIRE(&site->flags) & QP_SITE_STR_ARGS))) {
+        site->str_args = qp_binlog_scan_fmt(site->fmt, (site->flags & QP_SITE_LOC) ? 2 : 0);
+        __atomic_or_fetch(&site->flags, QP_SITE_STR_ARGS, __ATOMIC_RELEASE);
+    }
+    w->str_args = site->str_args;
+    w->pos = w->slot->data + sizeof(*hdr);
+    w->end = w->slot->data + w->ring->slot_size - sizeof(*w->slot);
+
+    return 1;
+}
+
+/** Append one argument to the record, see QP__BINLOG_ARG */
+static inline void qp_binlog_put(struct qp_binlog_writer *w,
+        int type_class, const void *val, size_t size)
+{
+    struct qp_binlog_rec_hdr *hdr = (struct qp_binlog_rec_hdr *)w->slot->data;
+    int is_str = (w->str_args & 1) && type_class == 5 && size == sizeof(char *);
+    int kind;
+
+    w->str_args >>= 1;
+    if (is_str) {
+        const char *str;
+        uint16_t len;
+
+        memcpy(&str, val, sizeof(str));
+        if (!str)
+            str = "(null)";
+        if (w->pos + 1 + sizeof(len) > w->end) {
+            hdr->flags |= QP_BINLOG_REC_TRUNCATED;
+            return;
+        }
+        len = strnlen(str, w->end - w->pos - 1 - sizeof(len));
+        if (str[len])
+            hdr->flags |= QP_BINLOG_REC_TRUNCATED;
+        *w->pos++ = QP_BINLOG_ARG_STR << 4;
+        memcpy(w->pos, &len, sizeof(len));
+        memcpy(w->pos + sizeof(len), str, len);
+        w->pos += sizeof(len) + len;
+        return;
+    }
+    if (w->pos + 1 + size > w->end || (size & (size - 1)) || size > 16) {
+        hdr->flags |= QP_BINLOG_REC_TRUNCATED;
+        return;
+    }
+    if (type_class == 5)
+        kind = QP_BINLOG_ARG_PTR;
+    else if (type_class == 8)
+        kind = QP_BINLOG_ARG_REAL;
+    else
+        kind = QP_BINLOG_ARG_INT;
+    *w->pos++ = (kind << 4) | __builtin_ctz(size);
+    memcpy(w->pos, val, size);
+    w->pos += size;
+}
+
+static inline void qp_binlog_end(struct qp_binlog_writer *w)
+{
+    struct qp_binlog_rec_hdr *hdr = (struct qp_binlog_rec_hdr *)w->slot->data;
+
+    hdr->len = w->pos - w->slot->data;
+    qp_ring_commit(w->ring, w->slot, hdr->len);
+}
+#endif /* QP_PROJECT_GLIBC */
+
+/* Store one argument after promotion similar to printf varargs. */
+#define QP__BINLOG_ARG(x) { \
+        __typeof__((x) + 0) qp_binlog_val = (x); \
+        qp_binlog_put(&qp_binlog_w, __builtin_classify_type(qp_binlog_val), \
+                &qp_binlog_val, sizeof(qp_binlog_val)); \
+    }
+
+/** Record raw arguments for a #qp_site */
+#define QP_BINLOG_WRITE(site, ...) do { \
+        struct qp_binlog_writer qp_binlog_w; \
+        if (qp_binlog_begin(&qp_binlog_w, (site))) { \
+            QP__FOR_EACH(QP__BINLOG_ARG, __VA_ARGS__) \
+            qp_binlog_end(&qp_binlog_w); \
+        } \
+    } while (0)
+
+/** Record a print site and its raw arguments for offline formatting */
+#define QP_BINLOG_PRINT(site_flags, str, ...) do { \
+        QP__SITE_DEFINE(qp_binlog_site, str, site_flags); \
+        QP_BINLOG_WRITE(&qp_binlog_site, __VA_ARGS__); \
+    } while (0)
+
+/** Print implementation storing raw arguments for the "qpdecode" tool
+ *
+ * This is selected by defining QP_BINLOG before including qp.h, which also
+ * switches #QP_PRINT_LOC to binary records. Output goes to #QP_BINLOG_FILE.
+ */
+#define QP_PRINT_IMPL_BINLOG(str, ...) QP_BINLOG_PRINT(0, str, ## __VA_ARGS__)
+
+#if defined(QP_DYNAMIC_DEBUG) && !defined(QP_PROJECT_GLIBC)
+    #error "QP_DYNAMIC_DEBUG requires glibc userspace"
+#endif
+
+#ifdef QP_PROJECT_GLIBC
+/* Dynamic debug: runtime control of #QP_PRINT_LOC sites.
+ *
+ * Queries use a syntax similar to the kernel's dynamic_debug/control:
+ *
+ *     file <glob> func <glob> line <N>[-<M>] format <substring> +p|-p
+ *
+ * All match keywords are optional and multiple queries can be separated by
+ * ';' or newlines. File globs are matched against both the full path and the
+ * basename. Queries are read from the QP_DYNDBG environment variable and from
+ * the file named by QP_DYNDBG_CONTROL, which is watched for changes.
+ *
+ * Queries are remembered so that sites evaluated later (for example from a
+ * dlopened library) get the same state.
+ */
+
+/** Maximum number of remembered dynamic debug queries */
+#ifndef QP_DYNDBG_MAX_QUERIES
+    #define QP_DYNDBG_MAX_QUERIES 64
+#endif
+
+/** Interval for checking QP_DYNDBG_CONTROL for changes */
+#ifndef QP_DYNDBG_CONTROL_INTERVAL_MS
+    #define QP_DYNDBG_CONTROL_INTERVAL_MS 1000
+#endif
+
+struct qp_dyndbg_query {
+    char file[128];
+    char func[64];
+    char format[64];
+    unsigned int line_min;
+    unsigned int line_max;
+    int enable;
+};
+
+struct qp_dyndbg_state {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    unsigned int nqueries;
+    struct qp_dyndbg_query queries[QP_DYNDBG_MAX_QUERIES];
+};
+
+QP_GLOBAL struct qp_dyndbg_state qp_dyndbg_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static inline int qp_dyndbg_match(const struct qp_dyndbg_query *q, const struct qp_site *site)
+{
+    if (q->file[0]) {
+        const char *base = strrchr(site->file, '/');
+        if (fnmatch(q->file, site->file, 0) &&
+                (!base || fnmatch(q->file, base + 1, 0)))
+            return 0;
+    }
+    if (q->func[0] && fnmatch(q->func, site->func, 0))
+        return 0;
+    if (q->line_max && (site->line < q->line_min || site->line > q->line_max))
+        return 0;
+    if (q->format[0] && !strstr(site->fmt, q->format))
+        return 0;
+    return 1;
+}
+
+/** Evaluate a site against all queries, called with the lock held */
+static inline int qp_dyndbg_site_eval(const struct qp_site *site)
+{
+    int enabled = !!(site->flags & QP_SITE_DEFAULT_ON);
+    unsigned int i;
+
+    for (i = 0; i < qp_dyndbg_state.nqueries; ++i)
+        if (qp_dyndbg_match(&qp_dyndbg_state.queries[i], site))
+            enabled = qp_dyndbg_state.queries[i].enable;
+    return enabled;
+}
+
+/* Copy the next whitespace-separated word, returns pointer after it */
+static inline const char *qp_dyndbg_word(const char *str, char *word, size_t size)
+{
+    size_t len = 0;
+
+    while (*str == ' ' || *str == '\t')
+        ++str;
+    while (*str && *str != ' ' && *str != '\t' && *str != ';' && *str != '\n') {
+        if (len + 1 < size)
+            word[len++] = *str;
+        ++str;
+    }
+    word[len] = 0;
+    return str;
+}
+
+/** Parse a single query, returns pointer after it or NULL on error */
+static inline const char *qp_dyndbg_parse(const char *str, struct qp_dyndbg_query *q)
+{
+    char word[128];
+
+    memset(q, 0, sizeof(*q));
+    q->enable = -1;
+    for (;;) {
+        str = qp_dyndbg_word(str, word, sizeof(word));
+        if (!word[0])
+            break;
+        if (!strcmp(word, "+p") || !strcmp(word, "+")) {
+            q->enable = 1;
+        } else if (!strcmp(word, "-p") || !strcmp(word, "-")) {
+            q->enable = 0;
+        } else if (!strcmp(word, "file")) {
+            str = qp_dyndbg_word(str, q->file, sizeof(q->file));
+        } else if (!strcmp(word, "func")) {
+            str = qp_dyndbg_word(str, q->func, sizeof(q->func));
+        } else if (!strcmp(word, "format")) {
+            str = qp_dyndbg_word(str, q->format, sizeof(q->format));
+        } else if (!strcmp(word, "line")) {
+            str = qp_dyndbg_word(str, word, sizeof(word));
+            if (sscanf(word, "%u-%u", &q->line_min, &q->line_max) == 1)
+                q->line_max = q->line_min;
+            if (!q->line_max)
+                return NULL;
+        } else {
+            return NULL;
+        }
+    }
+    return q->enable < 0 ? NULL : str;
+}
+
+/** Apply one query to all sites in the table, called with the lock held */
+static inline int qp_dyndbg_apply(const struct qp_dyndbg_query *q)
+{
+    struct qp_site *site;
+    int count = 0;
+
+    if (qp_dyndbg_state.nqueries < QP_DYNDBG_MAX_QUERIES) {
+        qp_dyndbg_state.queries[qp_dyndbg_state.nqueries++] = *q;
+    } else {
+        memmove(qp_dyndbg_state.queries, qp_dyndbg_state.queries + 1,
+                sizeof(*q) * (QP_DYNDBG_MAX_QUERIES - 1));
+        qp_dyndbg_state.queries[QP_DYNDBG_MAX_QUERIES - 1] = *q;
+    }
+    for (site = __start_qp_sites; site && site < __stop_qp_sites; ++site) {
+        if (!qp_dyndbg_match(q, site))
+            continue;
+        if (QP_ATOMIC_LOAD(&site->enabled) >= 0)
+            QP_ATOMIC_STORE(&site->enabled, q->enable);
+        ++count;
+    }
+
+    return count;
+}
+
+static inline int qp_dyndbg_control_locked(const char *str)
+{
+    struct qp_dyndbg_query q;
+    int count = 0;
+
+    while (*str) {
+        if (*str == ';' || *str == '\n' || *str == ' ' || *str == '\t') {
+            ++str;
+            continue;
+        }
+        if (*str == '#') {
+            while (*str && *str != '\n')
+                ++str;
+            continue;
+        }
+        str = qp_dyndbg_parse(str, &q);
+        if (!str)
+            return -EINVAL;
+        count += qp_dyndbg_apply(&q);
+    }
+
+    return count;
+}
+
+static inline void qp_dyndbg_read_control(const char *path)
+{
+    char buf[4096];
+    size_t len;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return;
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = 0;
+    pthread_mutex_lock(&qp_dyndbg_state.lock);
+    qp_dyndbg_control_locked(buf);
+    pthread_mutex_unlock(&qp_dyndbg_state.lock);
+}
+
+static inline void *qp_dyndbg_control_thread(void *arg)
+{
+    const char *path = (const char *)arg;
+    struct stat st;
+    struct timespec last = {0, 0};
+
+    for (;;) {
+        if (!stat(path, &st) && (st.st_mtim.tv_sec != last.tv_sec ||
+                st.st_mtim.tv_nsec != last.tv_nsec)) {
+            last = st.st_mtim;
+            qp_dyndbg_read_control(path);
+        }
+        usleep(QP_DYNDBG_CONTROL_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+static inline void qp_dyndbg_init_once(void)
+{
+    const char *env = getenv("QP_DYNDBG");
+    const char *path = getenv("QP_DYNDBG_CONTROL");
+    pthread_t thread;
+
+    if (env) {
+        pthread_mutex_lock(&qp_dyndbg_state.lock);
+        if (qp_dyndbg_control_locked(env) < 0)
+            fprintf(stderr, "qp: invalid QP_DYNDBG query: %s\n", env);
+        pthread_mutex_unlock(&qp_dyndbg_state.lock);
+    }
+    if (path) {
+        qp_dyndbg_read_control(path);
+        if (!pthread_create(&thread, NULL, qp_dyndbg_control_thread, (void *)path))
+            pthread_detach(thread);
+    }
+}
+
+/** Slow path of QP_SITE_ENABLED for a site that was not evaluated yet */
+static inline int qp_dyndbg_site_init(struct qp_site *site)
+{
+    int enabled;
+
+    pthread_once(&qp_dyndbg_state.once, qp_dyndbg_init_once);
+    pthread_mutex_lock(&qp_dyndbg_state.lock);
+    enabled = qp_dyndbg_site_eval(site);
+    QP_ATOMIC_STORE(&site->enabled, enabled);
+    pthread_mutex_unlock(&qp_dyndbg_state.lock);
+
+    return enabled;
+}
+
+/** Apply dynamic debug queries
+ *
+ * Example: qp_dyndbg_control("file net*.c line 100-200 +p; func foo -p")
+ *
+ * Returns number of matched sites or -EINVAL for a syntax error.
+ */
+static inline int qp_dyndbg_control(const char *query)
+{
+    int ret;
+
+    pthread_once(&qp_dyndbg_state.once, qp_dyndbg_init_once);
+    pthread_mutex_lock(&qp_dyndbg_state.lock);
+    ret = qp_dyndbg_control_locked(query);
+    pthread_mutex_unlock(&qp_dyndbg_state.lock);
+
+    return ret;
+}
+#endif /* QP_PROJECT_GLIBC */
+
+/** Print all #QP_PRINT_LOC sites known to dynamic debug with their state */
+#define QP_DYNDBG_DUMP() do { \
+        struct qp_site *qp_dump_site; \
+        for (qp_dump_site = __start_qp_sites; \
+                qp_dump_site && qp_dump_site < __stop_qp_sites; \
+                ++qp_dump_site) { \
+            QP_PRINT("%s:%u [%s] =%s \"%s\"" QP_NL, \
+                    qp_dump_site->file, qp_dump_site->line, qp_dump_site->func, \
+                    QP_SITE_ENABLED(qp_dump_site) ? "p" : "_", \
+                    qp_dump_site->fmt); \
+        } \
+    } while (0)
+
+#ifdef QP_NO_LOCKS
+    /* Nothing .*/
+#elif defined(__KERNEL__)
+    #if !defined(CONFIG_SMP)
+        #define QP_NO_LOCKS
+    #elif defined(DEFINE_SPINLOCK)
+        #define QP_LOCK_DEFINE(lock) DEFINE_SPINLOCK((lock))
+    #elif defined(SPIN_LOCK_UNLOCKED)
+        #define QP_LOCK_DEFINE(lock) spinlock_t lock = SPIN_LOCK_UNLOCKED
+    #else
+        #warning Kernel spinlocks not supported
+        #define QP_NO_LOCKS
+    #endif
+
+    #ifndef QP_NO_LOCKS
+        #define QP_LOCK(lock) unsigned long flags##lock; spin_lock_irqsave(&lock, flags##lock)
+        #define QP_UNLOCK(lock) spin_unlock_irqrestore(&lock, flags##lock)
+    #endif
+#elif defined(_POSIX_THREADS)
+    #define QP_LOCK_DEFINE(lock) pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER
+    #define QP_LOCK(lock) pthread_mutex_lock(&lock)
+    #define QP_UNLOCK(lock) pthread_mutex_unlock(&lock)
+#elif !defined(QP_LOCK_DEFINE)
+    //#warning "locking not supported"
+    #define QP_NO_LOCKS
+#endif
+
+#ifdef QP_NO_LOCKS
+    #define QP_LOCK_DEFINE(lock) struct { } lock __attribute__((unused))
+    #define QP_LOCK(lock)
+    #define QP_UNLOCK(lock)
 #endif
 
 #if !defined(do_div)
@@ -318,111 +2172,405 @@
 
 /** Rate limiter which evaluates as "true" once every "delta" miliseconds.
  *
- * Rate limitation is separate for each scope using this macro.
+ * Rate limitation is separate for each scope using this macro. This is
+ * lock-free: when the interval expires exactly one thread wins the
+ * compare-exchange on the last time and the others see 0.
  *
  * Returns 0 or number miliseconds passed.
  */
 #define QP_RATELIMIT(delta) ({ \
             static QP_MILITIME_T g_last_time; \
-            static QP_LOCK_DEFINE(g_lock); \
             QP_MILITIME_T now_time = QP_MILITIME_NOW(); \
+            QP_MILITIME_T last_time = QP_ATOMIC_LOAD(&g_last_time); \
             unsigned long delta_ms; \
             unsigned long ret = 0; \
             \
-            delta_ms = now_time - g_last_time; \
-            if (unlikely(delta_ms > delta)) { \
-                QP_LOCK(g_lock); \
-                delta_ms = now_time - g_last_time; \
-                if (likely(delta_ms > delta)) { \
-                    g_last_time = now_time; \
-                    ret = delta_ms; \
-                } \
-                QP_UNLOCK(g_lock); \
+            delta_ms = now_time - last_time; \
+            if (unlikely(delta_ms > delta) && \
+                    QP_ATOMIC_CAS(&g_last_time, &last_time, now_time)) { \
+                ret = delta_ms; \
             } \
             ret; \
         })
 
+/* Thread slots: small per-thread indexes for sharded counters.
+ *
+ * Each thread gets an exclusive slot in [0, QP_THREAD_SLOT_SHARED) on first
+ * use, released for reuse when the thread exits. Exclusive slots can be
+ * updated with plain relaxed stores. Once they are exhausted further threads
+ * share #QP_THREAD_SLOT_SHARED, which must be updated atomically.
+ */
+#ifndef QP_THREAD_SLOTS
+    #ifdef QP_PROJECT_GLIBC
+        #define QP_THREAD_SLOTS 64
+    #else
+        #define QP_THREAD_SLOTS 1
+    #endif
+#endif
+#define QP_THREAD_SLOT_SHARED (QP_THREAD_SLOTS - 1)
+
+#if defined(QP_PROJECT_GLIBC) && QP_THREAD_SLOTS > 1
+struct qp_thread_slots {
+    pthread_once_t once;
+    pthread_key_t key;
+    unsigned long long used[(QP_THREAD_SLOTS + 63) / 64];
+};
+
+QP_GLOBAL struct qp_thread_slots qp_thread_slots = {
+    .once = PTHREAD_ONCE_INIT,
+};
+/* Slot index plus one, zero if not yet allocated */
+QP_GLOBAL __thread int qp_thread_slot_self;
+
+static inline void qp_thread_slot_release(void *arg)
+{
+    unsigned int slot = (uintptr_t)arg - 1;
+
+    if (slot < QP_THREAD_SLOT_SHARED)
+        __atomic_fetch_and(&qp_thread_slots.used[slot / 64],
+                ~(1ULL << (slot % 64)), __ATOMIC_RELEASE);
+}
+
+static inline void qp_thread_slots_init_once(void)
+{
+    pthread_key_create(&qp_thread_slots.key, qp_thread_slot_release);
+}
+
+static inline int qp_thread_slot_alloc(void)
+{
+    unsigned int slot;
+
+    pthread_once(&qp_thread_slots.once, qp_thread_slots_init_once);
+    for (slot = 0; slot < QP_THREAD_SLOT_SHARED; ++slot) {
+        unsigned long long bit = 1ULL << (slot % 64);
+        if (!(__atomic_fetch_or(&qp_thread_slots.used[slot / 64], bit,
+                        __ATOMIC_ACQUIRE) & bit))
+            break;
+    }
+    qp_thread_slot_self = slot + 1;
+    pthread_setspecific(qp_thread_slots.key, (void *)(uintptr_t)(slot + 1));
+
+    return slot;
+}
+
+/** Index of the calling thread's slot */
+static inline int qp_thread_slot(void)
+{
+    if (likely(qp_thread_slot_self))
+        return qp_thread_slot_self - 1;
+    return qp_thread_slot_alloc();
+}
+#else
+    #define qp_thread_slot() QP_THREAD_SLOT_SHARED
+#endif
+
 #ifndef QP_LONG_COUNTER_T
 /** Type for ratelimit and profile counters. Can be redefined */
 #define QP_LONG_COUNTER_T unsigned long long
 #endif
 
+/* Statistics site registry.
+ *
+ * Ratelimit and profile sites register themselves on their first hit into a
+ * lock-free list so that their counters can be read on demand instead of
+ * only through periodic reports. In the kernel the list is exported in
+ * debugfs, see #QP_DEBUGFS_INIT, in userspace it is printed by #QP_SNAPSHOT
+ * and qp_snapshot().
+ */
+#ifndef QP_STAT_REGISTRY
+    #if defined(QP_PROJECT_LINUX_KERNEL) || defined(QP_PROJECT_GLIBC)
+        #define QP_STAT_REGISTRY 1
+    #else
+        #define QP_STAT_REGISTRY 0
+    #endif
+#endif
+
+/* With QP_STAT_SHM defined, counters of registered userspace sites live in
+ * a shared memory segment read by the "qpstat" tool, see #qp_stat_shm_hdr.
+ */
+#if defined(QP_STAT_SHM) && defined(QP_PROJECT_GLIBC) && QP_STAT_REGISTRY
+    #define QP__STAT_SHM 1
+#else
+    #define QP__STAT_SHM 0
+#endif
+
+/** Initial value of the print flag of each site, 0 to only pull counters */
+#ifndef QP_STAT_SITE_PRINT_DEFAULT
+    #define QP_STAT_SITE_PRINT_DEFAULT 1
+#endif
+
+#define QP_STAT_SITE_RATELIMIT 1
+#define QP_STAT_SITE_PROFILE 2
+#define QP_STAT_SITE_HIST 3
+
+struct qp_stat_site {
+    struct qp_stat_site *next;
+    const char *file;
+    const char *func;
+    unsigned int line;
+    unsigned int type;
+    /* QP_LONG_COUNTER_T count, struct qp_profile_site or size counts */
+    void *data;
+    unsigned int size;
+    /* Periodic reports are printed only while this is set */
+    unsigned int print;
+    /* 0, then -1 while the first hit registers the site, then 1 */
+    int registered;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    struct dentry *dentry;
+#endif
+};
+
+#define QP__STAT_SITE_INIT(site_type, site_data, site_size) { \
+        .file = __FILE__, \
+        .func = __func__, \
+        .line = __LINE__, \
+        .type = (site_type), \
+        .data = (site_data), \
+        .size = (site_size), \
+        .print = QP_STAT_SITE_PRINT_DEFAULT, \
+    }
+
+#if QP_STAT_REGISTRY
+#ifdef QP_PROJECT_LINUX_KERNEL
+    #ifndef QP_NO_AUTO_INCLUDE
+        #include <linux/debugfs.h>
+        #include <linux/seq_file.h>
+        #include <linux/workqueue.h>
+        #include <linux/slab.h>
+    #endif
+#endif
+
+struct qp_stat_registry {
+    /* Most recently registered first */
+    struct qp_stat_site *sites;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    int active;
+    /* "qp-<module>", shared by the files of a module, and "<file>" in it */
+    struct dentry *parent;
+    struct dentry *dir;
+    struct work_struct work;
+#endif
+};
+
+QP_GLOBAL struct qp_stat_registry qp_stat_registry;
+
+#if QP__STAT_SHM
+static inline void qp_stat_shm_attach(struct qp_stat_site *site);
+#endif
+
+static inline void qp_stat_site_register(struct qp_stat_site *site)
+{
+    struct qp_stat_site *head;
+    int registered = 0;
+
+    if (!QP_ATOMIC_CAS(&site->registered, &registered, -1)) {
+#if QP__STAT_SHM
+        /* Profile counters only exist once attached, wait for the first hit */
+        while (QP_ATOMIC_LOAD_ACQUIRE(&site->registered) < 0)
+            sched_yield();
+#endif
+        return;
+    }
+#if QP__STAT_SHM
+    qp_stat_shm_attach(site);
+#endif
+    head = QP_ATOMIC_LOAD(&qp_stat_registry.sites);
+    do {
+        site->next = head;
+    } while (!QP_ATOMIC_CAS(&qp_stat_registry.sites, &head, site));
+#ifdef QP_PROJECT_LINUX_KERNEL
+    /* qp_debugfs_exit waits for this with synchronize_rcu */
+    rcu_read_lock();
+    if (READ_ONCE(qp_stat_registry.active))
+        schedule_work(&qp_stat_registry.work);
+    rcu_read_unlock();
+#endif
+    QP_ATOMIC_STORE_RELEASE(&site->registered, 1);
+}
+
+#if QP__STAT_SHM
+    /* Pairs with the store in qp_stat_site_register, counters move before it */
+    #define QP__STAT_SITE_REGISTERED(site) (QP_ATOMIC_LOAD_ACQUIRE(&(site)->registered) > 0)
+#else
+    #define QP__STAT_SITE_REGISTERED(site) (QP_ATOMIC_LOAD(&(site)->registered) > 0)
+#endif
+
+#define QP__STAT_SITE_HIT(site) do { \
+        if (unlikely(!QP__STAT_SITE_REGISTERED(site))) \
+            qp_stat_site_register(site); \
+    } while (0)
+#else
+    #define QP__STAT_SITE_HIT(site) do { } while (0)
+#endif /* QP_STAT_REGISTRY */
+
+/* Counter of a ratelimit site, moved to the shared segment on registration */
+#if QP__STAT_SHM
+    #define QP__STAT_SITE_COUNTER(site, local) \
+            ((QP_LONG_COUNTER_T *)QP_ATOMIC_LOAD(&(site)->data))
+#else
+    #define QP__STAT_SITE_COUNTER(site, local) (local)
+#endif
+
 /** Count calls to this location. */
 #define QP_PRINT_RATELIMIT(str, ...) do { \
         static QP_LONG_COUNTER_T g_cnt = 0; \
         static QP_LONG_COUNTER_T g_last_cnt; \
-        static QP_LOCK_DEFINE(g_lock); \
+        static struct qp_stat_site qp_stat_site = \
+                QP__STAT_SITE_INIT(QP_STAT_SITE_RATELIMIT, &g_cnt, 1); \
+        QP_LONG_COUNTER_T cnt; \
         int delta_ms; \
-        QP_LOCK(g_lock); \
-        ++g_cnt; \
+        QP__STAT_SITE_HIT(&qp_stat_site); \
+        cnt = QP_ATOMIC_ADD(QP__STAT_SITE_COUNTER(&qp_stat_site, &g_cnt), 1); \
         delta_ms = QP_RATELIMIT(QP_RATELIMIT_INTERVAL); \
-        if (unlikely(delta_ms)) {\
-            QP_LONG_COUNTER_T rate = ((g_cnt - g_last_cnt) * 1000000); \
-            QP_LONG_COUNTER_T cnt = g_cnt; \
+        if (unlikely(delta_ms) && QP_ATOMIC_LOAD(&qp_stat_site.print)) {\
+            QP_LONG_COUNTER_T rate; \
             unsigned long rate_mod; \
-            g_last_cnt = g_cnt; \
-            QP_UNLOCK(g_lock); \
+            /* Counts from other threads racing with this one go to the next interval */ \
+            rate = (cnt - QP_ATOMIC_XCHG(&g_last_cnt, cnt)) * 1000000; \
             do_div(rate, delta_ms); \
             rate_mod = do_div(rate, 1000); \
-            QP_PRINT_LOC("cnt=%llu rate=%llu.%03d/s: " str, \
+            QP_PRINT_FIELDS_MSG("cnt=%llu rate=%llu.%03d/s: ", \
+                    QP_KV("cnt", "%llu") QP_KV("rate", "%llu.%03d"), str, \
                     cnt, rate, (int)rate_mod, \
                     ## __VA_ARGS__); \
-        } else { \
-            QP_UNLOCK(g_lock); \
         } \
     } while (0)
 
-#define QP_DEFINE_PER_CPU(type, name) DEFINE_PER_CPU(type, name)
-#define QP_PER_CPU_VAR(name) __get_cpu_var(name)
+/* Per-CPU variables.
+ *
+ * In the kernel these are regular per-CPU variables accessed with this_cpu
+ * operations. Callers of QP_PER_CPU_READ/WRITE/ID must disable preemption
+ * with QP_PER_CPU_GET/PUT, QP_PER_CPU_ADD is safe anywhere.
+ *
+ * In userspace there is one cache-line sized slot per thread slot (see
+ * qp_thread_slot) so "CPU" means thread; get/put are no-ops.
+ */
+#ifdef QP_PROJECT_LINUX_KERNEL
+    #define QP_DEFINE_PER_CPU(type, name) DEFINE_PER_CPU(type, name)
+    #define QP_PER_CPU_VAR(name) (*this_cpu_ptr(&(name)))
+    #define QP_PER_CPU_READ(name) this_cpu_read(name)
+    #define QP_PER_CPU_WRITE(name, val) this_cpu_write(name, val)
+    #define QP_PER_CPU_ADD(name, val) this_cpu_add(name, val)
+    #define QP_PER_CPU_ID() smp_processor_id()
+    #define QP_PER_CPU_GET() preempt_disable()
+    #define QP_PER_CPU_PUT() preempt_enable()
+    #define QP_PER_CPU_SUM(name) ({ \
+            __typeof__(name) qp_percpu_sum = 0; \
+            int qp_percpu_cpu; \
+            for_each_possible_cpu(qp_percpu_cpu) \
+                qp_percpu_sum += per_cpu(name, qp_percpu_cpu); \
+            qp_percpu_sum; \
+        })
+#else
+    #define QP_DEFINE_PER_CPU(type, name) \
+        struct { type val __attribute__((aligned(64))); } name[QP_THREAD_SLOTS]
+    #define QP_PER_CPU_VAR(name) ((name)[qp_thread_slot()].val)
+    #define QP_PER_CPU_READ(name) QP_ATOMIC_LOAD(&QP_PER_CPU_VAR(name))
+    #define QP_PER_CPU_WRITE(name, v) QP_ATOMIC_STORE(&QP_PER_CPU_VAR(name), (v))
+    #define QP_PER_CPU_ADD(name, v) do { \
+            int qp_percpu_slot = qp_thread_slot(); \
+            if (unlikely(qp_percpu_slot == QP_THREAD_SLOT_SHARED)) \
+                QP_ATOMIC_ADD(&(name)[qp_percpu_slot].val, (v)); \
+            else \
+                QP_ATOMIC_STORE(&(name)[qp_percpu_slot].val, \
+                        (name)[qp_percpu_slot].val + (v)); \
+        } while (0)
+    #define QP_PER_CPU_ID() qp_thread_slot()
+    #define QP_PER_CPU_GET() do { } while (0)
+    #define QP_PER_CPU_PUT() do { } while (0)
+    #define QP_PER_CPU_SUM(name) ({ \
+            __typeof__((name)[0].val) qp_percpu_sum = 0; \
+            int qp_percpu_i; \
+            for (qp_percpu_i = 0; qp_percpu_i < QP_THREAD_SLOTS; ++qp_percpu_i) \
+                qp_percpu_sum += QP_ATOMIC_LOAD(&(name)[qp_percpu_i].val); \
+            qp_percpu_sum; \
+        })
+#endif
+
+/** Define a counter which scales with the number of CPUs/threads */
+#define QP_PERCPU_COUNTER_DEFINE(name) QP_DEFINE_PER_CPU(QP_LONG_COUNTER_T, name)
+/** Add to a per-CPU counter, never contends */
+#define QP_PERCPU_COUNTER_ADD(name, val) QP_PER_CPU_ADD(name, val)
+/** Sum of a per-CPU counter across all CPUs/threads */
+#define QP_PERCPU_COUNTER_SUM(name) QP_PER_CPU_SUM(name)
 
+/** Rate limiter with separate state per CPU, see #QP_RATELIMIT
+ *
+ * Must be called between QP_PER_CPU_GET and QP_PER_CPU_PUT.
+ */
 #define QP_RATELIMIT_PERCPU(delta) ({ \
             static QP_DEFINE_PER_CPU(QP_MILITIME_T, g_last_time); \
             QP_MILITIME_T now_time = QP_MILITIME_NOW(); \
             unsigned long delta_ms; \
-            delta_ms = now_time - QP_PER_CPU_VAR(g_last_time); \
+            delta_ms = now_time - QP_PER_CPU_READ(g_last_time); \
             if (unlikely(delta_ms > delta)) { \
-                QP_PER_CPU_VAR(g_last_time) = now_time; \
+                QP_PER_CPU_WRITE(g_last_time, now_time); \
             } else { \
                 delta_ms = 0; \
             } \
             delta_ms; \
         })
 
-/** Count calls to this location on a per-cpu basis. */
+/** Count calls to this location on a per-cpu basis.
+ *
+ * Each CPU (thread in userspace) reports its own count and rate, total is
+ * the sum over all CPUs.
+ */
 #define QP_PRINT_RATELIMIT_PERCPU(str, ...) do { \
         static QP_DEFINE_PER_CPU(QP_LONG_COUNTER_T, g_cnt); \
         static QP_DEFINE_PER_CPU(QP_LONG_COUNTER_T, g_last_cnt); \
         int delta_ms; \
-        ++QP_PER_CPU_VAR(g_cnt); \
+        QP_PER_CPU_GET(); \
+        QP_PER_CPU_ADD(g_cnt, 1); \
         delta_ms = QP_RATELIMIT_PERCPU(QP_RATELIMIT_INTERVAL); \
         if (unlikely(delta_ms)) {\
-            QP_LONG_COUNTER_T rate = ((QP_PER_CPU_VAR(g_cnt) - QP_PER_CPU_VAR(g_last_cnt)) * 1000000); \
-            QP_LONG_COUNTER_T cnt = QP_PER_CPU_VAR(g_cnt); \
+            QP_LONG_COUNTER_T cnt = QP_PER_CPU_READ(g_cnt); \
+            QP_LONG_COUNTER_T rate = (cnt - QP_PER_CPU_READ(g_last_cnt)) * 1000000; \
+            QP_LONG_COUNTER_T total = QP_PER_CPU_SUM(g_cnt); \
+            int cpu = QP_PER_CPU_ID(); \
             unsigned long rate_mod; \
-            QP_PER_CPU_VAR(g_last_cnt) = QP_PER_CPU_VAR(g_cnt); \
+            QP_PER_CPU_WRITE(g_last_cnt, cnt); \
+            QP_PER_CPU_PUT(); \
             do_div(rate, delta_ms); \
             rate_mod = do_div(rate, 1000); \
-            QP_PRINT_LOC("cpu=%d cnt=%llu rate=%llu.%03lu/s: " str, \
-                    smp_processor_id(), cnt, rate, rate_mod, \
+            QP_PRINT_FIELDS_MSG("cpu=%d cnt=%llu total=%llu rate=%llu.%03lu/s: ", \
+                    QP_KV("cpu", "%d") QP_KV("cnt", "%llu") QP_KV("total", "%llu") \
+                    QP_KV("rate", "%llu.%03lu"), str, \
+                    cpu, cnt, total, rate, rate_mod, \
                     ## __VA_ARGS__); \
+        } else { \
+            QP_PER_CPU_PUT(); \
         } \
     } while (0)
 
-/* Count calls to this location: */
+/* Count calls to this location, separately for each value of expr in [0, maxval).
+ *
+ * Values outside the range are ignored. For large or sparse keys use
+ * #QP_PRINT_KEY_HIST_RATELIMIT.
+ */
 #define QP_PRINT_HIST_RATELIMIT(expr, maxval, str, ...) do { \
         static QP_LONG_COUNTER_T cnt[maxval]; \
         static QP_LONG_COUNTER_T last_cnt[maxval]; \
         static QP_MILITIME_T last_time[maxval]; \
+        static struct qp_stat_site qp_stat_site = \
+                QP__STAT_SITE_INIT(QP_STAT_SITE_HIST, cnt, maxval); \
         unsigned int curval = expr; \
         QP_MILITIME_T now_time = QP_MILITIME_NOW(); \
-        QP_MILITIME_T delta_ms = now_time - last_time[curval]; \
+        QP_MILITIME_T delta_ms; \
+        if (unlikely(curval >= (maxval))) \
+            break; \
+        QP__STAT_SITE_HIT(&qp_stat_site); \
+        delta_ms = now_time - last_time[curval]; \
         ++cnt[curval]; \
-        if (unlikely(delta_ms > QP_RATELIMIT_INTERVAL)) { \
+        if (unlikely(delta_ms > QP_RATELIMIT_INTERVAL) && \
+                QP_ATOMIC_LOAD(&qp_stat_site.print)) { \
             QP_LONG_COUNTER_T rate = ((cnt[curval] - last_cnt[curval]) * 1000000); \
             unsigned long rate_mod; \
             do_div(rate, delta_ms); \
             rate_mod = do_div(rate, 1000); \
-            QP_PRINT_LOC("cnt=%llu rate=%llu.%03lu/s: " str, \
+            QP_PRINT_FIELDS_MSG("cnt=%llu rate=%llu.%03lu/s: ", \
+                    QP_KV("cnt", "%llu") QP_KV("rate", "%llu.%03lu"), str, \
                     cnt[curval], rate, rate_mod, \
                     ## __VA_ARGS__); \
             last_time[curval] = now_time; \
@@ -432,202 +2580,3115 @@
 
 #define QP_TRACE_RATELIMIT() QP_PRINT_RATELIMIT("trace" QP_NL)
 
-#define QP__BOOLFUNC_FMT(expr) \
-            ((!!expr()) ? " "#expr : "")
+/* Keyed histogram: counts per key in a fixed-capacity open-addressing hash
+ * table. Slots are claimed with a compare-exchange on the key and counted
+ * with atomic adds, so it is safe from any number of threads. Keys which do
+ * not fit are counted as overflow.
+ */
 
-#ifdef in_nmi
-    #define QP_PREEMPT_COUNT_FMT__nmi "%s"
-    #define QP_PREEMPT_COUNT_ARGS__nmi , QP__BOOLFUNC_FMT(in_nmi)
-#else
-    #define QP_PREEMPT_COUNT_FMT__nmi
-    #define QP_PREEMPT_COUNT_ARGS__nmi
+/** Number of slots in each keyed histogram, must be a power of two */
+#ifndef QP_KEY_HIST_SIZE
+    #define QP_KEY_HIST_SIZE 256
+#endif
+/** Number of keys with the highest rate shown in each summary */
+#ifndef QP_KEY_HIST_TOPK
+    #define QP_KEY_HIST_TOPK 8
+#endif
+
+struct qp_key_hist_slot {
+    /* key + 1, zero if unused */
+    unsigned long long tag;
+    QP_LONG_COUNTER_T cnt;
+    QP_LONG_COUNTER_T last_cnt;
+};
+
+struct qp_key_hist {
+    QP_LONG_COUNTER_T total;
+    QP_LONG_COUNTER_T last_total;
+    QP_LONG_COUNTER_T overflow;
+    struct qp_key_hist_slot slots[QP_KEY_HIST_SIZE];
+};
+
+static inline void qp_key_hist_add(struct qp_key_hist *hist, unsigned long long key)
+{
+    unsigned long long tag = key + 1, cur;
+    unsigned long long hash = tag * 0x9e3779b97f4a7c15ULL;
+    unsigned int i, idx = (hash ^ (hash >> 32)) & (QP_KEY_HIST_SIZE - 1);
+
+    QP_ATOMIC_ADD(&hist->total, 1);
+    for (i = 0; i < QP_KEY_HIST_SIZE; ++i, idx = (idx + 1) & (QP_KEY_HIST_SIZE - 1)) {
+        struct qp_key_hist_slot *slot = &hist->slots[idx];
+
+        cur = QP_ATOMIC_LOAD(&slot->tag);
+        if (!cur) {
+            if (QP_ATOMIC_CAS(&slot->tag, &cur, tag))
+                cur = tag;
+        }
+        if (cur == tag) {
+            QP_ATOMIC_ADD(&slot->cnt, 1);
+            return;
+        }
+    }
+    QP_ATOMIC_ADD(&hist->overflow, 1);
+}
+
+/** Format "key:rate/s" for the keys with the highest rate since the last
+ *  summary, returns the number of keys seen so far.
+ */
+static inline unsigned int qp_key_hist_summary(struct qp_key_hist *hist,
+        unsigned long delta_ms, char *buf, size_t size)
+{
+    struct qp_key_hist_slot *top[QP_KEY_HIST_TOPK];
+    QP_LONG_COUNTER_T top_delta[QP_KEY_HIST_TOPK];
+    unsigned int i, j, ntop = 0, nkeys = 0;
+    size_t len = 0;
+
+    for (i = 0; i < QP_KEY_HIST_SIZE; ++i) {
+        struct qp_key_hist_slot *slot = &hist->slots[i];
+        QP_LONG_COUNTER_T cnt, delta;
+
+        if (!QP_ATOMIC_LOAD(&slot->tag))
+            continue;
+        ++nkeys;
+        cnt = QP_ATOMIC_LOAD(&slot->cnt);
+        delta = cnt - slot->last_cnt;
+        slot->last_cnt = cnt;
+        if (!delta)
+            continue;
+        /* Insertion into the sorted top list */
+        for (j = ntop; j > 0 && top_delta[j - 1] < delta; --j) {
+            if (j < QP_KEY_HIST_TOPK) {
+                top[j] = top[j - 1];
+                top_delta[j] = top_delta[j - 1];
+            }
+        }
+        if (j < QP_KEY_HIST_TOPK) {
+            top[j] = slot;
+            top_delta[j] = delta;
+            if (ntop < QP_KEY_HIST_TOPK)
+                ++ntop;
+        }
+    }
+
+    buf[0] = 0;
+    for (i = 0; i < ntop && len < size; ++i) {
+        QP_LONG_COUNTER_T rate = top_delta[i] * 1000000;
+        unsigned long rate_mod;
+
+        do_div(rate, delta_ms);
+        rate_mod = do_div(rate, 1000);
+        len += snprintf(buf + len, size - len, "%s%llu:%llu.%03lu/s",
+                i ? "," : "", top[i]->tag - 1, rate, rate_mod);
+    }
+
+    return nkeys;
+}
+
+/** Count calls to this location per key, with a periodic summary line.
+ *
+ * Unlike #QP_PRINT_HIST_RATELIMIT keys can be any 64-bit value except ~0
+ * (for example ports, ifindexes or error codes) and the output is a single
+ * line with the top #QP_KEY_HIST_TOPK keys by rate:
+ *
+ *     cnt=N rate=R/s keys=K overflow=O top=key:rate/s,...: str
+ */
+#define QP_PRINT_KEY_HIST_RATELIMIT(expr, str, ...) do { \
+        static struct qp_key_hist qp_key_hist; \
+        unsigned long delta_ms; \
+        qp_key_hist_add(&qp_key_hist, (expr)); \
+        delta_ms = QP_RATELIMIT(QP_RATELIMIT_INTERVAL); \
+        if (unlikely(delta_ms)) { \
+            char top[QP_KEY_HIST_TOPK * 40]; \
+            QP_LONG_COUNTER_T cnt = QP_ATOMIC_LOAD(&qp_key_hist.total); \
+            QP_LONG_COUNTER_T rate = (cnt - qp_key_hist.last_total) * 1000000; \
+            unsigned long rate_mod; \
+            unsigned int nkeys; \
+            qp_key_hist.last_total = cnt; \
+            nkeys = qp_key_hist_summary(&qp_key_hist, delta_ms, top, sizeof(top)); \
+            do_div(rate, delta_ms); \
+            rate_mod = do_div(rate, 1000); \
+            QP_PRINT_FIELDS_MSG("cnt=%llu rate=%llu.%03lu/s keys=%u overflow=%llu top=%s: ", \
+                    QP_KV("cnt", "%llu") QP_KV("rate", "%llu.%03lu") QP_KV("keys", "%u") \
+                    QP_KV("overflow", "%llu") QP_KV_STR("top", "%s"), str, \
+                    cnt, rate, rate_mod, nkeys, \
+                    (unsigned long long)QP_ATOMIC_LOAD(&qp_key_hist.overflow), top, \
+                    ## __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define QP__BOOLFUNC_FMT(expr) \
+            ((!!expr()) ? " "#expr : "")
+
+#ifdef in_nmi
+    #define QP_PREEMPT_COUNT_FMT__nmi "%s"
+    #define QP_PREEMPT_COUNT_ARGS__nmi , QP__BOOLFUNC_FMT(in_nmi)
+#else
+    #define QP_PREEMPT_COUNT_FMT__nmi
+    #define QP_PREEMPT_COUNT_ARGS__nmi
+#endif
+
+#ifdef in_serving_softirq
+    #define QP_PREEMPT_COUNT_FMT__serving_softirq "%s"
+    #define QP_PREEMPT_COUNT_ARGS__serving_softirq , QP__BOOLFUNC_FMT(in_serving_softirq)
+#else
+    #define QP_PREEMPT_COUNT_FMT__serving_softirq
+    #define QP_PREEMPT_COUNT_ARGS__serving_softirq
+#endif
+
+#define QP_PREEMPT_COUNT_FMT "0x%08x%s%s%s%s%s" \
+                    QP_PREEMPT_COUNT_FMT__nmi \
+                    QP_PREEMPT_COUNT_FMT__serving_softirq \
+
+#define QP_PREEMPT_COUNT_ARGS \
+                    preempt_count(), \
+                    QP__BOOLFUNC_FMT(irqs_disabled), \
+                    QP__BOOLFUNC_FMT(in_atomic), \
+                    QP__BOOLFUNC_FMT(in_interrupt), \
+                    QP__BOOLFUNC_FMT(in_irq), \
+                    QP__BOOLFUNC_FMT(in_softirq) \
+                    QP_PREEMPT_COUNT_ARGS__nmi \
+                    QP_PREEMPT_COUNT_ARGS__serving_softirq \
+
+
+#define QP_DUMP_KERNEL_CONTEXT() \
+            QP_PRINT_LOC("preempt_count=" QP_PREEMPT_COUNT_FMT "\n", \
+                    QP_PREEMPT_COUNT_ARGS);
+
+#ifdef QP_PROJECT_GLIBC
+/* Symbolization.
+ *
+ * Addresses are matched to loaded objects with /proc/self/maps and resolved
+ * with the symbol table of the object file (.symtab, or .dynsym if stripped),
+ * so static functions get names as well. Symbols are copied and sorted once
+ * per object, and results are kept in a bounded direct-mapped cache, so
+ * formatting a frame does not allocate once its object has been loaded.
+ * Objects which are no longer mapped are dropped on the next cache miss.
+ */
+
+/** Number of cached addresses (must be a power of 2) */
+#ifndef QP_SYM_CACHE_SIZE
+    #define QP_SYM_CACHE_SIZE 1024
+#endif
+
+/** Maximum number of loaded objects with cached symbol tables */
+#ifndef QP_SYM_MODULES
+    #define QP_SYM_MODULES 64
+#endif
+
+/** Buffer size for one formatted address */
+#ifndef QP_SYM_LINE_SIZE
+    #define QP_SYM_LINE_SIZE 256
+#endif
+
+/* Function or object symbol, value is relative to the load bias */
+struct qp_sym_addr {
+    uintptr_t value;
+    uintptr_t size;
+    const char *name;
+};
+
+struct qp_sym_module {
+    /* Address range of all mappings and load bias */
+    uintptr_t lo;
+    uintptr_t hi;
+    uintptr_t base;
+    /* Name printed in frames, path is the one in /proc/self/maps */
+    char *name;
+    char *path;
+    /* Symbols sorted by value, NULL if unavailable. The names are copied
+     * so the object file is not kept mapped.
+     */
+    struct qp_sym_addr *addrs;
+    size_t naddrs;
+    char *names;
+    /* Found by the last scan of /proc/self/maps */
+    int seen;
+};
+
+struct qp_sym_entry {
+    const void *pc;
+    const struct qp_sym_module *module;
+    /* Symbol name or NULL for an offset from the module base */
+    const char *name;
+    uintptr_t offset;
+};
+
+struct qp_sym_state {
+    pthread_mutex_t lock;
+    unsigned int nmodules;
+    /* Objects unloaded by the dynamic linker when modules were last checked */
+    unsigned long long subs;
+    unsigned long long hits;
+    unsigned long long misses;
+    /* Buffers of the /proc/self/maps scan, kept off the stack of the dumps */
+    char *line;
+    size_t line_size;
+    char path[PATH_MAX];
+    struct qp_sym_module modules[QP_SYM_MODULES];
+    struct qp_sym_entry cache[QP_SYM_CACHE_SIZE];
+};
+
+QP_GLOBAL struct qp_sym_state qp_sym_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+extern char *program_invocation_name;
+
+static inline int qp_sym_addr_cmp(const void *a, const void *b)
+{
+    uintptr_t va = ((const struct qp_sym_addr *)a)->value;
+    uintptr_t vb = ((const struct qp_sym_addr *)b)->value;
+
+    return va < vb ? -1 : va > vb;
+}
+
+static inline int qp_sym_wanted(const ElfW(Sym) *sym, size_t strtab_size)
+{
+    unsigned int type = ELF64_ST_TYPE(sym->st_info);
+
+    return (type == STT_FUNC || type == STT_OBJECT) &&
+            sym->st_shndx != SHN_UNDEF &&
+            sym->st_name < strtab_size;
+}
+
+/** Copy the sorted symbol table of an object */
+static inline void qp_sym_module_copy(struct qp_sym_module *module,
+        const ElfW(Sym) *syms, size_t nsyms, const char *strtab, size_t strtab_size)
+{
+    size_t i, len, naddrs = 0, names_size = 0;
+    struct qp_sym_addr *addr;
+    char *pos;
+
+    for (i = 0; i < nsyms; ++i) {
+        if (!qp_sym_wanted(&syms[i], strtab_size))
+            continue;
+        ++naddrs;
+        names_size += strnlen(strtab + syms[i].st_name, strtab_size - syms[i].st_name) + 1;
+    }
+    if (!naddrs)
+        return;
+    module->addrs = (struct qp_sym_addr *)malloc(naddrs * sizeof(*module->addrs));
+    module->names = (char *)malloc(names_size);
+    if (!module->addrs || !module->names) {
+        free(module->addrs);
+        free(module->names);
+        module->addrs = NULL;
+        module->names = NULL;
+        return;
+    }
+
+    pos = module->names;
+    for (i = 0; i < nsyms; ++i) {
+        if (!qp_sym_wanted(&syms[i], strtab_size))
+            continue;
+        len = strnlen(strtab + syms[i].st_name, strtab_size - syms[i].st_name);
+        memcpy(pos, strtab + syms[i].st_name, len);
+        pos[len] = 0;
+        addr = &module->addrs[module->naddrs++];
+        addr->value = syms[i].st_value;
+        addr->size = syms[i].st_size ?: 1;
+        addr->name = pos;
+        pos += len + 1;
+    }
+    qsort(module->addrs, module->naddrs, sizeof(*module->addrs), qp_sym_addr_cmp);
+}
+
+/** Read the symbol table of an object file and find the load bias of the
+ *  mapping at file offset 0 starting at map_start.
+ */
+static inline void qp_sym_module_load(struct qp_sym_module *module, const char *path,
+        uintptr_t map_start)
+{
+    const ElfW(Ehdr) *ehdr;
+    const ElfW(Phdr) *phdr;
+    const ElfW(Shdr) *shdr, *symtab = NULL, *strtab;
+    const char *map;
+    struct stat st;
+    unsigned int i;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*ehdr)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    ehdr = (const ElfW(Ehdr) *)map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+            ehdr->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+            ehdr->e_phentsize != sizeof(*phdr) ||
+            ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(*phdr) > (size_t)st.st_size ||
+            ehdr->e_shentsize != sizeof(*shdr) ||
+            ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(*shdr) > (size_t)st.st_size)
+        goto out;
+
+    /* Non-PIE executables are mapped at their link address */
+    phdr = (const ElfW(Phdr) *)(map + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdr[i].p_type == PT_LOAD) {
+            module->base = map_start - (phdr[i].p_vaddr & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+            break;
+        }
+    }
+
+    shdr = (const ElfW(Shdr) *)(map + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdr[i].sh_type == SHT_SYMTAB ||
+                (shdr[i].sh_type == SHT_DYNSYM && !symtab))
+            symtab = &shdr[i];
+    }
+    if (!symtab || symtab->sh_link >= ehdr->e_shnum)
+        goto out;
+    strtab = &shdr[symtab->sh_link];
+    if (symtab->sh_offset + symtab->sh_size > (size_t)st.st_size ||
+            strtab->sh_offset + strtab->sh_size > (size_t)st.st_size)
+        goto out;
+
+    qp_sym_module_copy(module, (const ElfW(Sym) *)(map + symtab->sh_offset),
+            symtab->sh_size / sizeof(ElfW(Sym)), map + strtab->sh_offset, strtab->sh_size);
+
+out:
+    munmap((void *)map, st.st_size);
+}
+
+/** End of a run of mappings of one file in /proc/self/maps */
+static inline int qp_sym_maps_run(const char *run, uintptr_t run_lo, uintptr_t run_hi,
+        uintptr_t run_map, uintptr_t pc, uintptr_t *lo, uintptr_t *hi, uintptr_t *map_start)
+{
+    unsigned int i;
+
+    for (i = 0; i < qp_sym_state.nmodules; ++i) {
+        struct qp_sym_module *module = &qp_sym_state.modules[i];
+
+        if (module->lo == run_lo && !strcmp(module->path, run))
+            module->seen = 1;
+    }
+    if (pc < run_lo || pc >= run_hi || !run_map)
+        return 0;
+    snprintf(qp_sym_state.path, sizeof(qp_sym_state.path), "%s", run);
+    *lo = run_lo;
+    *hi = run_hi;
+    *map_start = run_map;
+
+    return 1;
+}
+
+/** Scan /proc/self/maps once, marking the modules which are still mapped and
+ *  looking for the file containing pc, which is copied to qp_sym_state.path.
+ *  Returns 0 if there is none.
+ *
+ * The mappings of a file are adjacent, each run of them gives the range of
+ * the file and the start of its mapping at file offset 0.
+ */
+static inline int qp_sym_maps_scan(uintptr_t pc, uintptr_t *lo, uintptr_t *hi,
+        uintptr_t *map_start)
+{
+    unsigned long start, end, offset;
+    uintptr_t run_lo = 0, run_hi = 0, run_map = 0;
+    char *run = NULL;
+    unsigned int i;
+    int pos, found = 0, eof = 0;
+    FILE *fp = fopen("/proc/self/maps", "re");
+
+    if (!fp)
+        return 0;
+    for (i = 0; i < qp_sym_state.nmodules; ++i)
+        qp_sym_state.modules[i].seen = 0;
+    while (!eof) {
+        char *name = NULL;
+
+        if (getline(&qp_sym_state.line, &qp_sym_state.line_size, fp) > 0) {
+            pos = 0;
+            if (sscanf(qp_sym_state.line, "%lx-%lx %*s %lx %*s %*s %n",
+                    &start, &end, &offset, &pos) < 3 || !pos)
+                continue;
+            name = qp_sym_state.line + pos;
+            name[strcspn(name, "\n")] = 0;
+            if (name[0] != '/')
+                continue;
+            if (run && !strcmp(name, run)) {
+                run_hi = end;
+                if (!offset && !run_map)
+                    run_map = start;
+                continue;
+            }
+        } else {
+            eof = 1;
+        }
+        if (run)
+            found |= qp_sym_maps_run(run, run_lo, run_hi, run_map, pc, lo, hi, map_start);
+        free(run);
+        run = NULL;
+        if (name) {
+            /* The line buffer is reused by the next line */
+            run = strdup(name);
+            if (!run)
+                break;
+            run_lo = start;
+            run_hi = end;
+            run_map = offset ? 0 : start;
+        }
+    }
+    free(run);
+    fclose(fp);
+
+    return found;
+}
+
+/** Whether path is the main program, like backtrace_symbols it is then named
+ *  after argv[0]
+ */
+static inline int qp_sym_is_exe(const char *path)
+{
+    struct stat st, exe_st;
+
+    return !stat(path, &st) && !stat("/proc/self/exe", &exe_st) &&
+            st.st_dev == exe_st.st_dev && st.st_ino == exe_st.st_ino;
+}
+
+#ifdef _GNU_SOURCE
+static inline int qp_sym_subs_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+        *(unsigned long long *)data = info->dlpi_subs;
+    return 1;
+}
+
+/** Number of objects unloaded by the dynamic linker so far */
+static inline unsigned long long qp_sym_subs(void)
+{
+    unsigned long long subs = 0;
+
+    dl_iterate_phdr(qp_sym_subs_cb, &subs);
+    return subs;
+}
+#else
+    /* Without dl_iterate_phdr every miss checks /proc/self/maps */
+    #define qp_sym_subs() (qp_sym_state.subs + 1)
+#endif
+
+/** Drop modules not found by the last scan, called with the lock held */
+static inline void qp_sym_modules_prune(void)
+{
+    unsigned int i = 0;
+    int dropped = 0;
+
+    while (i < qp_sym_state.nmodules) {
+        struct qp_sym_module *module = &qp_sym_state.modules[i];
+
+        if (module->seen) {
+            ++i;
+            continue;
+        }
+        free(module->name);
+        free(module->path);
+        free(module->addrs);
+        free(module->names);
+        *module = qp_sym_state.modules[--qp_sym_state.nmodules];
+        dropped = 1;
+    }
+    /* Cached entries point to modules and their names */
+    if (dropped)
+        memset(qp_sym_state.cache, 0, sizeof(qp_sym_state.cache));
+}
+
+/** Find the loaded object containing pc, called with the lock held.
+ *
+ * Modules are checked against /proc/self/maps whenever it is read, and
+ * before using the known ranges if the dynamic linker unloaded objects since
+ * the last check (always without _GNU_SOURCE). Dropping a module flushes the
+ * cache.
+ */
+static inline const struct qp_sym_module *qp_sym_module_find(uintptr_t pc)
+{
+    struct qp_sym_module *module;
+    const char *path = qp_sym_state.path;
+    uintptr_t lo = 0, hi = 0, map_start = 0;
+    unsigned long long subs = qp_sym_subs();
+    unsigned int i;
+    int found;
+
+    if (subs == qp_sym_state.subs) {
+        for (i = 0; i < qp_sym_state.nmodules; ++i) {
+            module = &qp_sym_state.modules[i];
+            if (pc >= module->lo && pc < module->hi)
+                return module;
+        }
+    }
+    qp_sym_state.subs = subs;
+    found = qp_sym_maps_scan(pc, &lo, &hi, &map_start);
+    qp_sym_modules_prune();
+    if (!found)
+        return NULL;
+    for (i = 0; i < qp_sym_state.nmodules; ++i) {
+        module = &qp_sym_state.modules[i];
+        if (pc >= module->lo && pc < module->hi)
+            return module;
+    }
+    if (qp_sym_state.nmodules == QP_SYM_MODULES)
+        return NULL;
+
+    module = &qp_sym_state.modules[qp_sym_state.nmodules];
+    memset(module, 0, sizeof(*module));
+    module->name = strdup(qp_sym_is_exe(path) ? program_invocation_name : path);
+    module->path = strdup(path);
+    if (!module->name || !module->path) {
+        free(module->name);
+        free(module->path);
+        return NULL;
+    }
+    module->lo = lo;
+    module->hi = hi;
+    module->base = map_start;
+    module->seen = 1;
+    qp_sym_module_load(module, path, map_start);
+    ++qp_sym_state.nmodules;
+
+    return module;
+}
+
+/** Find the symbol containing rel, relative to the base */
+static inline const char *qp_sym_module_lookup(const struct qp_sym_module *module,
+        uintptr_t rel, uintptr_t *offset)
+{
+    size_t lo = 0, hi = module->naddrs, mid;
+    uintptr_t value;
+
+    /* Number of symbols starting at or below rel */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (module->addrs[mid].value <= rel)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return NULL;
+    /* Aliases share a value, not all of them have a size */
+    value = module->addrs[lo - 1].value;
+    while (lo && module->addrs[lo - 1].value == value) {
+        const struct qp_sym_addr *addr = &module->addrs[--lo];
+
+        if (rel - addr->value < addr->size) {
+            *offset = rel - addr->value;
+            return addr->name;
+        }
+    }
+
+    return NULL;
+}
+
+/** Resolve pc through the cache, called with the lock held */
+static inline const struct qp_sym_entry *qp_sym_lookup_locked(const void *pc)
+{
+    struct qp_sym_entry *entry = &qp_sym_state.cache[
+            ((uintptr_t)pc ^ (uintptr_t)pc >> 12) & (QP_SYM_CACHE_SIZE - 1)];
+
+    if (entry->pc == pc && entry->pc) {
+        ++qp_sym_state.hits;
+    } else {
+        const struct qp_sym_module *module;
+
+        ++qp_sym_state.misses;
+        /* This can flush the cache */
+        module = qp_sym_module_find((uintptr_t)pc);
+        entry->pc = pc;
+        entry->name = NULL;
+        entry->module = module;
+        if (module) {
+            entry->offset = (uintptr_t)pc - module->base;
+            entry->name = qp_sym_module_lookup(module, entry->offset, &entry->offset);
+        }
+    }
+
+    return entry;
+}
+
+/** Resolve pc through the cache into *out.
+ *
+ * The module and name pointers may be freed by a later lookup once their
+ * object is unloaded, only use them to compare addresses.
+ */
+static inline void qp_sym_lookup(const void *pc, struct qp_sym_entry *out)
+{
+    pthread_mutex_lock(&qp_sym_state.lock);
+    *out = *qp_sym_lookup_locked(pc);
+    pthread_mutex_unlock(&qp_sym_state.lock);
+}
+
+/** Format an address like backtrace_symbols: "object(symbol+0xoffset) [0xaddress]"
+ *
+ * Not async-signal-safe, capture addresses with #QP_STACK_RECORD instead.
+ */
+static inline int qp_sym_format(const void *pc, char *buf, size_t size)
+{
+    const struct qp_sym_entry *entry;
+    int ret;
+
+    pthread_mutex_lock(&qp_sym_state.lock);
+    entry = qp_sym_lookup_locked(pc);
+    if (!entry->module)
+        ret = snprintf(buf, size, "[%p]", pc);
+    else
+        ret = snprintf(buf, size, "%s(%s+%#lx) [%p]", entry->module->name,
+                entry->name ?: "", (unsigned long)entry->offset, pc);
+    pthread_mutex_unlock(&qp_sym_state.lock);
+
+    return ret;
+}
+
+/** Format only the symbol name of an address, or "object+0xoffset" */
+static inline int qp_sym_name(const void *pc, char *buf, size_t size)
+{
+    const struct qp_sym_entry *entry;
+    const char *base;
+    int ret;
+
+    pthread_mutex_lock(&qp_sym_state.lock);
+    entry = qp_sym_lookup_locked(pc);
+    if (!entry->module) {
+        ret = snprintf(buf, size, "[%p]", pc);
+    } else if (entry->name) {
+        ret = snprintf(buf, size, "%s", entry->name);
+    } else {
+        base = strrchr(entry->module->name, '/');
+        ret = snprintf(buf, size, "%s+%#lx", base ? base + 1 : entry->module->name,
+                (unsigned long)entry->offset);
+    }
+    pthread_mutex_unlock(&qp_sym_state.lock);
+
+    return ret;
+}
+
+/** Maximum number of frames in a captured stack */
+#ifndef QP_STACK_DEPTH
+    #define QP_STACK_DEPTH 20
+#endif
+
+/** Number of stacks kept by #QP_STACK_RECORD until #QP_STACK_REPORT */
+#ifndef QP_STACK_LOG_SIZE
+    #define QP_STACK_LOG_SIZE 64
+#endif
+
+/** Raw return addresses, symbolized only when printed */
+struct qp_stack {
+    const char *func;
+    int line;
+    int depth;
+    void *pc[QP_STACK_DEPTH];
+};
+
+struct qp_stack_log_entry {
+    /* Sequence number of the recorded stack, 0 while being written */
+    unsigned long seq;
+    struct qp_stack stack;
+};
+
+struct qp_stack_log {
+    pthread_once_t once;
+    unsigned long head;
+    unsigned long reported;
+    struct qp_stack_log_entry entries[QP_STACK_LOG_SIZE];
+};
+
+QP_GLOBAL struct qp_stack_log qp_stack_log = {
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static inline void qp_stack_prime_once(void)
+{
+    void *pc;
+
+    backtrace(&pc, 1);
+}
+
+/** Load the unwinder ahead of time.
+ *
+ * The first backtrace() loads libgcc_s, which is not async-signal-safe. Call
+ * this before recording stacks from signal handlers.
+ */
+static inline void qp_stack_prime(void)
+{
+    pthread_once(&qp_stack_log.once, qp_stack_prime_once);
+}
+
+/** Capture raw return addresses of the calling code */
+#define QP_STACK_CAPTURE(stack) do { \
+        (stack)->func = __func__; \
+        (stack)->line = __LINE__; \
+        (stack)->depth = backtrace((stack)->pc, QP_STACK_DEPTH); \
+    } while (0)
+
+static inline struct qp_stack *qp_stack_log_reserve(unsigned long *seq)
+{
+    struct qp_stack_log_entry *entry;
+
+    *seq = QP_ATOMIC_ADD(&qp_stack_log.head, 1);
+    entry = &qp_stack_log.entries[(*seq - 1) % QP_STACK_LOG_SIZE];
+    QP_ATOMIC_STORE(&entry->seq, 0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return &entry->stack;
+}
+
+static inline void qp_stack_log_commit(unsigned long seq)
+{
+    QP_ATOMIC_STORE_RELEASE(&qp_stack_log.entries[(seq - 1) % QP_STACK_LOG_SIZE].seq, seq);
+}
+
+/** Copy the oldest stack not reported yet, returns 0 if there is none.
+ *
+ * Stacks overwritten or still being written are added to *lost. Only one
+ * thread should report at a time.
+ */
+static inline int qp_stack_log_next(struct qp_stack *stack, unsigned long *seq,
+        unsigned long *lost)
+{
+    unsigned long head = QP_ATOMIC_LOAD_ACQUIRE(&qp_stack_log.head);
+    unsigned long next = qp_stack_log.reported;
+
+    if (head - next > QP_STACK_LOG_SIZE) {
+        *lost += head - next - QP_STACK_LOG_SIZE;
+        next = head - QP_STACK_LOG_SIZE;
+    }
+    while (next < head) {
+        struct qp_stack_log_entry *entry = &qp_stack_log.entries[next % QP_STACK_LOG_SIZE];
+
+        ++next;
+        if (QP_ATOMIC_LOAD_ACQUIRE(&entry->seq) != next) {
+            ++*lost;
+            continue;
+        }
+        *stack = entry->stack;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (QP_ATOMIC_LOAD(&entry->seq) != next) {
+            ++*lost;
+            continue;
+        }
+        qp_stack_log.reported = next;
+        *seq = next;
+        return 1;
+    }
+    qp_stack_log.reported = next;
+
+    return 0;
+}
+
+/** Record the current stack for a later #QP_STACK_REPORT
+ *
+ * Only raw addresses are stored. This is async-signal-safe after
+ * qp_stack_prime().
+ */
+#define QP_STACK_RECORD() do { \
+        unsigned long qp_stack_seq; \
+        struct qp_stack *qp_stack = qp_stack_log_reserve(&qp_stack_seq); \
+        QP_STACK_CAPTURE(qp_stack); \
+        qp_stack_log_commit(qp_stack_seq); \
+    } while (0)
+
+#define QP__STACK_PRINT_FRAMES(stack) do { \
+        char qp_sym_buf[QP_SYM_LINE_SIZE]; \
+        int qp_frame; \
+        for (qp_frame = 0; qp_frame < (stack)->depth; ++qp_frame) { \
+            qp_sym_format((stack)->pc[qp_frame], qp_sym_buf, sizeof(qp_sym_buf)); \
+            QP_LINE_PRINT("[%d]: %s" QP_NL, qp_frame, qp_sym_buf); \
+        } \
+    } while (0)
+
+/** Symbolize and print stacks saved by #QP_STACK_RECORD since the last report */
+#define QP_STACK_REPORT() do { \
+        QP__DUMP_SITE_DECLARE("stack #%lu recorded at %s(%d):" QP_NL); \
+        struct qp_stack qp_stack; \
+        unsigned long qp_stack_seq, qp_stack_lost = 0; \
+        QP__DUMP_SITE_CHECK(); \
+        while (qp_stack_log_next(&qp_stack, &qp_stack_seq, &qp_stack_lost)) { \
+            QP_LINE_HOLD(); \
+            QP__DUMP_LINE_PRINT_LOC("stack #%lu recorded at %s(%d):" QP_NL, \
+                    qp_stack_seq, qp_stack.func, qp_stack.line); \
+            QP__STACK_PRINT_FRAMES(&qp_stack); \
+            QP_LINE_FLUSH(); \
+        } \
+        if (qp_stack_lost) \
+            QP_PRINT_LOC("stacks lost=%lu" QP_NL, qp_stack_lost); \
+    } while (0)
+
+/* Stack aggregation.
+ *
+ * Identical stacks are merged in an open addressing table with a count and
+ * a total weight (usually nanoseconds), then printed in the collapsed stack
+ * format read by flamegraph.pl: "root;...;leaf weight".
+ */
+
+/** Buffer size for one collapsed stack line */
+#ifndef QP_STACK_AGG_LINE_SIZE
+    #define QP_STACK_AGG_LINE_SIZE 2048
+#endif
+
+struct qp_stack_agg {
+    /* Hash of the addresses, 0 for an unused entry */
+    unsigned long hash;
+    int depth;
+    void *pc[QP_STACK_DEPTH];
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+};
+
+/** Add a stack to a table of size entries (a power of 2).
+ *
+ * Returns 1 for a new entry, 0 if the table is full and -1 otherwise.
+ */
+static inline int qp_stack_agg_add(struct qp_stack_agg *table, unsigned int size,
+        void *const *pc, int depth, unsigned long long count, unsigned long long dur)
+{
+    unsigned long hash = 14695981039346656037UL;
+    struct qp_stack_agg *entry;
+    unsigned int i;
+    int d, ret = -1;
+
+    for (d = 0; d < depth; ++d)
+        hash = (hash ^ (uintptr_t)pc[d]) * 1099511628211UL;
+    hash |= 1;
+
+    for (i = 0; i < size; ++i) {
+        entry = &table[(hash + i) & (size - 1)];
+        if (!entry->hash) {
+            entry->hash = hash;
+            entry->depth = depth;
+            memcpy(entry->pc, pc, depth * sizeof(pc[0]));
+            ret = 1;
+            break;
+        }
+        if (entry->hash == hash && entry->depth == depth &&
+                !memcmp(entry->pc, pc, depth * sizeof(pc[0])))
+            break;
+    }
+    if (i == size)
+        return 0;
+    entry->count += count;
+    entry->total_ns += dur;
+    if (dur > entry->max_ns)
+        entry->max_ns = dur;
+
+    return ret;
+}
+
+/** Format a stack from root to leaf, weighted by total nanoseconds
+ *  (or by count with QP_STACK_AGG_WEIGHT_COUNT).
+ */
+static inline int qp_stack_agg_format(const struct qp_stack_agg *entry, char *buf, size_t size)
+{
+    char name[QP_SYM_LINE_SIZE];
+    size_t len = 0;
+    int i;
+
+    for (i = entry->depth - 1; i >= 0 && len < size; --i) {
+        qp_sym_name(entry->pc[i], name, sizeof(name));
+        len += snprintf(buf + len, size - len, "%s%s",
+                i == entry->depth - 1 ? "" : ";", name);
+    }
+    if (len >= size)
+        len = size - 1;
+#ifdef QP_STACK_AGG_WEIGHT_COUNT
+    return len + snprintf(buf + len, size - len, " %llu", entry->count);
+#else
+    return len + snprintf(buf + len, size - len, " %llu", entry->total_ns);
+#endif
+}
+
+/* Sampling profiler.
+ *
+ * QP_SAMPLER_START(hz) arms ITIMER_PROF, so SIGPROF arrives hz times per
+ * second of CPU time used by the process and interrupts whichever thread is
+ * running. The handler only reserves a slot in a preallocated sample buffer
+ * with an atomic increment and stores the raw return addresses there.
+ * QP_SAMPLER_REPORT symbolizes and aggregates samples by function into
+ * collapsed stacks weighted by estimated CPU nanoseconds.
+ */
+
+/** Number of samples kept between QP_SAMPLER_START and QP_SAMPLER_STOP
+ *  (must be a power of 2), later samples are counted as dropped.
+ */
+#ifndef QP_SAMPLER_SAMPLES
+    #define QP_SAMPLER_SAMPLES 8192
+#endif
+
+/** Frames of the signal handler and the signal return trampoline */
+#define QP_SAMPLER_SKIP_FRAMES 2
+
+struct qp_sample {
+    /* Set once the sample is complete */
+    int done;
+    int depth;
+    void *pc[QP_STACK_DEPTH + QP_SAMPLER_SKIP_FRAMES];
+};
+
+struct qp_sampler {
+    int running;
+    unsigned int hz;
+    unsigned long head;
+    unsigned long dropped;
+    struct qp_sample *samples;
+    struct sigaction old_action;
+};
+
+QP_GLOBAL struct qp_sampler qp_sampler;
+
+static void qp_sampler_handler(int sig)
+{
+    int saved_errno = errno;
+    unsigned long idx = QP_ATOMIC_ADD(&qp_sampler.head, 1) - 1;
+    struct qp_sample *samples = QP_ATOMIC_LOAD_ACQUIRE(&qp_sampler.samples);
+
+    if (samples && idx < QP_SAMPLER_SAMPLES) {
+        samples[idx].depth = backtrace(samples[idx].pc, QP_STACK_DEPTH + QP_SAMPLER_SKIP_FRAMES);
+        QP_ATOMIC_STORE_RELEASE(&samples[idx].done, 1);
+    } else {
+        QP_ATOMIC_ADD(&qp_sampler.dropped, 1);
+    }
+    errno = saved_errno;
+}
+
+/** Start sampling hz times per CPU second, discarding previous samples.
+ *
+ * Returns 0 or a negative errno. Installs a SIGPROF handler, system calls
+ * interrupted by it are restarted.
+ */
+static inline int qp_sampler_start(unsigned int hz)
+{
+    struct qp_sample *samples;
+    struct sigaction sa;
+    struct itimerval it;
+
+    if (qp_sampler.running)
+        return -EBUSY;
+    if (!hz || hz > 1000000)
+        return -EINVAL;
+    samples = (struct qp_sample *)calloc(QP_SAMPLER_SAMPLES, sizeof(*samples));
+    if (!samples)
+        return -ENOMEM;
+    qp_stack_prime();
+
+    free(qp_sampler.samples);
+    qp_sampler.hz = hz;
+    qp_sampler.head = 0;
+    qp_sampler.dropped = 0;
+    QP_ATOMIC_STORE_RELEASE(&qp_sampler.samples, samples);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = qp_sampler_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &qp_sampler.old_action))
+        return -errno;
+
+    it.it_interval.tv_sec = (1000000 / hz) / 1000000;
+    it.it_interval.tv_usec = (1000000 / hz) % 1000000;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL)) {
+        int err = errno;
+        sigaction(SIGPROF, &qp_sampler.old_action, NULL);
+        return -err;
+    }
+    qp_sampler.running = 1;
+
+    return 0;
+}
+
+/** Stop sampling, samples are kept for QP_SAMPLER_REPORT */
+static inline void qp_sampler_stop(void)
+{
+    struct itimerval it;
+
+    if (!qp_sampler.running)
+        return;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    /* Discard a SIGPROF still pending, the old action may be SIG_DFL */
+    signal(SIGPROF, SIG_IGN);
+    sigaction(SIGPROF, &qp_sampler.old_action, NULL);
+    qp_sampler.running = 0;
+}
+
+/** Aggregate samples by function, returns a table of QP_SAMPLER_SAMPLES
+ *  entries to free() or NULL. *nsamples is the number of samples taken.
+ */
+static inline struct qp_stack_agg *qp_sampler_aggregate(unsigned long *nsamples)
+{
+    unsigned long head = QP_ATOMIC_LOAD_ACQUIRE(&qp_sampler.head);
+    unsigned long long period_ns = 1000000000ULL / (qp_sampler.hz ?: 1);
+    struct qp_sample *samples = QP_ATOMIC_LOAD_ACQUIRE(&qp_sampler.samples);
+    struct qp_stack_agg *table;
+    struct qp_sym_entry sym;
+    void *pc[QP_STACK_DEPTH];
+    unsigned long i;
+    int d, depth;
+
+    *nsamples = head;
+    if (!samples)
+        return NULL;
+    table = (struct qp_stack_agg *)calloc(QP_SAMPLER_SAMPLES, sizeof(*table));
+    if (!table)
+        return NULL;
+    for (i = 0; i < head && i < QP_SAMPLER_SAMPLES; ++i) {
+        if (!QP_ATOMIC_LOAD_ACQUIRE(&samples[i].done))
+            continue;
+        depth = samples[i].depth - QP_SAMPLER_SKIP_FRAMES;
+        for (d = 0; d < depth; ++d) {
+            /* Merge samples from anywhere in the same function */
+            qp_sym_lookup(samples[i].pc[d + QP_SAMPLER_SKIP_FRAMES], &sym);
+            pc[d] = sym.name ? (char *)sym.pc - sym.offset : (char *)sym.pc;
+        }
+        if (depth > 0)
+            qp_stack_agg_add(table, QP_SAMPLER_SAMPLES, pc, depth, 1, period_ns);
+    }
+
+    return table;
+}
+
+/** Start the sampling profiler, see qp_sampler_start() */
+#define QP_SAMPLER_START(hz) qp_sampler_start(hz)
+
+/** Stop the sampling profiler */
+#define QP_SAMPLER_STOP() qp_sampler_stop()
+
+/** Print samples taken since QP_SAMPLER_START as collapsed stacks */
+#define QP_SAMPLER_REPORT() do { \
+        char qp_sampler_buf[QP_STACK_AGG_LINE_SIZE]; \
+        unsigned long qp_sampler_n; \
+        unsigned int qp_sampler_i; \
+        struct qp_stack_agg *qp_sampler_table = qp_sampler_aggregate(&qp_sampler_n); \
+        QP_PRINT_LOC("sampler hz=%u samples=%lu dropped=%lu" QP_NL, \
+                qp_sampler.hz, qp_sampler_n, QP_ATOMIC_LOAD(&qp_sampler.dropped)); \
+        for (qp_sampler_i = 0; qp_sampler_table && qp_sampler_i < QP_SAMPLER_SAMPLES; ++qp_sampler_i) { \
+            if (!qp_sampler_table[qp_sampler_i].hash) \
+                continue; \
+            qp_stack_agg_format(&qp_sampler_table[qp_sampler_i], \
+                    qp_sampler_buf, sizeof(qp_sampler_buf)); \
+            QP_PRINT("%s" QP_NL, qp_sampler_buf); \
+        } \
+        free(qp_sampler_table); \
+    } while (0)
+#endif /* QP_PROJECT_GLIBC */
+
+/* Stack dumping. */
+#if defined(__KERNEL__)
+    /* Kernel */
+    #define QP_DUMP_STACK() dump_stack()
+
+    #define QP_DUMP_SYMBOL(ptr) \
+            QP_PRINT_LOC(#ptr "=%pS" QP_NL, (void*)(ptr))
+#else
+    /* GLIBC */
+    #define QP_DUMP_STACK() do { \
+            QP__DUMP_SITE_DECLARE("[%d]: %s" QP_NL); \
+            struct qp_stack qp_stack; \
+            QP__DUMP_SITE_CHECK(); \
+            QP_STACK_CAPTURE(&qp_stack); \
+            QP_LINE_HOLD(); \
+            QP__STACK_PRINT_FRAMES(&qp_stack); \
+            QP_LINE_FLUSH(); \
+        } while (0)
+
+    #define QP_DUMP_SYMBOL(ptr) do { \
+            char qp_sym_buf[QP_SYM_LINE_SIZE]; \
+            qp_sym_format((const void *)(ptr), qp_sym_buf, sizeof(qp_sym_buf)); \
+            QP_PRINT_LOC(#ptr "=%s" QP_NL, qp_sym_buf); \
+        } while (0)
+#endif
+
+#define QP_DUMP_STACK_RATELIMIT() do { \
+        if (QP_RATELIMIT(5000)) { \
+            QP_DUMP_STACK(); \
+        } \
+    } while (0)
+
+/* Log-linear latency histogram.
+ *
+ * Values below 2^QP_HIST_SUB_BITS get exact buckets, above that every power
+ * of two is split into 2^QP_HIST_SUB_BITS linear sub-buckets, for a relative
+ * error of at most 12.5% with the default 3 bits. Values of 2^QP_HIST_OCTAVES
+ * and above (about 18 minutes in nanoseconds) share the last bucket.
+ */
+#ifndef QP_HIST_SUB_BITS
+    #define QP_HIST_SUB_BITS 3
+#endif
+#ifndef QP_HIST_OCTAVES
+    #define QP_HIST_OCTAVES 40
+#endif
+#define QP_HIST_SUB (1 << QP_HIST_SUB_BITS)
+#define QP_HIST_BUCKETS ((QP_HIST_OCTAVES - QP_HIST_SUB_BITS + 1) * QP_HIST_SUB)
+
+static inline unsigned int qp_hist_bucket(unsigned long long val)
+{
+    unsigned int exp;
+
+    if (val < QP_HIST_SUB)
+        return val;
+    exp = 63 - __builtin_clzll(val);
+    if (exp >= QP_HIST_OCTAVES)
+        return QP_HIST_BUCKETS - 1;
+    return (exp - QP_HIST_SUB_BITS + 1) * QP_HIST_SUB +
+            ((val >> (exp - QP_HIST_SUB_BITS)) & (QP_HIST_SUB - 1));
+}
+
+/** Lowest value counted in a bucket */
+static inline unsigned long long qp_hist_bucket_low(unsigned int bucket)
+{
+    unsigned int exp;
+
+    if (bucket < QP_HIST_SUB)
+        return bucket;
+    exp = bucket / QP_HIST_SUB + QP_HIST_SUB_BITS - 1;
+    return (1ULL << exp) +
+            ((unsigned long long)(bucket % QP_HIST_SUB) << (exp - QP_HIST_SUB_BITS));
+}
+
+/** Highest value counted in a bucket */
+static inline unsigned long long qp_hist_bucket_high(unsigned int bucket)
+{
+    if (bucket + 1 >= QP_HIST_BUCKETS)
+        return ~0ULL;
+    return qp_hist_bucket_low(bucket + 1) - 1;
+}
+
+/** Value at a percentile given in units of 0.001%, optionally relative to
+ *  an older copy of the same histogram. The result is clamped to max.
+ */
+static inline unsigned long long qp_hist_percentile(const QP_LONG_COUNTER_T *hist,
+        const QP_LONG_COUNTER_T *base, unsigned long long pcm, unsigned long long max)
+{
+    QP_LONG_COUNTER_T total = 0, sum = 0, target;
+    unsigned int i;
+
+    for (i = 0; i < QP_HIST_BUCKETS; ++i)
+        total += hist[i] - (base ? base[i] : 0);
+    if (!total)
+        return 0;
+    target = total * pcm;
+    do_div(target, 100000);
+    if (!target)
+        target = 1;
+    for (i = 0; i < QP_HIST_BUCKETS; ++i) {
+        sum += hist[i] - (base ? base[i] : 0);
+        if (sum >= target)
+            break;
+    }
+    if (i >= QP_HIST_BUCKETS || qp_hist_bucket_high(i) > max)
+        return max;
+    return qp_hist_bucket_high(i);
+}
+
+/* Micro-profiling.
+ *
+ * Each region accumulates into per-thread (userspace) or per-CPU (kernel)
+ * shards without locks. Shards are only merged by the thread which wins the
+ * rate limit for the periodic report. Each shard has its own histogram,
+ * allocated on the first record in the shard so that a shard stays one cache
+ * line and only shards in use cost memory. In the kernel the histograms are
+ * freed by #QP_DEBUGFS_EXIT.
+ */
+struct qp_profile_shard {
+    QP_LONG_COUNTER_T usage;
+    QP_LONG_COUNTER_T count;
+    QP_LONG_COUNTER_T inst_max;
+    /* inst_max is only valid if this matches the site epoch */
+    unsigned long epoch;
+    /* QP_HIST_BUCKETS counters, NULL until the first record */
+    QP_LONG_COUNTER_T *hist;
+} __attribute__((aligned(64)));
+
+struct qp_profile_site {
+    const char *func;
+    unsigned int line;
+    unsigned long epoch;
+    QP_LONG_COUNTER_T last_usage;
+    QP_LONG_COUNTER_T last_count;
+    QP_LONG_COUNTER_T max;
+    /* Merged lifetime histogram and its copy at the previous report */
+    QP_LONG_COUNTER_T hist[QP_HIST_BUCKETS];
+    QP_LONG_COUNTER_T last_hist[QP_HIST_BUCKETS];
+    struct qp_stat_site stat;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    struct qp_profile_shard __percpu *shards;
+#elif QP__STAT_SHM
+    /* Set by the first hit, to a slot of the shared segment or the heap */
+    struct qp_profile_shard *shards;
+    /* Calls while shards is NULL because there was no memory for them */
+    QP_LONG_COUNTER_T dropped;
+#else
+    struct qp_profile_shard shards[QP_THREAD_SLOTS];
+#endif
+};
+
+#ifdef QP_PROJECT_LINUX_KERNEL
+    #define QP__PROFILE_SITE_DEFINE(name) \
+        static DEFINE_PER_CPU(struct qp_profile_shard, name##_shards); \
+        static struct qp_profile_site name = { \
+            .func = __func__, \
+            .line = __LINE__, \
+            .stat = QP__STAT_SITE_INIT(QP_STAT_SITE_PROFILE, &name, 1), \
+            .shards = &name##_shards, \
+        }
+#elif QP__STAT_SHM
+    #define QP__PROFILE_SITE_DEFINE(name) \
+        static struct qp_profile_site name = { \
+            .func = __func__, \
+            .line = __LINE__, \
+            .stat = QP__STAT_SITE_INIT(QP_STAT_SITE_PROFILE, &name, 1), \
+        }
+#else
+    #define QP__PROFILE_SITE_DEFINE(name) \
+        static struct qp_profile_site name = { \
+            .func = __func__, \
+            .line = __LINE__, \
+            .stat = QP__STAT_SITE_INIT(QP_STAT_SITE_PROFILE, &name, 1), \
+        }
+#endif
+
+/** Histogram of a shard, allocated on the first record in the shard.
+ *
+ * Only the shared thread slot can race here. Returns NULL if out of memory,
+ * the record is then missing from the percentiles only.
+ */
+static inline QP_LONG_COUNTER_T *qp_profile_shard_hist(struct qp_profile_shard *shard)
+{
+    QP_LONG_COUNTER_T *hist = QP_ATOMIC_LOAD_ACQUIRE(&shard->hist);
+    QP_LONG_COUNTER_T *cur = NULL;
+
+    if (likely(hist))
+        return hist;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    /* Called with interrupts disabled */
+    hist = kcalloc(QP_HIST_BUCKETS, sizeof(*hist), GFP_ATOMIC);
+#else
+    hist = calloc(QP_HIST_BUCKETS, sizeof(*hist));
+#endif
+    if (!hist || QP_ATOMIC_CAS(&shard->hist, &cur, hist))
+        return hist;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    kfree(hist);
+#else
+    free(hist);
+#endif
+
+    return cur;
+}
+
+static inline void qp_profile_record(struct qp_profile_site *site, QP_LONG_COUNTER_T dur)
+{
+    unsigned long epoch = QP_ATOMIC_LOAD(&site->epoch);
+    unsigned int bucket = qp_hist_bucket(dur);
+    struct qp_profile_shard *shard;
+    QP_LONG_COUNTER_T *hist;
+#ifdef QP_PROJECT_LINUX_KERNEL
+    unsigned long flags;
+
+    /* Interrupts can hit the same region on this CPU */
+    local_irq_save(flags);
+    shard = this_cpu_ptr(site->shards);
+    hist = qp_profile_shard_hist(shard);
+#else
+    int slot = qp_thread_slot();
+
+#if QP__STAT_SHM
+    if (unlikely(!site->shards)) {
+        QP_ATOMIC_ADD(&site->dropped, 1);
+        return;
+    }
+#endif
+    shard = &site->shards[slot];
+    hist = qp_profile_shard_hist(shard);
+    if (unlikely(slot == QP_THREAD_SLOT_SHARED)) {
+        QP_LONG_COUNTER_T max;
+
+        QP_ATOMIC_ADD(&shard->usage, dur);
+        QP_ATOMIC_ADD(&shard->count, 1);
+        if (hist)
+            QP_ATOMIC_ADD(&hist[bucket], 1);
+        if (QP_ATOMIC_LOAD(&shard->epoch) != epoch) {
+            QP_ATOMIC_STORE(&shard->inst_max, dur);
+            QP_ATOMIC_STORE(&shard->epoch, epoch);
+            return;
+        }
+        max = QP_ATOMIC_LOAD(&shard->inst_max);
+        while (dur > max && !QP_ATOMIC_CAS(&shard->inst_max, &max, dur))
+            ;
+        return;
+    }
+#endif
+    QP_ATOMIC_STORE(&shard->usage, shard->usage + dur);
+    QP_ATOMIC_STORE(&shard->count, shard->count + 1);
+    if (likely(hist))
+        QP_ATOMIC_STORE(&hist[bucket], hist[bucket] + 1);
+    if (shard->epoch != epoch) {
+        QP_ATOMIC_STORE(&shard->inst_max, dur);
+        QP_ATOMIC_STORE(&shard->epoch, epoch);
+    } else if (dur > shard->inst_max) {
+        QP_ATOMIC_STORE(&shard->inst_max, dur);
+    }
+#ifdef QP_PROJECT_LINUX_KERNEL
+    local_irq_restore(flags);
+#endif
+}
+
+/** Sum all shards into hist without modifying the site, inst_max is the
+ *  maximum of the current interval.
+ */
+static inline void qp_profile_sum(struct qp_profile_site *site,
+        QP_LONG_COUNTER_T *usage, QP_LONG_COUNTER_T *count,
+        QP_LONG_COUNTER_T *inst_max, QP_LONG_COUNTER_T *hist)
+{
+    unsigned long epoch = QP_ATOMIC_LOAD(&site->epoch);
+    struct qp_profile_shard *shard;
+    QP_LONG_COUNTER_T *shard_hist;
+    unsigned int j;
+    int i;
+
+    *usage = *count = *inst_max = 0;
+    memset(hist, 0, QP_HIST_BUCKETS * sizeof(*hist));
+#if QP__STAT_SHM
+    if (!site->shards)
+        return;
+#endif
+#ifdef QP_PROJECT_LINUX_KERNEL
+    for_each_possible_cpu(i) {
+        shard = per_cpu_ptr(site->shards, i);
+#else
+    for (i = 0; i < QP_THREAD_SLOTS; ++i) {
+        shard = &site->shards[i];
+#endif
+        *usage += QP_ATOMIC_LOAD(&shard->usage);
+        *count += QP_ATOMIC_LOAD(&shard->count);
+        if (QP_ATOMIC_LOAD(&shard->epoch) == epoch &&
+                QP_ATOMIC_LOAD(&shard->inst_max) > *inst_max)
+            *inst_max = QP_ATOMIC_LOAD(&shard->inst_max);
+        shard_hist = QP_ATOMIC_LOAD_ACQUIRE(&shard->hist);
+        if (!shard_hist)
+            continue;
+        for (j = 0; j < QP_HIST_BUCKETS; ++j)
+            hist[j] += QP_ATOMIC_LOAD(&shard_hist[j]);
+    }
+}
+
+#ifdef QP_PROJECT_LINUX_KERNEL
+/** Free the shard histograms, nothing may record in the site any more */
+static inline void qp_profile_free(struct qp_profile_site *site)
+{
+    struct qp_profile_shard *shard;
+    int i;
+
+    for_each_possible_cpu(i) {
+        shard = per_cpu_ptr(site->shards, i);
+        kfree(shard->hist);
+        shard->hist = NULL;
+    }
+}
+#endif
+
+/** Sum all shards into site->hist, optionally starting a new inst_max interval */
+static inline void qp_profile_merge(struct qp_profile_site *site,
+        QP_LONG_COUNTER_T *usage, QP_LONG_COUNTER_T *count,
+        QP_LONG_COUNTER_T *inst_max, int new_interval)
+{
+    unsigned long epoch = QP_ATOMIC_LOAD(&site->epoch);
+
+    qp_profile_sum(site, usage, count, inst_max, site->hist);
+    if (*inst_max > site->max)
+        site->max = *inst_max;
+    if (new_interval)
+        QP_ATOMIC_STORE(&site->epoch, epoch + 1);
+}
+
+#define QP_PROFILE_PERCENTILES 4
+
+/** Interval and lifetime percentiles from a merged site, then start a new
+ *  interval. Fills p50, p90, p99 and p99.9 for each.
+ */
+static inline void qp_profile_percentiles(struct qp_profile_site *site,
+        QP_LONG_COUNTER_T inst_max,
+        QP_LONG_COUNTER_T *interval, QP_LONG_COUNTER_T *lifetime)
+{
+    static const unsigned int pcm[QP_PROFILE_PERCENTILES] = {
+        50000, 90000, 99000, 99900,
+    };
+    int i;
+
+    for (i = 0; i < QP_PROFILE_PERCENTILES; ++i) {
+        interval[i] = qp_hist_percentile(site->hist, site->last_hist, pcm[i], inst_max);
+        lifetime[i] = qp_hist_percentile(site->hist, NULL, pcm[i], site->max);
+    }
+    memcpy(site->last_hist, site->hist, sizeof(site->hist));
+}
+
+#if QP_STAT_REGISTRY
+/** Buffer size for the counters of one site */
+#ifndef QP_STAT_LINE_SIZE
+    #define QP_STAT_LINE_SIZE 512
+#endif
+
+/** Append n bytes of str at buf + len, truncating like snprintf.
+ *  Returns the length buf would have without truncation.
+ */
+static inline size_t qp_stat_append(char *buf, size_t size, size_t len,
+        const char *str, size_t n)
+{
+    if (len + 1 < size)
+        memcpy(buf + len, str, len + n < size ? n : size - len - 1);
+    if (size)
+        buf[len + n < size ? len + n : size - 1] = '\0';
+
+    return len + n;
+}
+
+/** Append prefix, val in decimal and suffix, see qp_stat_append() */
+static inline size_t qp_stat_append_dec(char *buf, size_t size, size_t len,
+        const char *prefix, unsigned long long val, const char *suffix)
+{
+    char dec[20];
+    char *first = qp_fmt_dec(dec + sizeof(dec), val);
+
+    len = qp_stat_append(buf, size, len, prefix, strlen(prefix));
+    len = qp_stat_append(buf, size, len, first, dec + sizeof(dec) - first);
+
+    return qp_stat_append(buf, size, len, suffix, strlen(suffix));
+}
+
+/** Format the current counters of a site on one line.
+ *
+ * hist is scratch space for QP_HIST_BUCKETS counters. Only reads counters,
+ * periodic reports are not affected. Returns the length like snprintf.
+ * Nothing is locked, allocated or printed with stdio, so this is
+ * async-signal-safe.
+ */
+static inline int qp_stat_site_format(struct qp_stat_site *site,
+        QP_LONG_COUNTER_T *hist, char *buf, size_t size)
+{
+    static const unsigned int pcm[QP_PROFILE_PERCENTILES] = {
+        50000, 90000, 99000, 99900,
+    };
+    static const char *const pct_names[QP_PROFILE_PERCENTILES] = {
+        " p50=", " p90=", " p99=", " p99.9=",
+    };
+    QP_LONG_COUNTER_T usage, count, inst_max, max, avg, *cnt;
+    struct qp_profile_site *profile;
+    size_t len = 0;
+    unsigned int i;
+
+    switch (site->type) {
+    case QP_STAT_SITE_RATELIMIT:
+        return qp_stat_append_dec(buf, size, 0, "cnt=",
+                QP_ATOMIC_LOAD((QP_LONG_COUNTER_T *)site->data), "");
+    case QP_STAT_SITE_PROFILE:
+        profile = site->data;
+#if QP__STAT_SHM
+        if (!profile->shards)
+            return qp_stat_append_dec(buf, size, 0, "not counted, no memory: dropped=",
+                    QP_ATOMIC_LOAD(&profile->dropped), "");
+#endif
+        qp_profile_sum(profile, &usage, &count, &inst_max, hist);
+        max = QP_ATOMIC_LOAD(&profile->max);
+        if (inst_max > max)
+            max = inst_max;
+        avg = usage;
+        if (count)
+            do_div(avg, count);
+        len = qp_stat_append_dec(buf, size, len, "calls=", count, "");
+        len = qp_stat_append_dec(buf, size, len, " usage=", usage, "ns");
+        len = qp_stat_append_dec(buf, size, len, " avg_dur=", avg, "ns");
+        len = qp_stat_append_dec(buf, size, len, " max=", max, "ns");
+        for (i = 0; i < QP_PROFILE_PERCENTILES && len < size; ++i)
+            len = qp_stat_append_dec(buf, size, len, pct_names[i],
+                    qp_hist_percentile(hist, NULL, pcm[i], max), "ns");
+        return len;
+    case QP_STAT_SITE_HIST:
+        cnt = site->data;
+        if (size)
+            buf[0] = '\0';
+        for (i = 0; i < site->size && len < size; ++i) {
+            if (QP_ATOMIC_LOAD(&cnt[i])) {
+                len = qp_stat_append_dec(buf, size, len, len ? " cnt[" : "cnt[", i, "]=");
+                len = qp_stat_append_dec(buf, size, len, "", QP_ATOMIC_LOAD(&cnt[i]), "");
+            }
+        }
+        return len;
+    }
+
+    return qp_stat_append(buf, size, 0, "unknown", 7);
+}
+#endif
+
+#if QP_STAT_REGISTRY && defined(QP_PROJECT_LINUX_KERNEL)
+/* Debugfs export.
+ *
+ * Each registered site gets a directory "func:line" under
+ * "qp-<module>/<file>" with:
+ * - counters: current totals, computed when read
+ * - hist: "low high count" lines of the lifetime histogram (profile sites)
+ * - enable: 1 while periodic reports are printed, write 0 to only pull
+ *
+ * Sites register on their first hit, possibly in atomic context, so the
+ * files are created later from a work item. The registry is per translation
+ * unit, call #QP_DEBUGFS_INIT from each file that uses the QP macros. Names
+ * already taken, such as sites of a header inlined into several functions or
+ * files with the same base name, get a "#2", "#3"... suffix.
+ */
+
+static inline int qp_debugfs_counters_show(struct seq_file *m, void *v)
+{
+    QP_LONG_COUNTER_T *hist;
+    char *buf;
+
+    hist = kcalloc(QP_HIST_BUCKETS, sizeof(*hist), GFP_KERNEL);
+    buf = kmalloc(QP_STAT_LINE_SIZE, GFP_KERNEL);
+    if (hist && buf) {
+        qp_stat_site_format(m->private, hist, buf, QP_STAT_LINE_SIZE);
+        seq_printf(m, "%s\n", buf);
+    }
+    kfree(buf);
+    kfree(hist);
+
+    return hist && buf ? 0 : -ENOMEM;
+}
+
+static inline int qp_debugfs_hist_show(struct seq_file *m, void *v)
+{
+    struct qp_stat_site *site = m->private;
+    QP_LONG_COUNTER_T usage, count, inst_max;
+    QP_LONG_COUNTER_T *hist;
+    unsigned int i;
+
+    hist = kcalloc(QP_HIST_BUCKETS, sizeof(*hist), GFP_KERNEL);
+    if (!hist)
+        return -ENOMEM;
+    qp_profile_sum(site->data, &usage, &count, &inst_max, hist);
+    for (i = 0; i < QP_HIST_BUCKETS; ++i) {
+        if (hist[i])
+            seq_printf(m, "%llu %llu %llu\n", qp_hist_bucket_low(i),
+                    qp_hist_bucket_high(i), hist[i]);
+    }
+    kfree(hist);
+
+    return 0;
+}
+
+static inline int qp_debugfs_counters_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, qp_debugfs_counters_show, inode->i_private);
+}
+
+static inline int qp_debugfs_hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, qp_debugfs_hist_show, inode->i_private);
+}
+
+QP_GLOBAL const struct file_operations qp_debugfs_counters_fops = {
+    .owner = THIS_MODULE,
+    .open = qp_debugfs_counters_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+QP_GLOBAL const struct file_operations qp_debugfs_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = qp_debugfs_hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/** Create directory @name under @parent, suffixing @name if it is taken */
+static inline struct dentry *qp_debugfs_create_dir(char *name, size_t size,
+        struct dentry *parent)
+{
+    struct dentry *dentry;
+    size_t len = strlen(name);
+    unsigned int i;
+
+    for (i = 2; (dentry = debugfs_lookup(name, parent)); ++i) {
+        dput(dentry);
+        snprintf(name + len, size - len, "#%u", i);
+    }
+
+    return debugfs_create_dir(name, parent);
+}
+
+/** Create files for sites registered since the last export.
+ *
+ * Returns the number of sites skipped because their directory could not be
+ * created, *err is then the last error. Skipped sites are retried by the
+ * next export unless a newer site was exported after them.
+ */
+static inline int qp_debugfs_export(int *err)
+{
+    struct qp_stat_site *site;
+    char name[64];
+    int skipped = 0;
+
+    /* New sites are pushed in front, stop at the first one already exported */
+    for (site = QP_ATOMIC_LOAD_ACQUIRE(&qp_stat_registry.sites);
+            site && !site->dentry; site = site->next) {
+        snprintf(name, sizeof(name), "%s:%u", site->func, site->line);
+        site->dentry = qp_debugfs_create_dir(name, sizeof(name), qp_stat_registry.dir);
+        if (IS_ERR_OR_NULL(site->dentry)) {
+            *err = site->dentry ? PTR_ERR(site->dentry) : -ENOMEM;
+            site->dentry = NULL;
+            ++skipped;
+            continue;
+        }
+        debugfs_create_file("counters", 0444, site->dentry, site,
+                &qp_debugfs_counters_fops);
+        if (site->type == QP_STAT_SITE_PROFILE)
+            debugfs_create_file("hist", 0444, site->dentry, site,
+                    &qp_debugfs_hist_fops);
+        debugfs_create_u32("enable", 0644, site->dentry, &site->print);
+    }
+
+    return skipped;
+}
+
+/** Export sites registered after qp_debugfs_init() */
+static inline void qp_debugfs_work(struct work_struct *work)
+{
+    int err = 0, skipped = qp_debugfs_export(&err);
+
+    if (skipped)
+        pr_warn("qp: %d sites not exported in debugfs: %d\n", skipped, err);
+}
+
+static inline void qp_debugfs_exit(void);
+
+/** Create the debugfs directory of @file and export the sites hit so far,
+ *  call from module init. Fails if any of them could not be exported.
+ */
+static inline int qp_debugfs_init(const char *modname, const char *file)
+{
+    struct dentry *parent, *dir;
+    char name[64];
+    int err = 0;
+
+    /* The first file of the module creates the shared directory */
+    snprintf(name, sizeof(name), "qp-%s", modname);
+    parent = debugfs_lookup(name, NULL);
+    if (!parent) {
+        parent = debugfs_create_dir(name, NULL);
+        if (IS_ERR_OR_NULL(parent))
+            return parent ? PTR_ERR(parent) : -ENODEV;
+        dget(parent);
+    }
+    snprintf(name, sizeof(name), "%s", kbasename(file));
+    dir = qp_debugfs_create_dir(name, sizeof(name), parent);
+    if (IS_ERR_OR_NULL(dir)) {
+        if (simple_empty(parent))
+            debugfs_remove(parent);
+        dput(parent);
+        return dir ? PTR_ERR(dir) : -ENODEV;
+    }
+    qp_stat_registry.parent = parent;
+    qp_stat_registry.dir = dir;
+    /* Sites hit before init, nothing schedules the work yet */
+    if (qp_debugfs_export(&err)) {
+        qp_debugfs_exit();
+        return err;
+    }
+    INIT_WORK(&qp_stat_registry.work, qp_debugfs_work);
+    WRITE_ONCE(qp_stat_registry.active, 1);
+    /* Sites hit since the export above */
+    schedule_work(&qp_stat_registry.work);
+
+    return 0;
+}
+
+/** Remove the debugfs directory and free the profile histograms, call from
+ *  module exit even without qp_debugfs_init().
+ */
+static inline void qp_debugfs_exit(void)
+{
+    struct qp_stat_site *site;
+
+    if (READ_ONCE(qp_stat_registry.active)) {
+        WRITE_ONCE(qp_stat_registry.active, 0);
+        /* No qp_stat_site_register can schedule the work after this */
+        synchronize_rcu();
+        cancel_work_sync(&qp_stat_registry.work);
+    }
+    if (qp_stat_registry.parent) {
+        debugfs_remove_recursive(qp_stat_registry.dir);
+        qp_stat_registry.dir = NULL;
+        /* The last file of the module removes the shared directory */
+        if (simple_empty(qp_stat_registry.parent))
+            debugfs_remove(qp_stat_registry.parent);
+        dput(qp_stat_registry.parent);
+        qp_stat_registry.parent = NULL;
+    }
+    /* No file can read the histograms any more */
+    for (site = qp_stat_registry.sites; site; site = site->next) {
+        site->dentry = NULL;
+        if (site->type == QP_STAT_SITE_PROFILE)
+            qp_profile_free(site->data);
+    }
+}
+
+/** Export the registered sites in /sys/kernel/debug/qp-KBUILD_MODNAME/<file> */
+#define QP_DEBUGFS_INIT() qp_debugfs_init(KBUILD_MODNAME, __FILE__)
+
+#define QP_DEBUGFS_EXIT() qp_debugfs_exit()
+#endif
+
+#if QP_STAT_REGISTRY && defined(QP_PROJECT_GLIBC)
+/* Snapshot of all registered sites.
+ *
+ * qp_snapshot() writes one "func(line): counters" line per site hit so far,
+ * #QP_SNAPSHOT prints the same through QP_PRINT. With
+ * QP_STAT_SITE_PRINT_DEFAULT set to 0 the periodic reports are off and the
+ * counters are only collected by snapshots, for example on SIGUSR1 and at
+ * exit after qp_snapshot_install().
+ */
+
+/** Signal which triggers a snapshot after qp_snapshot_install() */
+#ifndef QP_SNAPSHOT_SIGNAL
+    #define QP_SNAPSHOT_SIGNAL SIGUSR1
+#endif
+
+struct qp_snapshot_state {
+    int installed;
+    int fd;
+};
+
+QP_GLOBAL struct qp_snapshot_state qp_snapshot_state;
+
+/** Format one snapshot line of a site, including its location */
+static inline int qp_snapshot_format(struct qp_stat_site *site,
+        QP_LONG_COUNTER_T *hist, char *buf, size_t size)
+{
+    size_t len = qp_stat_append(buf, size, 0, site->func, strlen(site->func));
+
+    len = qp_stat_append_dec(buf, size, len, "(", site->line, "): ");
+    if (len >= size)
+        return len;
+    return len + qp_stat_site_format(site, hist, buf + len, size - len);
+}
+
+/** Write all registered sites to fd, returns the number of sites.
+ *
+ * Counters are read without locks and lines are formatted without stdio or
+ * allocations, then written with write(), so this can run from a signal
+ * handler. Sites being hit concurrently may be off by the calls in flight.
+ */
+static inline int qp_snapshot(int fd)
+{
+    QP_LONG_COUNTER_T hist[QP_HIST_BUCKETS];
+    char buf[QP_STAT_LINE_SIZE + 1];
+    struct qp_stat_site *site;
+    int nsites = 0;
+    int len;
+
+    for (site = QP_ATOMIC_LOAD_ACQUIRE(&qp_stat_registry.sites); site; site = site->next) {
+        len = qp_snapshot_format(site, hist, buf, QP_STAT_LINE_SIZE);
+        if (len < 0)
+            continue;
+        if (len >= QP_STAT_LINE_SIZE)
+            len = QP_STAT_LINE_SIZE - 1;
+        buf[len++] = '\n';
+        if (write(fd, buf, len) < 0)
+            break;
+        ++nsites;
+    }
+
+    return nsites;
+}
+
+static inline void qp_snapshot_signal(int signo)
+{
+    int saved_errno = errno;
+
+    qp_snapshot(qp_snapshot_state.fd);
+    errno = saved_errno;
+}
+
+static inline void qp_snapshot_exit(void)
+{
+    qp_snapshot(qp_snapshot_state.fd);
+}
+
+/** Write snapshots to fd on QP_SNAPSHOT_SIGNAL and at exit.
+ *
+ * Only the first call installs the handlers, later calls change the fd.
+ * Returns 0 or -1 with errno set if the signal handler could not be set.
+ */
+static inline int qp_snapshot_install(int fd)
+{
+    struct sigaction sa;
+    int installed = 0;
+
+    QP_ATOMIC_STORE(&qp_snapshot_state.fd, fd);
+    if (!QP_ATOMIC_CAS(&qp_snapshot_state.installed, &installed, 1))
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = qp_snapshot_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(QP_SNAPSHOT_SIGNAL, &sa, NULL)) {
+        QP_ATOMIC_STORE(&qp_snapshot_state.installed, 0);
+        return -1;
+    }
+    atexit(qp_snapshot_exit);
+
+    return 0;
+}
+
+/** Print the counters of all registered sites */
+#define QP_SNAPSHOT() do { \
+        QP__DUMP_SITE_DECLARE("snapshot" QP_NL); \
+        QP_LONG_COUNTER_T qp_snapshot_hist[QP_HIST_BUCKETS]; \
+        char qp_snapshot_buf[QP_STAT_LINE_SIZE]; \
+        struct qp_stat_site *qp_snapshot_site; \
+        QP__DUMP_SITE_CHECK(); \
+        QP_LINE_HOLD(); \
+        QP__DUMP_LINE_PRINT_LOC("snapshot" QP_NL); \
+        for (qp_snapshot_site = QP_ATOMIC_LOAD_ACQUIRE(&qp_stat_registry.sites); \
+                qp_snapshot_site; qp_snapshot_site = qp_snapshot_site->next) { \
+            qp_snapshot_format(qp_snapshot_site, qp_snapshot_hist, \
+                    qp_snapshot_buf, sizeof(qp_snapshot_buf)); \
+            QP_LINE_PRINT("%s" QP_NL, qp_snapshot_buf); \
+        } \
+        QP_LINE_FLUSH(); \
+    } while (0)
+#endif
+
+#if QP__STAT_SHM
+/* Shared memory statistics segment.
+ *
+ * Registered ratelimit and profile sites get a slot in a file mapped shared
+ * (by default in /dev/shm) and their counters are moved there, so updates
+ * stay plain stores to the same per-thread shards as without QP_STAT_SHM.
+ * The "qpstat" tool maps the file read-only and computes rates, averages and
+ * percentiles without any cost for the instrumented process. Profile sites
+ * have no counters of their own: the first hit attaches the site before
+ * counting while other threads hitting it wait. Sites which do not fit in
+ * the segment count in a slot allocated on the heap instead, or are only
+ * counted as dropped if that fails.
+ *
+ * File layout (native byte order): struct qp_stat_shm_hdr, then max_sites
+ * slots of site_size bytes starting at hdr_size. A slot is valid once its
+ * type is non-zero. Sizes in the header must match for a reader to use the
+ * shards and histogram buckets of the slots. Each shard has its histogram in
+ * the slot, the segment is sparse and only pages of shards in use are
+ * backed by memory.
+ */
+
+#define QP_STAT_SHM_MAGIC "QPSTATSM"
+#define QP_STAT_SHM_VERSION 3
+
+/** Segment path, "%d" is replaced by the pid. Can be overridden with the
+ *  QP_STAT_SHM_FILE env var, which is not a printf format: only its first
+ *  "%d" is replaced.
+ */
+#ifndef QP_STAT_SHM_FILE
+    #define QP_STAT_SHM_FILE "/dev/shm/qp-stat.%d"
+#endif
+
+/** Number of site slots in the segment */
+#ifndef QP_STAT_SHM_SITES
+    #define QP_STAT_SHM_SITES 256
+#endif
+
+struct qp_stat_shm_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdr_size;
+    uint32_t site_size;
+    uint32_t max_sites;
+    /* Number of slots handed out, slots may be published out of order */
+    uint32_t nsites;
+    uint32_t pid;
+    uint32_t counter_size;
+    uint32_t thread_slots;
+    uint32_t shard_size;
+    uint32_t hist_buckets;
+    uint32_t hist_sub_bits;
+    /* Profile sites not counted at all, there was no memory for them */
+    uint32_t dropped_sites;
+} __attribute__((aligned(64)));
+
+struct qp_stat_shm_site {
+    /* QP_STAT_SITE_*, stored last */
+    uint32_t type;
+    uint32_t line;
+    char func[64];
+    char file[112];
+    QP_LONG_COUNTER_T count;
+    /* The hist pointers of the shards are only valid in the process */
+    struct qp_profile_shard shards[QP_THREAD_SLOTS];
+    QP_LONG_COUNTER_T hist[QP_THREAD_SLOTS][QP_HIST_BUCKETS];
+};
+
+struct qp_stat_shm_state {
+    pthread_once_t once;
+    struct qp_stat_shm_hdr *hdr;
+    char path[PATH_MAX];
+};
+
+QP_GLOBAL struct qp_stat_shm_state qp_stat_shm_state = {
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static inline void qp_stat_shm_exit(void)
+{
+    unlink(qp_stat_shm_state.path);
+}
+
+/** Segment path from the env var, with its first "%d" replaced by pid */
+static inline void qp_stat_shm_env_path(char *buf, size_t size, const char *env, int pid)
+{
+    const char *pos = strstr(env, "%d");
+
+    if (pos)
+        snprintf(buf, size, "%.*s%d%s", (int)(pos - env), env, pid, pos + 2);
+    else
+        snprintf(buf, size, "%s", env);
+}
+
+static inline void qp_stat_shm_init_once(void)
+{
+    const char *path = getenv("QP_STAT_SHM_FILE");
+    size_t size = sizeof(struct qp_stat_shm_hdr) +
+            QP_STAT_SHM_SITES * sizeof(struct qp_stat_shm_site);
+    struct qp_stat_shm_hdr *hdr;
+    int fd;
+
+    if (path)
+        qp_stat_shm_env_path(qp_stat_shm_state.path, sizeof(qp_stat_shm_state.path),
+                path, getpid());
+    else
+        snprintf(qp_stat_shm_state.path, sizeof(qp_stat_shm_state.path),
+                QP_STAT_SHM_FILE, getpid());
+    fd = open(qp_stat_shm_state.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return;
+    }
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+        return;
+
+    hdr->version = QP_STAT_SHM_VERSION;
+    hdr->hdr_size = sizeof(*hdr);
+    hdr->site_size = sizeof(struct qp_stat_shm_site);
+    hdr->max_sites = QP_STAT_SHM_SITES;
+    hdr->pid = getpid();
+    hdr->counter_size = sizeof(QP_LONG_COUNTER_T);
+    hdr->thread_slots = QP_THREAD_SLOTS;
+    hdr->shard_size = sizeof(struct qp_profile_shard);
+    hdr->hist_buckets = QP_HIST_BUCKETS;
+    hdr->hist_sub_bits = QP_HIST_SUB_BITS;
+    /* Readers check the magic last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, QP_STAT_SHM_MAGIC, sizeof(hdr->magic));
+    qp_stat_shm_state.hdr = hdr;
+    atexit(qp_stat_shm_exit);
+}
+
+static inline struct qp_stat_shm_site *qp_stat_shm_site(struct qp_stat_shm_hdr *hdr,
+        unsigned int idx)
+{
+    return (struct qp_stat_shm_site *)((char *)hdr + hdr->hdr_size + idx * hdr->site_size);
+}
+
+/** Hand out the next free slot of the segment, NULL if there is none */
+static inline struct qp_stat_shm_site *qp_stat_shm_slot(void)
+{
+    unsigned int idx;
+
+    pthread_once(&qp_stat_shm_state.once, qp_stat_shm_init_once);
+    if (!qp_stat_shm_state.hdr)
+        return NULL;
+    idx = QP_ATOMIC_ADD(&qp_stat_shm_state.hdr->nsites, 1) - 1;
+    if (idx >= QP_STAT_SHM_SITES)
+        return NULL;
+
+    return qp_stat_shm_site(qp_stat_shm_state.hdr, idx);
+}
+
+/** Move the counters of a site to the segment on its first hit.
+ *
+ * Ratelimit sites keep their static counter if there is no slot. Profile
+ * sites have none, they count in shards on the heap, with histograms
+ * allocated as without QP_STAT_SHM. If that fails too their calls are only
+ * counted as dropped, which snapshots show, and qpstat shows the number of
+ * such sites.
+ */
+static inline void qp_stat_shm_attach(struct qp_stat_site *site)
+{
+    struct qp_stat_shm_site *slot;
+    struct qp_profile_site *profile;
+    void *heap;
+    unsigned int i;
+
+    if (site->type != QP_STAT_SITE_RATELIMIT && site->type != QP_STAT_SITE_PROFILE)
+        return;
+    slot = qp_stat_shm_slot();
+    if (!slot && site->type == QP_STAT_SITE_RATELIMIT)
+        return;
+    if (!slot) {
+        profile = site->data;
+        if (posix_memalign(&heap, 64, QP_THREAD_SLOTS * sizeof(*profile->shards))) {
+            if (qp_stat_shm_state.hdr)
+                QP_ATOMIC_ADD(&qp_stat_shm_state.hdr->dropped_sites, 1);
+            return;
+        }
+        profile->shards = memset(heap, 0, QP_THREAD_SLOTS * sizeof(*profile->shards));
+        return;
+    }
+
+    slot->line = site->line;
+    snprintf(slot->func, sizeof(slot->func), "%s", site->func);
+    snprintf(slot->file, sizeof(slot->file), "%s", site->file);
+    if (site->type == QP_STAT_SITE_RATELIMIT) {
+        slot->count = QP_ATOMIC_LOAD((QP_LONG_COUNTER_T *)site->data);
+        QP_ATOMIC_STORE_RELEASE(&site->data, (void *)&slot->count);
+    } else {
+        profile = site->data;
+        for (i = 0; i < QP_THREAD_SLOTS; ++i)
+            slot->shards[i].hist = slot->hist[i];
+        profile->shards = slot->shards;
+    }
+    QP_ATOMIC_STORE_RELEASE(&slot->type, site->type);
+}
+#endif /* QP__STAT_SHM */
+
+#ifdef QP_PROJECT_GLIBC
+/* Slow instance stacks.
+ *
+ * If QP_PROFILE_SLOW_NS is defined then every profiled region instance that
+ * takes at least that many nanoseconds captures its call stack. Identical
+ * stacks are merged in a fixed-size table with a count and total duration.
+ * The table is printed in collapsed stack format ("root;...;leaf value", as
+ * read by flamegraph.pl) with region reports at most every
+ * QP_PROFILE_SLOW_INTERVAL milliseconds, on #QP_PROFILE_SLOW_DUMP and to
+ * stderr at exit.
+ */
+
+/** Number of distinct slow stacks kept (must be a power of 2) */
+#ifndef QP_PROFILE_SLOW_STACKS
+    #define QP_PROFILE_SLOW_STACKS 256
+#endif
+
+/** Minimum interval between slow stack dumps from region reports */
+#ifndef QP_PROFILE_SLOW_INTERVAL
+    #define QP_PROFILE_SLOW_INTERVAL 10000
+#endif
+
+struct qp_slow_stacks {
+    pthread_mutex_t lock;
+    int atexit_registered;
+    /* Set when the table changed since the last dump */
+    int changed;
+    unsigned long long last_dump_ms;
+    unsigned int used;
+    unsigned long long dropped;
+    struct qp_stack_agg entries[QP_PROFILE_SLOW_STACKS];
+};
+
+QP_GLOBAL struct qp_slow_stacks qp_slow_stacks = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Copy entry idx of the table, returns 0 if unused */
+static inline int qp_slow_stack_get(unsigned int idx, struct qp_stack_agg *out)
+{
+    int ret;
+
+    pthread_mutex_lock(&qp_slow_stacks.lock);
+    *out = qp_slow_stacks.entries[idx];
+    ret = out->hash != 0;
+    pthread_mutex_unlock(&qp_slow_stacks.lock);
+
+    return ret;
+}
+
+static inline void qp_slow_stacks_exit(void)
+{
+    struct qp_stack_agg entry;
+    char buf[QP_STACK_AGG_LINE_SIZE];
+    unsigned int i;
+
+    for (i = 0; i < QP_PROFILE_SLOW_STACKS; ++i) {
+        if (!qp_slow_stack_get(i, &entry))
+            continue;
+        qp_stack_agg_format(&entry, buf, sizeof(buf));
+        fprintf(stderr, "%s\n", buf);
+    }
+}
+
+/** Account one slow instance to its stack */
+static inline void qp_slow_stack_add(const struct qp_stack *stack, unsigned long long dur)
+{
+    pthread_mutex_lock(&qp_slow_stacks.lock);
+    if (!qp_slow_stacks.atexit_registered) {
+        qp_slow_stacks.atexit_registered = 1;
+        atexit(qp_slow_stacks_exit);
+    }
+    if (qp_stack_agg_add(qp_slow_stacks.entries, QP_PROFILE_SLOW_STACKS,
+            stack->pc, stack->depth, 1, dur))
+        ++qp_slow_stacks.used;
+    else
+        ++qp_slow_stacks.dropped;
+    qp_slow_stacks.changed = 1;
+    pthread_mutex_unlock(&qp_slow_stacks.lock);
+}
+
+/** Check if new slow stacks should be printed with a region report */
+static inline int qp_slow_stacks_due(void)
+{
+    unsigned long long now = QP_MILITIME_NOW();
+    int ret = 0;
+
+    pthread_mutex_lock(&qp_slow_stacks.lock);
+    if (qp_slow_stacks.changed && (!qp_slow_stacks.last_dump_ms ||
+            now - qp_slow_stacks.last_dump_ms >= QP_PROFILE_SLOW_INTERVAL)) {
+        qp_slow_stacks.last_dump_ms = now;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&qp_slow_stacks.lock);
+
+    return ret;
+}
+
+/** Print all slow stacks captured so far in collapsed stack format */
+#define QP_PROFILE_SLOW_DUMP() do { \
+        QP__DUMP_SITE_DECLARE("slow stacks=%u dropped=%llu" QP_NL); \
+        char qp_slow_buf[QP_STACK_AGG_LINE_SIZE]; \
+        struct qp_stack_agg qp_slow_entry; \
+        unsigned int qp_slow_i; \
+        qp_slow_stacks.changed = 0; \
+        QP__DUMP_SITE_CHECK(); \
+        QP__DUMP_PRINT_LOC("slow stacks=%u dropped=%llu" QP_NL, \
+                qp_slow_stacks.used, qp_slow_stacks.dropped); \
+        for (qp_slow_i = 0; qp_slow_i < QP_PROFILE_SLOW_STACKS; ++qp_slow_i) { \
+            if (!qp_slow_stack_get(qp_slow_i, &qp_slow_entry)) \
+                continue; \
+            qp_stack_agg_format(&qp_slow_entry, qp_slow_buf, sizeof(qp_slow_buf)); \
+            QP_PRINT("%s" QP_NL, qp_slow_buf); \
+        } \
+    } while (0)
+#endif /* QP_PROJECT_GLIBC */
+
+#if defined(QP_PROFILE_SLOW_NS) && defined(QP_PROJECT_GLIBC)
+    /* Capture in the macro so that the stack starts at the region */
+    #define QP__PROFILE_SLOW_CAPTURE(dur) do { \
+            if (unlikely((dur) >= QP_PROFILE_SLOW_NS)) { \
+                struct qp_stack qp_slow_stack; \
+                QP_STACK_CAPTURE(&qp_slow_stack); \
+                qp_slow_stack_add(&qp_slow_stack, (dur)); \
+            } \
+        } while (0)
+    #define QP__PROFILE_SLOW_REPORT() do { \
+            if (qp_slow_stacks_due()) \
+                QP_PROFILE_SLOW_DUMP(); \
+        } while (0)
+#else
+    #define QP__PROFILE_SLOW_CAPTURE(dur) do { } while (0)
+    #define QP__PROFILE_SLOW_REPORT() do { } while (0)
+#endif
+
+#ifdef QP_PROJECT_GLIBC
+/* Per-thread software event counters for profiled regions.
+ *
+ * With QP_PROFILE_PERF defined every region reads the task clock, context
+ * switches, page faults and CPU migrations of the calling thread at begin and
+ * end, and the region report adds on-CPU versus off-CPU time and event counts
+ * per call. Counters come from one perf_event_open group per thread, read
+ * with a single read(); the mmap'd self-monitoring page only helps with
+ * hardware counters, software events are always read through the syscall. If
+ * perf events are not available (perf_event_paranoid, seccomp) only on-CPU
+ * time is measured with CLOCK_THREAD_CPUTIME_ID. Reports name their source:
+ * "perf", "perf-user" when events are restricted to user space (context
+ * switches are then not counted and print as "-") or "cputime".
+ */
+/* Context switches lead the group, with a task clock leader they read 0 */
+#define QP_PERF_CONTEXT_SWITCHES 0
+#define QP_PERF_TASK_CLOCK 1
+#define QP_PERF_PAGE_FAULTS 2
+#define QP_PERF_CPU_MIGRATIONS 3
+#define QP_PERF_COUNTERS 4
+
+struct qp_perf_values {
+    unsigned long long v[QP_PERF_COUNTERS];
+};
+
+struct qp_perf_totals {
+    unsigned long long v[QP_PERF_COUNTERS];
+    /* Totals at the previous report */
+    unsigned long long last[QP_PERF_COUNTERS];
+};
+
+struct qp_perf_thread {
+    /* 1 for perf events, 2 for perf events restricted to user space, -1 for
+     * the CPU time fallback, 0 before first use
+     */
+    int state;
+    int fd;
+};
+
+struct qp_perf_state {
+    pthread_once_t once;
+    pthread_key_t key;
+    /* Set if any thread had to fall back */
+    int fallback;
+};
+
+QP_GLOBAL struct qp_perf_state qp_perf_state = {
+    .once = PTHREAD_ONCE_INIT,
+};
+QP_GLOBAL __thread struct qp_perf_thread qp_perf_self;
+
+static inline void qp_perf_thread_exit(void *arg)
+{
+    struct qp_perf_thread *self = (struct qp_perf_thread *)arg;
+
+    if (self->state > 0)
+        close(self->fd);
+    self->state = 0;
+}
+
+static inline void qp_perf_init(void)
+{
+    pthread_key_create(&qp_perf_state.key, qp_perf_thread_exit);
+}
+
+/** Open the counter group of the calling thread */
+static inline void qp_perf_open(struct qp_perf_thread *self)
+{
+    static const unsigned long long config[QP_PERF_COUNTERS] = {
+        PERF_COUNT_SW_CONTEXT_SWITCHES,
+        PERF_COUNT_SW_TASK_CLOCK,
+        PERF_COUNT_SW_PAGE_FAULTS,
+        PERF_COUNT_SW_CPU_MIGRATIONS,
+    };
+    struct perf_event_attr attr;
+    int i, fd, leader = -1, user_only = 0;
+
+    pthread_once(&qp_perf_state.once, qp_perf_init);
+    for (i = 0; i < QP_PERF_COUNTERS; ++i) {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && errno == EACCES) {
+            /* Restricted to user space, context switches then read as 0 */
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+            user_only = 1;
+        }
+        if (fd < 0) {
+            if (leader >= 0)
+                close(leader);
+            self->state = -1;
+            QP_ATOMIC_STORE(&qp_perf_state.fallback, 1);
+            return;
+        }
+        if (leader < 0)
+            leader = fd;
+    }
+    /* Group members are closed along with the leader */
+    self->fd = leader;
+    self->state = user_only ? 2 : 1;
+    pthread_setspecific(qp_perf_state.key, self);
+}
+
+/** Current counters of the calling thread */
+static inline struct qp_perf_values qp_perf_now(void)
+{
+    struct qp_perf_thread *self = &qp_perf_self;
+    struct qp_perf_values ret;
+    struct timespec ts;
+    struct {
+        unsigned long long nr;
+        unsigned long long v[QP_PERF_COUNTERS];
+    } group;
+
+    if (unlikely(!self->state))
+        qp_perf_open(self);
+    if (likely(self->state > 0) &&
+            read(self->fd, &group, sizeof(group)) == sizeof(group)) {
+        memcpy(ret.v, group.v, sizeof(ret.v));
+        return ret;
+    }
+    memset(&ret, 0, sizeof(ret));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    ret.v[QP_PERF_TASK_CLOCK] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    return ret;
+}
+
+static inline void qp_perf_add(struct qp_perf_totals *totals,
+        const struct qp_perf_values *begin, const struct qp_perf_values *end)
+{
+    int i;
+
+    for (i = 0; i < QP_PERF_COUNTERS; ++i)
+        QP_ATOMIC_ADD(&totals->v[i], end->v[i] - begin->v[i]);
+}
+
+/** Counters accumulated since the previous call */
+static inline struct qp_perf_values qp_perf_interval(struct qp_perf_totals *totals)
+{
+    struct qp_perf_values ret;
+    unsigned long long now;
+    int i;
+
+    for (i = 0; i < QP_PERF_COUNTERS; ++i) {
+        now = QP_ATOMIC_LOAD(&totals->v[i]);
+        ret.v[i] = now - totals->last[i];
+        totals->last[i] = now;
+    }
+
+    return ret;
+}
+
+/** Format count/calls with 3 decimals */
+#define QP__PERF_PER_CALL_FMT "%llu.%03llu"
+#define QP__PERF_PER_CALL_ARG(val, calls) \
+        (calls) ? (val) / (calls) : 0ULL, \
+        (calls) ? (val) * 1000 / (calls) % 1000 : 0ULL
+#endif /* QP_PROJECT_GLIBC */
+
+#if defined(QP_PROFILE_PERF) && defined(QP_PROJECT_GLIBC)
+    #define QP__PROFILE_PERF_BEGIN() \
+            static struct qp_perf_totals qp_profile_perf; \
+            struct qp_perf_values qp_profile_perf_begin = qp_perf_now();
+    #define QP__PROFILE_PERF_END() do { \
+            struct qp_perf_values qp_profile_perf_end = qp_perf_now(); \
+            qp_perf_add(&qp_profile_perf, &qp_profile_perf_begin, &qp_profile_perf_end); \
+        } while (0)
+    #define QP__PROFILE_PERF_REPORT(str, calls, wall_avg) do { \
+            struct qp_perf_values qp_perf = qp_perf_interval(&qp_profile_perf); \
+            unsigned long long qp_perf_calls = (calls); \
+            unsigned long long qp_perf_oncpu = qp_perf_calls ? \
+                    qp_perf.v[QP_PERF_TASK_CLOCK] / qp_perf_calls : 0; \
+            char qp_perf_cs[48] = "-"; \
+            /* Context switches are only counted with kernel events */ \
+            if (qp_perf_self.state == 1) \
+                snprintf(qp_perf_cs, sizeof(qp_perf_cs), QP__PERF_PER_CALL_FMT, \
+                        QP__PERF_PER_CALL_ARG(qp_perf.v[QP_PERF_CONTEXT_SWITCHES], qp_perf_calls)); \
+            QP_PRINT_LOC("oncpu_avg=%lluns offcpu_avg=%lluns" \
+                    " cs=%s" \
+                    " faults=" QP__PERF_PER_CALL_FMT \
+                    " migrations=" QP__PERF_PER_CALL_FMT \
+                    " per call (%s) " str QP_NL, \
+                    qp_perf_oncpu, \
+                    (wall_avg) > qp_perf_oncpu ? (wall_avg) - qp_perf_oncpu : 0ULL, \
+                    qp_perf_cs, \
+                    QP__PERF_PER_CALL_ARG(qp_perf.v[QP_PERF_PAGE_FAULTS], qp_perf_calls), \
+                    QP__PERF_PER_CALL_ARG(qp_perf.v[QP_PERF_CPU_MIGRATIONS], qp_perf_calls), \
+                    qp_perf_self.state == 1 ? "perf" : \
+                    qp_perf_self.state == 2 ? "perf-user" : "cputime"); \
+        } while (0)
+#else
+    #define QP__PROFILE_PERF_BEGIN()
+    #define QP__PROFILE_PERF_END() do { } while (0)
+    #define QP__PROFILE_PERF_REPORT(str, calls, wall_avg) do { } while (0)
+#endif
+
+#if QP__STAT_SHM
+    /* Sites without memory for their shards only count dropped calls */
+    #define QP__PROFILE_SITE_COUNTED(site) (QP_ATOMIC_LOAD(&(site)->shards) != NULL)
+#else
+    #define QP__PROFILE_SITE_COUNTED(site) 1
+#endif
+
+/** Start a profiled region, must be paired with #QP_PROFILE_REGION_END
+ *
+ * Records only write to the shard of the calling thread or CPU, no cache
+ * line is shared between threads on the hot path. Measure the cost on the
+ * target machine with "qp_bench -f profile_region".
+ */
+#define QP_PROFILE_REGION_BEGIN() \
+        QP__PROFILE_SITE_DEFINE(qp_profile_site); \
+        static QP_LOCK_DEFINE(qp_profile_lock); \
+        QP__PROFILE_PERF_BEGIN() \
+        QP_NANOTIME_T qp_profile_begin_ns = QP_NANOTIME_NOW();
+
+#define QP_PROFILE_REGION_END(str) do { \
+        unsigned int delta_ms; \
+        QP_NANOTIME_T qp_profile_end_ns = QP_NANOTIME_NOW(); \
+        QP__STAT_SITE_HIT(&qp_profile_site.stat); \
+        qp_profile_record(&qp_profile_site, qp_profile_end_ns - qp_profile_begin_ns); \
+        QP__PROFILE_SLOW_CAPTURE(qp_profile_end_ns - qp_profile_begin_ns); \
+        QP__PROFILE_PERF_END(); \
+        delta_ms = QP_RATELIMIT(QP_RATELIMIT_INTERVAL); \
+        if (unlikely(delta_ms) && QP_ATOMIC_LOAD(&qp_profile_site.stat.print) && \
+                QP__PROFILE_SITE_COUNTED(&qp_profile_site)) { \
+            QP_LONG_COUNTER_T total_usage, total_count, inst_max; \
+            QP_LONG_COUNTER_T delta_usage, delta_count; \
+            QP_LONG_COUNTER_T call_rate, usage_per_sec, instavg, longavg; \
+            QP_LONG_COUNTER_T pct_interval[QP_PROFILE_PERCENTILES]; \
+            QP_LONG_COUNTER_T pct_lifetime[QP_PROFILE_PERCENTILES]; \
+            QP_LONG_COUNTER_T lifetime_max; \
+            QP_LOCK(qp_profile_lock); \
+            qp_profile_merge(&qp_profile_site, &total_usage, &total_count, &inst_max, 1); \
+            qp_profile_percentiles(&qp_profile_site, inst_max, pct_interval, pct_lifetime); \
+            lifetime_max = qp_profile_site.max; \
+            delta_usage = total_usage - qp_profile_site.last_usage; \
+            delta_count = total_count - qp_profile_site.last_count; \
+            qp_profile_site.last_count = total_count; \
+            qp_profile_site.last_usage = total_usage; \
+            QP_UNLOCK(qp_profile_lock); \
+            call_rate = 1000 * delta_count; do_div(call_rate, delta_ms); \
+            usage_per_sec = delta_usage; do_div(usage_per_sec, delta_ms); \
+            instavg = delta_usage; \
+            if (delta_count) \
+                do_div(instavg, delta_count); \
+            longavg = total_usage; do_div(longavg, total_count); \
+            do_div(total_usage, 1000000); \
+            QP_PRINT_FIELDS_MSG("calls=%llu %llu/sec usage=%llums" \
+                    " %lluus/sec" \
+                    " inst_avg_dur=%lluns" \
+                    " long_avg_dur=%lluns" \
+                    " instmax=%lluns ", \
+                    QP_KV("calls", "%llu") QP_KV("call_rate", "%llu") \
+                    QP_KV("usage_ms", "%llu") QP_KV("usage_us_per_sec", "%llu") \
+                    QP_KV("inst_avg_ns", "%llu") QP_KV("long_avg_ns", "%llu") \
+                    QP_KV("inst_max_ns", "%llu"), \
+                    str QP_NL, \
+                    total_count, call_rate, total_usage, \
+                    usage_per_sec, instavg, longavg, inst_max); \
+            QP_PRINT_FIELDS_MSG("interval p50=%lluns p90=%lluns p99=%lluns" \
+                    " p99.9=%lluns max=%lluns" \
+                    " lifetime p50=%lluns p90=%lluns p99=%lluns" \
+                    " p99.9=%lluns max=%lluns ", \
+                    QP_KV("p50_ns", "%llu") QP_KV("p90_ns", "%llu") \
+                    QP_KV("p99_ns", "%llu") QP_KV("p99_9_ns", "%llu") \
+                    QP_KV("max_ns", "%llu") \
+                    QP_KV("lifetime_p50_ns", "%llu") QP_KV("lifetime_p90_ns", "%llu") \
+                    QP_KV("lifetime_p99_ns", "%llu") QP_KV("lifetime_p99_9_ns", "%llu") \
+                    QP_KV("lifetime_max_ns", "%llu"), \
+                    str QP_NL, \
+                    pct_interval[0], pct_interval[1], pct_interval[2], \
+                    pct_interval[3], inst_max, \
+                    pct_lifetime[0], pct_lifetime[1], pct_lifetime[2], \
+                    pct_lifetime[3], lifetime_max); \
+            QP__PROFILE_PERF_REPORT(str, delta_count, instavg); \
+            QP__PROFILE_SLOW_REPORT(); \
+        } \
+    } while (0)
+
+/** Dump the lifetime duration histogram of the current profiled region
+ *
+ * Must be used in the scope of #QP_PROFILE_REGION_BEGIN. Prints a header
+ * followed by one "low high count" line per non-empty bucket, with bounds in
+ * nanoseconds, suitable for offline plotting.
+ */
+#define QP_PROFILE_REGION_DUMP_HIST(str) do { \
+        QP__DUMP_SITE_DECLARE("hist calls=%llu buckets=%d " str QP_NL); \
+        QP_LONG_COUNTER_T qp_hist_usage, qp_hist_count, qp_hist_max; \
+        unsigned int qp_hist_i; \
+        QP__DUMP_SITE_CHECK(); \
+        QP_LOCK(qp_profile_lock); \
+        qp_profile_merge(&qp_profile_site, &qp_hist_usage, &qp_hist_count, &qp_hist_max, 0); \
+        QP__DUMP_PRINT_LOC("hist calls=%llu buckets=%d " str QP_NL, \
+                qp_hist_count, QP_HIST_BUCKETS); \
+        for (qp_hist_i = 0; qp_hist_i < QP_HIST_BUCKETS; ++qp_hist_i) { \
+            if (!qp_profile_site.hist[qp_hist_i]) \
+                continue; \
+            QP_PRINT("%llu %llu %llu" QP_NL, \
+                    qp_hist_bucket_low(qp_hist_i), \
+                    qp_hist_bucket_high(qp_hist_i), \
+                    qp_profile_site.hist[qp_hist_i]); \
+        } \
+        QP_UNLOCK(qp_profile_lock); \
+    } while (0)
+
+/* Print one variable, the structured record has fields "val" and "var" */
+#define QP__DUMP_VAR_KV(var, kv, fmt, val) \
+        QP__PRINT_FIELDS_KEY(#var "=" fmt QP_NL, kv("val", fmt), "var", #var, (val))
+
+#define QP_DUMP_VAR_FMT_VAL(var, fmt, val) QP__DUMP_VAR_KV(var, QP_KV_STR, fmt, val)
+
+#define QP_DUMP_VAR_FMT(fmt, var) QP__DUMP_VAR_KV(var, QP_KV_STR, fmt, var)
+
+#ifdef QP_PROJECT_LINUX_KERNEL
+#define QP_DUMP_VAR_PTR(var) QP_DUMP_VAR_FMT_VAL(var, "%px", (void*)var)
+#else
+#define QP_DUMP_VAR_PTR(var) QP_DUMP_VAR_FMT_VAL(var, "%p", (void*)var)
+#endif
+
+#define QP_DUMP_VAR_INT(var) QP__DUMP_VAR_KV(var, QP_KV, "%d", (int)var)
+#define QP_DUMP_VAR_HEX16(var) QP_DUMP_VAR_FMT_VAL(var, "0x%04x", (u16)var)
+#define QP_DUMP_VAR_HEX32(var) QP_DUMP_VAR_FMT_VAL(var, "0x%08x", (u32)var)
+#define QP_DUMP_VAR_HEX64(var) QP_DUMP_VAR_FMT_VAL(var, "0x%016llx", (u64)var)
+#define QP_DUMP_VAR_HEX(var) QP_DUMP_VAR_FMT_VAL(var, "0x%08x", (u32)var)
+
+/** Check if argument is pointer (to anything) */
+#define QP_ARG_IS_POINTER(arg) (__builtin_classify_type(arg) == 5)
+
+/* Hex encoding.
+ *
+ * Dumps are formatted a line at a time into a stack buffer with a byte to
+ * digit pair lookup table, then printed with a single QP_PRINT per line
+ * instead of one per byte.
+ */
+
+/** Maximum number of bytes formatted for each QP_PRINT */
+#define QP_HEX_LINE_BYTES 64
+/** Buffer size for QP_HEX_LINE_BYTES with spaces and an ASCII column */
+#define QP_HEX_LINE_SIZE (QP_HEX_LINE_BYTES * 4 + 8)
+
+/** Insert a space before the first byte of the buffer */
+#define QP_HEX_SPACE_AT_ZERO 1
+/** Append a "  |ascii|" column after the bytes of each line */
+#define QP_HEX_ASCII 2
+
+#define QP__HEX_ROW(h) \
+        h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+        h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+
+static const char qp_hex_pairs[] __attribute__((unused)) =
+        QP__HEX_ROW("0") QP__HEX_ROW("1") QP__HEX_ROW("2") QP__HEX_ROW("3")
+        QP__HEX_ROW("4") QP__HEX_ROW("5") QP__HEX_ROW("6") QP__HEX_ROW("7")
+        QP__HEX_ROW("8") QP__HEX_ROW("9") QP__HEX_ROW("a") QP__HEX_ROW("b")
+        QP__HEX_ROW("c") QP__HEX_ROW("d") QP__HEX_ROW("e") QP__HEX_ROW("f");
+
+/** Format bytes starting at idx up to the end of the current line (every
+ *  eol_count bytes, 0 for no limit) or QP_HEX_LINE_BYTES into out, which must
+ *  hold QP_HEX_LINE_SIZE characters. A space is inserted before each byte at
+ *  a multiple of space_count.
+ *
+ *  Returns the index after the last formatted byte.
+ */
+static inline unsigned int qp_hex_format(char *out,
+        const unsigned char *buf, unsigned int idx, unsigned int len,
+        unsigned int eol_count, unsigned int space_count, unsigned int flags)
+{
+    unsigned int start = idx, end, full_end, i;
+    char *pos = out;
+
+    full_end = idx + QP_HEX_LINE_BYTES;
+    if (eol_count && idx + eol_count - idx % eol_count < full_end)
+        full_end = idx + eol_count - idx % eol_count;
+    end = full_end < len ? full_end : len;
+
+    for (i = idx; i < end; ++i) {
+        if (i % space_count == 0 && (i || (flags & QP_HEX_SPACE_AT_ZERO)))
+            *pos++ = ' ';
+        memcpy(pos, &qp_hex_pairs[buf[i] * 2], 2);
+        pos += 2;
+    }
+    if (flags & QP_HEX_ASCII) {
+        /* Pad a short last line so that the column stays aligned */
+        for (; i < full_end; ++i) {
+            if (i % space_count == 0)
+                *pos++ = ' ';
+            *pos++ = ' ';
+            *pos++ = ' ';
+        }
+        *pos++ = ' ';
+        *pos++ = ' ';
+        *pos++ = '|';
+        for (i = start; i < end; ++i)
+            *pos++ = (buf[i] >= 0x20 && buf[i] < 0x7f) ? buf[i] : '.';
+        *pos++ = '|';
+    }
+    *pos = 0;
+
+    return end;
+}
+
+/** Dump raw hex inline: no EOL, just space separator every 8 bytes */
+#define QP_DUMP_HEX_BYTES(buf, len) do { \
+        char qp_hex_line[QP_HEX_LINE_SIZE]; \
+        unsigned int qp_hex_idx = 0, qp_hex_len = (len); \
+        while (qp_hex_idx < qp_hex_len) { \
+            qp_hex_idx = qp_hex_format(qp_hex_line, (const unsigned char *)(buf), \
+                    qp_hex_idx, qp_hex_len, 0, 8, 0); \
+            QP_PRINT(QP_CONT "%s", qp_hex_line); \
+        } \
+    } while (0)
+
+/* Like QP_DUMP_HEX_BYTES but through the line assembler */
+#define QP__LINE_HEX_BYTES(buf, len) do { \
+        char qp_hex_line[QP_HEX_LINE_SIZE]; \
+        unsigned int qp_hex_idx = 0, qp_hex_len = (len); \
+        while (qp_hex_idx < qp_hex_len) { \
+            qp_hex_idx = qp_hex_format(qp_hex_line, (const unsigned char *)(buf), \
+                    qp_hex_idx, qp_hex_len, 0, 8, 0); \
+            QP_LINE_PRINT("%s", qp_hex_line); \
+        } \
+    } while (0)
+
+#define QP__DUMP_HEX_BUFFER(buf, len, eol_count, space_count, flags) do { \
+        QP__DUMP_SITE_DECLARE("DUMP %u bytes from %p:"); \
+        char qp_hex_line[QP_HEX_LINE_SIZE]; \
+        const unsigned char *qp_hex_buf = (const unsigned char *)(buf); \
+        unsigned int qp_hex_idx = 0, qp_hex_next, qp_hex_len = (len); \
+        QP__DUMP_SITE_CHECK(); \
+        QP_LINE_HOLD(); \
+        QP__DUMP_LINE_PRINT_LOC("DUMP %u bytes from %p:", qp_hex_len, (buf)); \
+        for (; qp_hex_idx < qp_hex_len; qp_hex_idx = qp_hex_next) { \
+            qp_hex_next = qp_hex_format(qp_hex_line, qp_hex_buf, qp_hex_idx, \
+                    qp_hex_len, (eol_count), (space_count), \
+                    (flags) | QP_HEX_SPACE_AT_ZERO); \
+            if (qp_hex_idx % (eol_count) == 0) \
+                QP_LINE_PRINT("\nDUMP %p:%s", qp_hex_buf + qp_hex_idx, qp_hex_line); \
+            else \
+                QP_LINE_PRINT("%s", qp_hex_line); \
+        } \
+        QP_LINE_PRINT("\n"); \
+        QP_LINE_FLUSH(); \
+    } while (0)
+
+/** Dump a hex buffer nicely with a header
+ *  @param buf Buffer to dump
+ *  @param len Length of the buffer in bytes
+ *  @param eol_count Insert EOL every this many bytes
+ *  @param space_count Insert space every this many bytes
+ */
+#define QP_DUMP_HEX_BUFFER_PRETTY(buf, len, eol_count, space_count) \
+        QP__DUMP_HEX_BUFFER(buf, len, eol_count, space_count, 0)
+
+/** Like #QP_DUMP_HEX_BUFFER_PRETTY with an ASCII column after each line
+ *
+ * Lines longer than QP_HEX_LINE_BYTES get a column for every chunk.
+ */
+#define QP_DUMP_HEX_BUFFER_PRETTY_ASCII(buf, len, eol_count, space_count) \
+        QP__DUMP_HEX_BUFFER(buf, len, eol_count, space_count, QP_HEX_ASCII)
+
+/** Dump a hex buffer nicely with a header and up to 16 bytes per line */
+#define QP_DUMP_HEX_BUFFER(buf, len) QP_DUMP_HEX_BUFFER_PRETTY(buf, len, 16, 4);
+
+/** Dump a hex buffer with 16 bytes and their ASCII representation per line */
+#define QP_DUMP_HEX_BUFFER_ASCII(buf, len) QP_DUMP_HEX_BUFFER_PRETTY_ASCII(buf, len, 16, 4)
+
+/* Type-directed variable dumps.
+ *
+ * QP_DUMP_VAR selects a formatter for the type of its argument at compile
+ * time and formats the value into a stack buffer, so that printf only copies
+ * the result. Enums print as their integer type, arrays element by element,
+ * char arrays as strings and types without a formatter (structs, unions) as
+ * raw bytes. In structured output values that are not numbers or booleans
+ * are quoted. Bit-fields are not supported, dump them as (s.bf + 0).
+ */
+
+/** Buffer size for the values of one QP_DUMP_VAR or QP_DUMP_VARS */
+#ifndef QP_DUMP_VAR_SIZE
+    #ifdef QP_PROJECT_LINUX_KERNEL
+        #define QP_DUMP_VAR_SIZE 128
+    #else
+        #define QP_DUMP_VAR_SIZE 256
+    #endif
+#endif
+
+/* Cut arrays end with an extra "..." element */
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_HUMAN
+    #define QP__VAR_QUOTE 0
+    #define QP__VAR_ARRAY_SEP ", "
+    #define QP__VAR_ARRAY_MORE "..."
+    #define QP__VAR_MORE "..."
+    #define QP__VARS_MORE " ..."
+#else
+    #define QP__VAR_QUOTE 1
+    #define QP__VAR_ARRAY_SEP ","
+    #define QP__VAR_ARRAY_MORE "\"...\""
+    #define QP__VAR_MORE "\"...\""
+    /* Structured records just end with the last complete field */
+    #define QP__VARS_MORE ""
+#endif
+
+/* Variable length values are cut between elements, keeping room for "...",
+ * up to two closing characters and one spare byte. Other values are written
+ * entirely or not at all. Either way a value only reaches end if it did not
+ * fit.
+ */
+#define QP__VAR_TAIL 6
+
+/** Formats the value at val of size bytes into [pos, end), returns the new end */
+typedef char *(*qp_var_fmt_fn)(char *pos, char *end, const void *val, size_t size);
+
+/** Append len bytes of str, returns end if they do not fit */
+static inline char *qp_var_put(char *pos, char *end, const char *str, size_t len)
+{
+    if (len > (size_t)(end - pos))
+        return end;
+    memcpy(pos, str, len);
+
+    return pos + len;
+}
+
+static inline char *qp_var_put_dec(char *pos, char *end, unsigned long long val, int neg)
+{
+    char tmp[21];
+    char *start = qp_fmt_dec(tmp + sizeof(tmp), val);
+
+    if (neg)
+        *--start = '-';
+
+    return qp_var_put(pos, end, start, tmp + sizeof(tmp) - start);
+}
+
+/** Append str between quotes with JSON escapes, "..." if it does not fit */
+static inline char *qp_var_put_quoted(char *pos, char *end, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char c;
+    char esc;
+
+    if (end - pos < QP__VAR_TAIL + 1)
+        return end;
+    *pos++ = '"';
+    for (; len && *str; --len, ++str) {
+        c = *str;
+        esc = c == '\n' ? 'n' : c == '\t' ? 't' : c == '\r' ? 'r' :
+                c == '"' || c == '\\' ? c : 0;
+        if (end - pos < QP__VAR_TAIL + (esc ? 2 : c < 0x20 ? 6 : 1)) {
+            memcpy(pos, "...", 3);
+            pos += 3;
+            break;
+        }
+        if (esc) {
+            *pos++ = '\\';
+            *pos++ = esc;
+        } else if (c < 0x20) {
+            memcpy(pos, "\\u00", 4);
+            pos[4] = hex[c >> 4];
+            pos[5] = hex[c & 0xf];
+            pos += 6;
+        } else {
+            *pos++ = c;
+        }
+    }
+    *pos++ = '"';
+
+    return pos;
+}
+
+#define QP__VAR_FMT_SIGNED(name, type) \
+static inline char *qp_var_fmt_##name(char *pos, char *end, const void *val, size_t size) \
+{ \
+    type v = *(const type *)val; \
+    return qp_var_put_dec(pos, end, \
+            v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v, v < 0); \
+}
+
+#define QP__VAR_FMT_UNSIGNED(name, type) \
+static inline char *qp_var_fmt_##name(char *pos, char *end, const void *val, size_t size) \
+{ \
+    return qp_var_put_dec(pos, end, *(const type *)val, 0); \
+}
+
+QP__VAR_FMT_SIGNED(schar, signed char)
+QP__VAR_FMT_SIGNED(short, short)
+QP__VAR_FMT_SIGNED(int, int)
+QP__VAR_FMT_SIGNED(long, long)
+QP__VAR_FMT_SIGNED(llong, long long)
+QP__VAR_FMT_UNSIGNED(uchar, unsigned char)
+QP__VAR_FMT_UNSIGNED(ushort, unsigned short)
+QP__VAR_FMT_UNSIGNED(uint, unsigned int)
+QP__VAR_FMT_UNSIGNED(ulong, unsigned long)
+QP__VAR_FMT_UNSIGNED(ullong, unsigned long long)
+
+/* Plain char is printed as a number with the signedness of the platform */
+static inline char *qp_var_fmt_char(char *pos, char *end, const void *val, size_t size)
+{
+    return (char)-1 < 0 ? qp_var_fmt_schar(pos, end, val, size) :
+            qp_var_fmt_uchar(pos, end, val, size);
+}
+
+static inline char *qp_var_fmt_bool(char *pos, char *end, const void *val, size_t size)
+{
+    return *(const _Bool *)val ? qp_var_put(pos, end, "true", 4) :
+            qp_var_put(pos, end, "false", 5);
+}
+
+/* Hexadecimal like %p, without the kernel's pointer hashing */
+static inline char *qp_var_fmt_ptr(char *pos, char *end, const void *val, size_t size)
+{
+    char tmp[2 + 2 * sizeof(uintptr_t) + 2];
+    char *start = tmp + sizeof(tmp);
+    uintptr_t v;
+
+    memcpy(&v, val, sizeof(v));
+    if (QP__VAR_QUOTE)
+        *--start = '"';
+    if (!v) {
+        start -= 5;
+        memcpy(start, "(nil)", 5);
+    } else {
+        for (; v; v >>= 8) {
+            start -= 2;
+            memcpy(start, &qp_hex_pairs[(v & 0xff) * 2], 2);
+        }
+        if (*start == '0')
+            ++start;
+        start -= 2;
+        memcpy(start, "0x", 2);
+    }
+    if (QP__VAR_QUOTE)
+        *--start = '"';
+
+    return qp_var_put(pos, end, start, tmp + sizeof(tmp) - start);
+}
+
+/* Raw bytes for types without a formatter, like "<01 02 03>" */
+static inline char *qp_var_fmt_bytes(char *pos, char *end, const void *val, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)val;
+    size_t i;
+
+    if (end - pos < QP__VAR_TAIL + 2)
+        return end;
+    if (QP__VAR_QUOTE)
+        *pos++ = '"';
+    *pos++ = '<';
+    for (i = 0; i < size; ++i) {
+        if (end - pos < QP__VAR_TAIL + 3) {
+            memcpy(pos, "...", 3);
+            pos += 3;
+            break;
+        }
+        if (i)
+            *pos++ = ' ';
+        memcpy(pos, &qp_hex_pairs[bytes[i] * 2], 2);
+        pos += 2;
+    }
+    *pos++ = '>';
+    if (QP__VAR_QUOTE)
+        *pos++ = '"';
+
+    return pos;
+}
+
+#ifndef QP_PROJECT_LINUX_KERNEL
+/* Non-finite values are not JSON numbers */
+#define QP__VAR_FMT_FLOAT(name, type, fmt) \
+static inline char *qp_var_fmt_##name(char *pos, char *end, const void *val, size_t size) \
+{ \
+    type v = *(const type *)val; \
+    char tmp[48]; \
+    int len = snprintf(tmp, sizeof(tmp), \
+            QP__VAR_QUOTE && !__builtin_isfinite(v) ? "\"" fmt "\"" : fmt, v); \
+    return qp_var_put(pos, end, tmp, len < (int)sizeof(tmp) ? len : (int)sizeof(tmp) - 1); \
+}
+
+QP__VAR_FMT_FLOAT(float, float, "%g")
+QP__VAR_FMT_FLOAT(double, double, "%g")
+QP__VAR_FMT_FLOAT(ldouble, long double, "%Lg")
+
+#ifdef __SIZEOF_INT128__
+/* 19 digits at a time, the largest power of 10 below 2^64 */
+static inline char *qp_var_fmt_u128_abs(char *pos, char *end, unsigned __int128 v, int neg)
+{
+    char tmp[41];
+    char *start = tmp + sizeof(tmp);
+
+    while (v > ~0ULL) {
+        start -= 19;
+        qp_fmt_dec_pad(start + 19, v % 10000000000000000000ULL, 19);
+        v /= 10000000000000000000ULL;
+    }
+    start = qp_fmt_dec(start, v);
+    if (neg)
+        *--start = '-';
+
+    return qp_var_put(pos, end, start, tmp + sizeof(tmp) - start);
+}
+
+static inline char *qp_var_fmt_i128(char *pos, char *end, const void *val, size_t size)
+{
+    __int128 v = *(const __int128 *)val;
+
+    return qp_var_fmt_u128_abs(pos, end,
+            v < 0 ? 0 - (unsigned __int128)v : (unsigned __int128)v, v < 0);
+}
+
+static inline char *qp_var_fmt_u128(char *pos, char *end, const void *val, size_t size)
+{
+    return qp_var_fmt_u128_abs(pos, end, *(const unsigned __int128 *)val, 0);
+}
+
+    #define QP__VAR_FMT_INT128 \
+            __int128: qp_var_fmt_i128, \
+            unsigned __int128: qp_var_fmt_u128,
 #endif
 
-#ifdef in_serving_softirq
-    #define QP_PREEMPT_COUNT_FMT__serving_softirq "%s"
-    #define QP_PREEMPT_COUNT_ARGS__serving_softirq , QP__BOOLFUNC_FMT(in_serving_softirq)
-#else
-    #define QP_PREEMPT_COUNT_FMT__serving_softirq
-    #define QP_PREEMPT_COUNT_ARGS__serving_softirq
+#define QP__VAR_FMT_FLOATS \
+        float: qp_var_fmt_float, \
+        double: qp_var_fmt_double, \
+        long double: qp_var_fmt_ldouble,
+#endif /* !QP_PROJECT_LINUX_KERNEL */
+
+#ifndef QP__VAR_FMT_INT128
+    #define QP__VAR_FMT_INT128
+#endif
+#ifndef QP__VAR_FMT_FLOATS
+    #define QP__VAR_FMT_FLOATS
 #endif
 
-#define QP_PREEMPT_COUNT_FMT "0x%08x%s%s%s%s%s" \
-                    QP_PREEMPT_COUNT_FMT__nmi \
-                    QP_PREEMPT_COUNT_FMT__serving_softirq \
+/* Elements are formatted separately so that the list is never cut mid-element.
+ * The room needed to close it is checked after each element.
+ */
+static inline char *qp_var_fmt_array(char *pos, char *end, const void *pval, size_t size,
+        size_t elem_size, qp_var_fmt_fn fmt)
+{
+    const char *elems;
+    char tmp[64];
+    size_t i, len, sep = 0;
+    const size_t tail = sizeof(QP__VAR_ARRAY_SEP QP__VAR_ARRAY_MORE) + 1;
 
-#define QP_PREEMPT_COUNT_ARGS \
-                    preempt_count(), \
-                    QP__BOOLFUNC_FMT(irqs_disabled), \
-                    QP__BOOLFUNC_FMT(in_atomic), \
-                    QP__BOOLFUNC_FMT(in_interrupt), \
-                    QP__BOOLFUNC_FMT(in_irq), \
-                    QP__BOOLFUNC_FMT(in_softirq) \
-                    QP_PREEMPT_COUNT_ARGS__nmi \
-                    QP_PREEMPT_COUNT_ARGS__serving_softirq \
+    memcpy(&elems, pval, sizeof(elems));
+    if ((size_t)(end - pos) < tail + 1)
+        return end;
+    *pos++ = '[';
+    for (i = 0; elem_size && i + elem_size <= size; i += elem_size) {
+        len = fmt(tmp, tmp + sizeof(tmp), elems + i, elem_size) - tmp;
+        if ((size_t)(end - pos) < sep + len + tail) {
+            memcpy(pos, QP__VAR_ARRAY_SEP, sep);
+            memcpy(pos + sep, QP__VAR_ARRAY_MORE, sizeof(QP__VAR_ARRAY_MORE) - 1);
+            pos += sep + sizeof(QP__VAR_ARRAY_MORE) - 1;
+            break;
+        }
+        memcpy(pos, QP__VAR_ARRAY_SEP, sep);
+        memcpy(pos + sep, tmp, len);
+        pos += sep + len;
+        sep = sizeof(QP__VAR_ARRAY_SEP) - 1;
+    }
+    *pos++ = ']';
 
+    return pos;
+}
 
-#define QP_DUMP_KERNEL_CONTEXT() \
-            QP_PRINT_LOC("preempt_count=" QP_PREEMPT_COUNT_FMT "\n", \
-                    QP_PREEMPT_COUNT_ARGS);
+static inline char *qp_var_fmt_str(char *pos, char *end, const void *pval, size_t size)
+{
+    const char *str;
 
-/* Stack dumping. */
-#if defined(__KERNEL__)
-    /* Kernel */
-    #define QP_DUMP_STACK() dump_stack()
-#else
-    /* GLIBC */
-    #define QP_DUMP_STACK() do { \
-            int i, btlen; \
-            void *bt[20]; \
-            char **btsym; \
-            btlen = backtrace(bt, 20); \
-            btsym = backtrace_symbols(bt, btlen); \
-            for (i = 0; i < btlen; ++i) { \
-                QP_PRINT("[%d]: %s" QP_NL, i, btsym[i]); \
-            } \
-            free(btsym); \
-        } while (0)
-#endif
+    memcpy(&str, pval, sizeof(str));
 
-#define QP_DUMP_SYMBOL(ptr) do { \
-        void *fakebt = (void*)(ptr); \
-        char **names; \
-        names = backtrace_symbols(&fakebt, 1); \
-        if (names) { \
-            QP_PRINT_LOC(#ptr "=%s" QP_NL, names[0]); \
-            free(names); \
-        } else { \
-            QP_PRINT_LOC(#ptr "=%p (no symbol)" QP_NL, (void*)(ptr)); \
-        } \
-    } while (0)
+    return qp_var_put_quoted(pos, end, str, size);
+}
 
-#define QP_DUMP_STACK_RATELIMIT() do { \
-        if (QP_RATELIMIT(5000)) { \
-            QP_DUMP_STACK(); \
-        } \
-    } while (0)
+/** Type of x after array to pointer conversion */
+#define QP__VAR_DECAYED(x) typeof(({ __auto_type qp_decayed = (x); qp_decayed; }))
 
-/* Micro-profiling. */
-#define QP_PROFILE_REGION_BEGIN() \
-        static QP_LONG_COUNTER_T qp_profile_g_usage = 0, qp_profile_g_last_usage = 0; \
-        static QP_LONG_COUNTER_T qp_profile_g_count = 0, qp_profile_g_last_count = 0; \
-        static QP_LONG_COUNTER_T qp_profile_g_inst_max = 0; \
-        static QP_LOCK_DEFINE(qp_profile_lock); \
-        QP_NANOTIME_T qp_profile_begin_ns = QP_NANOTIME_NOW();
+#define QP__VAR_IS_ARRAY(x) \
+        (!__builtin_types_compatible_p(typeof(x), QP__VAR_DECAYED(x)))
 
-#define QP_PROFILE_REGION_END(str) do { \
-        unsigned int delta_ms; \
-        QP_NANOTIME_T qp_profile_end_ns = QP_NANOTIME_NOW(); \
-        QP_LOCK(qp_profile_lock); \
-        qp_profile_g_usage += (qp_profile_end_ns - qp_profile_begin_ns); \
-        ++qp_profile_g_count; \
-        if (qp_profile_end_ns - qp_profile_begin_ns > qp_profile_g_inst_max) { \
-            qp_profile_g_inst_max = qp_profile_end_ns - qp_profile_begin_ns; \
-        } \
-        delta_ms = QP_RATELIMIT(QP_RATELIMIT_INTERVAL); \
-        if (unlikely(delta_ms)) { \
-            QP_LONG_COUNTER_T total_usage = qp_profile_g_usage; \
-            QP_LONG_COUNTER_T total_count = qp_profile_g_count; \
-            QP_LONG_COUNTER_T delta_usage = total_usage - qp_profile_g_last_usage; \
-            QP_LONG_COUNTER_T delta_count = total_count - qp_profile_g_last_count; \
-            QP_LONG_COUNTER_T call_rate, usage_per_sec, instavg, longavg; \
-            QP_LONG_COUNTER_T inst_max = qp_profile_g_inst_max; \
-            qp_profile_g_last_count = total_count; \
-            qp_profile_g_last_usage = total_usage; \
-            qp_profile_g_inst_max = 0; \
-            QP_UNLOCK(qp_profile_lock); \
-            call_rate = 1000 * delta_count; do_div(call_rate, delta_ms); \
-            usage_per_sec = delta_usage; do_div(usage_per_sec, delta_ms); \
-            instavg = delta_usage; do_div(instavg, delta_count); \
-            longavg = total_usage; do_div(longavg, total_count); \
-            do_div(total_usage, 1000000); \
-            QP_PRINT_LOC("calls=%llu %llu/sec usage=%llums" \
-                    " %lluus/sec" \
-                    " inst_avg_dur=%lluns" \
-                    " long_avg_dur=%lluns" \
-                    " instmax=%lluns " \
-                    str QP_NL, \
-                    total_count, call_rate, total_usage, \
-                    usage_per_sec, instavg, longavg, inst_max); \
-        } else { \
-            QP_UNLOCK(qp_profile_lock); \
-        } \
-    } while (0)
+/** First element of array x, or a char if x is not an array (never evaluated) */
+#define QP__VAR_ELEM(x) \
+        (*__builtin_choose_expr(QP__VAR_IS_ARRAY(x), (x), (const char *)0))
 
-#define QP_DUMP_VAR_FMT_VAL(var, fmt, val) QP_PRINT_LOC(#var "=" fmt QP_NL, (val))
+/** Formatter for the type of x, nested arrays are printed as bytes */
+#define QP__VAR_FMT(x) \
+        __builtin_choose_expr(QP__VAR_IS_ARRAY(x), qp_var_fmt_bytes, \
+        __builtin_choose_expr(QP_ARG_IS_POINTER(x), qp_var_fmt_ptr, \
+        _Generic((x), \
+            _Bool: qp_var_fmt_bool, \
+            char: qp_var_fmt_char, \
+            signed char: qp_var_fmt_schar, \
+            unsigned char: qp_var_fmt_uchar, \
+            short: qp_var_fmt_short, \
+            unsigned short: qp_var_fmt_ushort, \
+            int: qp_var_fmt_int, \
+            unsigned int: qp_var_fmt_uint, \
+            long: qp_var_fmt_long, \
+            unsigned long: qp_var_fmt_ulong, \
+            long long: qp_var_fmt_llong, \
+            unsigned long long: qp_var_fmt_ullong, \
+            QP__VAR_FMT_INT128 \
+            QP__VAR_FMT_FLOATS \
+            default: qp_var_fmt_bytes)))
 
-#define QP_DUMP_VAR_FMT(fmt, var) QP_PRINT_LOC(#var "=" fmt QP_NL, (var))
+/* Append the value of var, evaluated once, to [pos, end) */
+#define QP__VAR_FORMAT(pos, end, var) do { \
+        __auto_type qp_var_val = (var); \
+        if (QP__VAR_IS_ARRAY(var) && \
+                __builtin_types_compatible_p(typeof(QP__VAR_ELEM(var)), char)) \
+            pos = qp_var_fmt_str(pos, end, &qp_var_val, sizeof(var)); \
+        else if (QP__VAR_IS_ARRAY(var)) \
+            pos = qp_var_fmt_array(pos, end, &qp_var_val, sizeof(var), \
+                    sizeof(QP__VAR_ELEM(var)), QP__VAR_FMT(QP__VAR_ELEM(var))); \
+        else \
+            pos = QP__VAR_FMT(qp_var_val)(pos, end, &qp_var_val, sizeof(qp_var_val)); \
+    } while (0)
 
-#ifdef QP_PROJECT_LINUX_KERNEL
-#define QP_DUMP_VAR_PTR(var) QP_DUMP_VAR_FMT_VAL(var, "%px", (void*)var)
+/** Append the name of a QP_DUMP_VARS variable */
+static inline char *qp_var_put_name(char *pos, char *end, const char *name, int first)
+{
+#if QP_OUTPUT_FORMAT == QP_OUTPUT_JSON
+    pos = qp_var_put(pos, end, ",", 1);
+    pos = qp_var_put_quoted(pos, end, name, strlen(name));
+    return qp_var_put(pos, end, ":", 1);
 #else
-#define QP_DUMP_VAR_PTR(var) QP_DUMP_VAR_FMT_VAL(var, "%p", (void*)var)
+    if (!first || QP_OUTPUT_FORMAT != QP_OUTPUT_HUMAN)
+        pos = qp_var_put(pos, end, " ", 1);
+    pos = qp_var_put(pos, end, name, strlen(name));
+    return qp_var_put(pos, end, "=", 1);
 #endif
+}
 
-#define QP_DUMP_VAR_INT(var) QP_DUMP_VAR_FMT_VAL(var, "%d", (int)var)
-#define QP_DUMP_VAR_HEX16(var) QP_DUMP_VAR_FMT_VAL(var, "0x%04x", (u16)var)
-#define QP_DUMP_VAR_HEX32(var) QP_DUMP_VAR_FMT_VAL(var, "0x%08x", (u32)var)
-#define QP_DUMP_VAR_HEX64(var) QP_DUMP_VAR_FMT_VAL(var, "0x%016llx", (u64)var)
-#define QP_DUMP_VAR_HEX(var) QP_DUMP_VAR_FMT_VAL(var, "0x%08x", (u32)var)
+/** Terminate a value buffer, replacing what follows cut (if set) with more */
+static inline void qp_var_finish(char *pos, char *cut, const char *more)
+{
+    if (cut) {
+        pos = cut;
+        while (*more)
+            *pos++ = *more++;
+    }
+    *pos = '\0';
+}
 
-/** Check if argument is pointer (to anything) */
-#define QP_ARG_IS_POINTER(arg) (__builtin_classify_type(arg) == 5)
+/* Values are formatted up to end, the rest of the buffer is kept for the
+ * marker of values that did not fit
+ */
+#define QP__VAR_BUF_DEFINE() \
+        char qp_var_buf[QP_DUMP_VAR_SIZE]; \
+        char *qp_var_pos = qp_var_buf; \
+        char *qp_var_end = qp_var_buf + sizeof(qp_var_buf) - 6; \
+        char *qp_var_cut = NULL
 
+/** Print "var=value" for any variable or expression */
 #define QP_DUMP_VAR(var) do { \
-        typeof(var) val = (var); \
-        _Pragma("GCC diagnostic push"); \
-        _Pragma("GCC diagnostic ignored \"-Wpointer-to-int-cast\""); \
-        if (__builtin_types_compatible_p(typeof(val), uint64_t)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%lld", *((uint64_t*)(&(val)))); \
-        } else if (__builtin_types_compatible_p(typeof(val), bool)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%s", ((bool)(val)) ? "true" : "false"); \
-        } else if (__builtin_types_compatible_p(typeof(val), int)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%d", (int)(val)); \
-        } else if (__builtin_types_compatible_p(typeof(val), unsigned int)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%u", (unsigned int)(val)); \
-        } else if (__builtin_types_compatible_p(typeof(val), char)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%hhd", (signed char)(val)); \
-        } else if (__builtin_types_compatible_p(typeof(val), signed char)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%hhd", (signed char)(val)); \
-        } else if (__builtin_types_compatible_p(typeof(val), unsigned char)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%hhu", (unsigned char)(val)); \
-        } else if (QP_ARG_IS_POINTER(val)) { \
-            QP_DUMP_VAR_FMT_VAL(var, "%px", (void*)(uintptr_t)(val)); \
-        } else { \
-            QP_PRINT_LOC("WTF is " #var "?" QP_NL); \
-        } \
-        _Pragma("GCC diagnostic pop"); \
+        QP__VAR_BUF_DEFINE(); \
+        QP__VAR_FORMAT(qp_var_pos, qp_var_end, var); \
+        if (qp_var_pos == qp_var_end) \
+            qp_var_cut = qp_var_buf; \
+        qp_var_finish(qp_var_pos, qp_var_cut, QP__VAR_MORE); \
+        QP__DUMP_VAR_KV(var, QP_KV, "%s", qp_var_buf); \
     } while (0)
 
-/** Dump raw hex inline: no EOL, just space separator every 8 bytes */
-#define QP_DUMP_HEX_BYTES(buf, len) do { \
-        unsigned int idx; \
-        for (idx = 0; idx < len; ++idx) { \
-            QP_PRINT(QP_CONT "%s%02x", (idx && (idx % 8) == 0) ? " " : "", (int)((unsigned char*)buf)[idx]); \
-        } \
-    } while (0)
+/* Variables after the first one that does not fit are skipped */
+#define QP__DUMP_VARS_ONE(var) \
+        if (!qp_var_cut) { \
+            char *qp_var_start = qp_var_pos; \
+            qp_var_pos = qp_var_put_name(qp_var_pos, qp_var_end, #var, \
+                    qp_var_pos == qp_var_buf); \
+            QP__VAR_FORMAT(qp_var_pos, qp_var_end, var); \
+            if (qp_var_pos == qp_var_end) \
+                qp_var_cut = qp_var_start; \
+        }
 
-/** Dump a hex buffer nicely with a header
- *  @param buf Buffer to dump
- *  @param len Length of the buffer in bytes
- *  @param eol_count Insert EOL every this many bytes
- *  @param space_count Insert space every this many bytes
+/** Print "a=1 b=2 ..." for up to 64 variables as one record
+ *
+ * Structured records get one field per variable, named after it.
  */
-#define QP_DUMP_HEX_BUFFER_PRETTY(buf, len, eol_count, space_count) do { \
-        unsigned int idx; \
-        QP_PRINT_LOC("DUMP %u bytes from %p:", (unsigned int)(len), (buf)); \
-        for (idx = 0; idx < (unsigned int)(len); ++idx) { \
-            if (idx % (eol_count) == 0) { \
-                QP_PRINT(QP_CONT "\nDUMP %p:", ((unsigned char*)(buf)) + idx); \
-            } \
-            QP_PRINT(QP_CONT "%s%02x", ((idx % space_count) == 0) ? " " : "", (int)((unsigned char*)(buf))[idx]); \
-        } \
-        QP_PRINT(QP_CONT "\n"); \
+#define QP_DUMP_VARS(...) do { \
+        QP__VAR_BUF_DEFINE(); \
+        QP__FOR_EACH(QP__DUMP_VARS_ONE, __VA_ARGS__) \
+        qp_var_finish(qp_var_pos, qp_var_cut, QP__VARS_MORE); \
+        QP__PRINT_FIELDS_KEY("%s" QP_NL, "%s", "msg", "", qp_var_buf); \
     } while (0)
 
-/** Dump a hex buffer nicely with a header and up to 16 bytes per line */
-#define QP_DUMP_HEX_BUFFER(buf, len) QP_DUMP_HEX_BUFFER_PRETTY(buf, len, 16, 4);
-
 /** Dump struct msghdr and iov pointers
  *
  * This includes all fields in struct msghdr and each struct iovec but not the
@@ -748,29 +5809,40 @@
             (h), ntohs(((struct ethhdr*)(h))->h_proto), \
             QP_MAC_ARG(((struct ethhdr*)(h))->h_dest), \
             QP_MAC_ARG(((struct ethhdr*)(h))->h_source)
+/* Structured fields of each header dump, same conversions as the _FMT */
+#define QP_ETH_HDR_KV \
+            QP_KV_STR("ethhdr", "%p") QP_KV_STR("proto", "%04hx") \
+            QP_KV_STR("dst_mac", QP_MAC_FMT) QP_KV_STR("src_mac", QP_MAC_FMT)
 #define QP_DUMP_ETH_HDR(h) \
-        QP_PRINT_LOC(QP_ETH_HDR_FMT QP_NL, \
+        QP_PRINT_FIELDS(QP_ETH_HDR_FMT QP_NL, QP_ETH_HDR_KV, \
                 QP_ETH_HDR_ARG(h))
 
 #define QP_ARP_HDR_PFX_FMT "arphdr=%p htype=%02hx ptype=%02hx hlen=%hhu plen=%hhu oper=%02hx"
 #define QP_ARP_HDR_PFX_ARG(h) (h), ntohs((h)->ar_hrd), ntohs((h)->ar_pro), (h)->ar_hln, (h)->ar_pln, ntohs((h)->ar_op)
+#define QP_ARP_HDR_PFX_KV \
+            QP_KV_STR("arphdr", "%p") QP_KV_STR("htype", "%02hx") QP_KV_STR("ptype", "%02hx") \
+            QP_KV("hlen", "%hhu") QP_KV("plen", "%hhu") QP_KV_STR("oper", "%02hx")
 
 #define QP_DUMP_ARP_HDR(h) do { \
         if ((h)->ar_hln == 6 && (h)->ar_pln == 4) { \
-            QP_PRINT_LOC(QP_ARP_HDR_PFX_FMT \
+            QP_PRINT_FIELDS(QP_ARP_HDR_PFX_FMT \
                     " sha=" QP_MAC_FMT " spa=" QP_IPV4_FMT \
                     " tha=" QP_MAC_FMT " tpa=" QP_IPV4_FMT "\n", \
+                    QP_ARP_HDR_PFX_KV \
+                    QP_KV_STR("sha", QP_MAC_FMT) QP_KV_STR("spa", QP_IPV4_FMT) \
+                    QP_KV_STR("tha", QP_MAC_FMT) QP_KV_STR("tpa", QP_IPV4_FMT), \
                     QP_ARP_HDR_PFX_ARG(h), \
                     QP_MAC_ARG((u8*)(h) + sizeof(struct arphdr)), \
                     QP_IPV4_ARG((u8*)(h) + sizeof(struct arphdr) + 6), \
                     QP_MAC_ARG((u8*)(h) + sizeof(struct arphdr) + 10), \
                     QP_IPV4_ARG((u8*)(h) + sizeof(struct arphdr) + 16)); \
         } else { \
-            QP_PRINT_LOC(QP_ARP_HDR_PFX_FMT " other\n", QP_ARP_HDR_PFX_ARG(h)); \
+            QP_PRINT_FIELDS_MSG(QP_ARP_HDR_PFX_FMT " ", QP_ARP_HDR_PFX_KV, "other\n", \
+                    QP_ARP_HDR_PFX_ARG(h)); \
         } \
     } while(0)
 
-#define QP_DUMP_IPV4_HDR(h) QP_PRINT_LOC(\
+#define QP_IPV4_HDR_FMT \
             "iphdr=%p version=%u" \
             " hdr_len=%u" \
             " tos=%hhx" \
@@ -780,8 +5852,8 @@
             " protocol=%hhx " \
             " check=%02hx" \
             " saddr=" QP_IPV4_FMT \
-            " daddr=" QP_IPV4_FMT \
-            "\n", \
+            " daddr=" QP_IPV4_FMT
+#define QP_IPV4_HDR_ARG(h) \
             (h), (h)->version, \
             (h)->ihl, \
             (h)->tos, \
@@ -792,7 +5864,19 @@
             (h)->protocol, \
             (h)->check, \
             QP_IPV4_ARG(&(h)->saddr), \
-            QP_IPV4_ARG(&(h)->daddr))
+            QP_IPV4_ARG(&(h)->daddr)
+#define QP_IPV4_HDR_KV \
+            QP_KV_STR("iphdr", "%p") QP_KV("version", "%u") \
+            QP_KV("hdr_len", "%u") \
+            QP_KV_STR("tos", "%hhx") \
+            QP_KV("tot_len", "%hu") \
+            QP_KV_STR("id", "%04hx") QP_KV_STR("frag_off", "%04hx") \
+            QP_KV_STR("ttl", "%hhx") \
+            QP_KV_STR("protocol", "%hhx") \
+            QP_KV_STR("check", "%02hx") \
+            QP_KV_STR("saddr", QP_IPV4_FMT) \
+            QP_KV_STR("daddr", QP_IPV4_FMT)
+#define QP_DUMP_IPV4_HDR(h) QP_PRINT_FIELDS(QP_IPV4_HDR_FMT "\n", QP_IPV4_HDR_KV, QP_IPV4_HDR_ARG(h))
 
 #define QP_IPV6_HDR_FMT \
             "iphdr=%p" \
@@ -812,7 +5896,16 @@
             (h)->hop_limit, \
             QP_IPV6_ARG(&(h)->saddr), \
             QP_IPV6_ARG(&(h)->daddr)
-#define QP_DUMP_IPV6_HDR(h) QP_PRINT_LOC(QP_IPV6_HDR_FMT QP_NL, QP_IPV6_HDR_ARG(h))
+#define QP_IPV6_HDR_KV \
+            QP_KV_STR("iphdr", "%p") \
+            QP_KV("version", "%u") \
+            QP_KV("priority", "%u") \
+            QP_KV("payload_len", "%hu") \
+            QP_KV_STR("nexthdr", "0x%hhx") \
+            QP_KV("hop_limit", "%hhd") \
+            QP_KV_STR("saddr", QP_IPV6_FMT) \
+            QP_KV_STR("daddr", QP_IPV6_FMT)
+#define QP_DUMP_IPV6_HDR(h) QP_PRINT_FIELDS(QP_IPV6_HDR_FMT QP_NL, QP_IPV6_HDR_KV, QP_IPV6_HDR_ARG(h))
 
 #define QP_DUMP_IPVX_HDR(h) do { \
         if (((struct iphdr*)(h))->version == 4) { \
@@ -832,7 +5925,11 @@
             ntohs((h)->source), ntohs((h)->dest), \
             ntohs((h)->len), ntohs((h)->check)
 
-#define QP_DUMP_UDP_HDR(h) QP_PRINT_LOC(QP_UDP_HDR_FMT QP_NL, QP_UDP_HDR_ARG(h))
+#define QP_UDP_HDR_KV \
+            QP_KV_STR("udphdr", "%p") QP_KV("sport", "%hu") QP_KV("dport", "%hu") \
+            QP_KV("len", "%hu") QP_KV_STR("csum", "%#hx")
+
+#define QP_DUMP_UDP_HDR(h) QP_PRINT_FIELDS(QP_UDP_HDR_FMT QP_NL, QP_UDP_HDR_KV, QP_UDP_HDR_ARG(h))
 
 #define QP_TCP_HDR_FMT \
             "tcphdr=%p sport=%hu dport=%hu" \
@@ -853,7 +5950,527 @@
             (h)->urg ? " URG" : "", \
             (h)->window, ntohs((h)->check), ntohs((h)->urg)
 
-#define QP_DUMP_TCP_HDR(h) QP_PRINT_LOC(QP_TCP_HDR_FMT QP_NL, QP_TCP_HDR_ARG(h))
+#define QP_TCP_HDR_KV \
+            QP_KV_STR("tcphdr", "%p") QP_KV("sport", "%hu") QP_KV("dport", "%hu") \
+            QP_KV("seq", "%u") QP_KV("ack", "%u") QP_KV("doff", "%u") \
+            QP_KV_STR("flags", "%04hx%s%s%s%s%s%s") \
+            QP_KV("win", "%u") QP_KV_STR("csum", "%04hx") QP_KV("urg", "%hu")
+
+#define QP_DUMP_TCP_HDR(h) QP_PRINT_FIELDS(QP_TCP_HDR_FMT QP_NL, QP_TCP_HDR_KV, QP_TCP_HDR_ARG(h))
+
+#define QP_ICMP_HDR_FMT "icmphdr=%p type=%hhu code=%hhu"
+#define QP_ICMP_HDR_ARG(h) (h), ((const uint8_t *)(h))[0], ((const uint8_t *)(h))[1]
+
+/** Maximum number of stacked VLAN tags walked by #QP_DUMP_PACKET */
+#define QP_PACKET_MAX_VLANS 2
+/** Maximum number of IPv6 extension headers walked by #QP_DUMP_PACKET */
+#define QP_PACKET_MAX_EXTHDRS 8
+
+#define QP__PACKET_BE16(p) ((uint16_t)((p)[0] << 8 | (p)[1]))
+
+/* Walk all headers of a packet and print them on one line.
+ *
+ * get(src, off, n, tmp) returns a pointer to n bytes at offset off, which may
+ * be a copy in tmp, or NULL if the packet is shorter. ethertype is 0 if the
+ * packet starts with an ethernet header, otherwise the protocol of the first
+ * header. Each layer is appended with the QP_*_HDR_FMT of its header, so
+ * header pointers refer to tmp copies when the data is not contiguous.
+ */
+#define QP__DUMP_PACKET(get, src, len, ethertype) do { \
+        QP__DUMP_SITE_DECLARE("packet len=%u"); \
+        unsigned char qp_pkt_eth_tmp[14], qp_pkt_ip_tmp[40], qp_pkt_l4_tmp[20], qp_pkt_tmp[4]; \
+        const unsigned char *qp_pkt_hdr; \
+        unsigned int qp_pkt_len = (len), qp_pkt_off = 0, qp_pkt_hlen, qp_pkt_i; \
+        unsigned int qp_pkt_proto = (ethertype), qp_pkt_l4 = 256; \
+        QP__DUMP_SITE_CHECK(); \
+        QP_LINE_HOLD(); \
+        QP__DUMP_LINE_PRINT_LOC("packet len=%u", qp_pkt_len); \
+        do { \
+            if (!qp_pkt_proto) { \
+                if (!(qp_pkt_hdr = get(src, 0, 14, qp_pkt_eth_tmp))) { \
+                    QP_LINE_PRINT(" truncated=eth"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_ETH_HDR_FMT, QP_ETH_HDR_ARG(qp_pkt_hdr)); \
+                qp_pkt_proto = QP__PACKET_BE16(qp_pkt_hdr + 12); \
+                qp_pkt_off = 14; \
+            } \
+            for (qp_pkt_i = 0; qp_pkt_i < QP_PACKET_MAX_VLANS && \
+                    (qp_pkt_proto == 0x8100 || qp_pkt_proto == 0x88a8); ++qp_pkt_i) { \
+                if (!(qp_pkt_hdr = get(src, qp_pkt_off, 4, qp_pkt_tmp))) \
+                    break; \
+                QP_LINE_PRINT(" vlan=%u prio=%u", \
+                        QP__PACKET_BE16(qp_pkt_hdr) & 0xfff, qp_pkt_hdr[0] >> 5); \
+                qp_pkt_proto = QP__PACKET_BE16(qp_pkt_hdr + 2); \
+                qp_pkt_off += 4; \
+            } \
+            if (qp_pkt_proto == 0x0800) { \
+                qp_pkt_hdr = get(src, qp_pkt_off, 20, qp_pkt_ip_tmp); \
+                if (!qp_pkt_hdr || (qp_pkt_hdr[0] & 0xf) < 5) { \
+                    QP_LINE_PRINT(" truncated=ipv4"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_IPV4_HDR_FMT, \
+                        QP_IPV4_HDR_ARG((const struct iphdr *)qp_pkt_hdr)); \
+                qp_pkt_off += (qp_pkt_hdr[0] & 0xf) * 4; \
+                qp_pkt_l4 = qp_pkt_hdr[9]; \
+                /* Only the first fragment has a transport header */ \
+                if (QP__PACKET_BE16(qp_pkt_hdr + 6) & 0x1fff) \
+                    break; \
+            } else if (qp_pkt_proto == 0x86dd) { \
+                if (!(qp_pkt_hdr = get(src, qp_pkt_off, 40, qp_pkt_ip_tmp))) { \
+                    QP_LINE_PRINT(" truncated=ipv6"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_IPV6_HDR_FMT, \
+                        QP_IPV6_HDR_ARG((const struct ipv6hdr *)qp_pkt_hdr)); \
+                qp_pkt_off += 40; \
+                qp_pkt_l4 = qp_pkt_hdr[6]; \
+                for (qp_pkt_i = 0; qp_pkt_i < QP_PACKET_MAX_EXTHDRS; ++qp_pkt_i) { \
+                    if (qp_pkt_l4 != 0 && qp_pkt_l4 != 43 && qp_pkt_l4 != 44 && \
+                            qp_pkt_l4 != 51 && qp_pkt_l4 != 60) \
+                        break; \
+                    if (!(qp_pkt_hdr = get(src, qp_pkt_off, 4, qp_pkt_tmp))) { \
+                        qp_pkt_l4 = 256; \
+                        break; \
+                    } \
+                    QP_LINE_PRINT(" exthdr=%u", qp_pkt_l4); \
+                    if (qp_pkt_l4 == 44) \
+                        qp_pkt_hlen = 8; \
+                    else if (qp_pkt_l4 == 51) \
+                        qp_pkt_hlen = (qp_pkt_hdr[1] + 2) * 4; \
+                    else \
+                        qp_pkt_hlen = (qp_pkt_hdr[1] + 1) * 8; \
+                    if (qp_pkt_l4 == 44 && (QP__PACKET_BE16(qp_pkt_hdr + 2) & 0xfff8)) { \
+                        qp_pkt_l4 = 257; \
+                        break; \
+                    } \
+                    qp_pkt_l4 = qp_pkt_hdr[0]; \
+                    qp_pkt_off += qp_pkt_hlen; \
+                } \
+            } else { \
+                QP_LINE_PRINT(" proto=%04x", qp_pkt_proto); \
+                break; \
+            } \
+            if (qp_pkt_l4 == 6) { \
+                qp_pkt_hdr = get(src, qp_pkt_off, 20, qp_pkt_l4_tmp); \
+                if (!qp_pkt_hdr || (qp_pkt_hdr[12] >> 4) < 5) { \
+                    QP_LINE_PRINT(" truncated=tcp"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_TCP_HDR_FMT, \
+                        QP_TCP_HDR_ARG((const struct tcphdr *)qp_pkt_hdr)); \
+                qp_pkt_off += (qp_pkt_hdr[12] >> 4) * 4; \
+            } else if (qp_pkt_l4 == 17) { \
+                if (!(qp_pkt_hdr = get(src, qp_pkt_off, 8, qp_pkt_l4_tmp))) { \
+                    QP_LINE_PRINT(" truncated=udp"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_UDP_HDR_FMT, \
+                        QP_UDP_HDR_ARG((const struct udphdr *)qp_pkt_hdr)); \
+                qp_pkt_off += 8; \
+            } else if (qp_pkt_l4 == 1 || qp_pkt_l4 == 58) { \
+                if (!(qp_pkt_hdr = get(src, qp_pkt_off, 8, qp_pkt_l4_tmp))) { \
+                    QP_LINE_PRINT(" truncated=icmp"); \
+                    break; \
+                } \
+                QP_LINE_PRINT(" " QP_ICMP_HDR_FMT, QP_ICMP_HDR_ARG(qp_pkt_hdr)); \
+                qp_pkt_off += 8; \
+            } else { \
+                /* 256 is a truncated extension header, 257 a later fragment */ \
+                if (qp_pkt_l4 == 256) \
+                    QP_LINE_PRINT(" truncated=exthdr"); \
+                else if (qp_pkt_l4 < 256) \
+                    QP_LINE_PRINT(" l4proto=%u", qp_pkt_l4); \
+                break; \
+            } \
+            if (qp_pkt_off <= qp_pkt_len) \
+                QP_LINE_PRINT(" payload=%u", qp_pkt_len - qp_pkt_off); \
+        } while (0); \
+        QP_LINE_PRINT("\n"); \
+        QP_LINE_FLUSH(); \
+    } while (0)
+
+#define QP__PACKET_BUF_GET(buf, off, n, tmp) \
+        ((void)(tmp), (off) + (n) <= qp_pkt_len ? (const unsigned char *)(buf) + (off) : NULL)
+
+/** Print all headers of an ethernet frame on one line
+ *
+ * Walks VLAN tags, IPv4 or IPv6 with extension headers and TCP, UDP or ICMP
+ * without ever reading past len.
+ */
+#define QP_DUMP_PACKET(buf, len) QP__DUMP_PACKET(QP__PACKET_BUF_GET, buf, len, 0)
+
+#define QP__PACKET_SKB_GET(skb, off, n, tmp) \
+        ((const unsigned char *)skb_header_pointer((skb), qp_pkt_skb_start + (int)(off), (n), (tmp)))
+
+/** Like #QP_DUMP_PACKET for an skb, starting from its mac header if set and
+ *  from the network header (with skb->protocol) otherwise.
+ *
+ * Headers in paged data are copied with skb_header_pointer, the skb is not
+ * linearized.
+ */
+#define QP_DUMP_SKB_PACKET(skb) do { \
+        struct sk_buff *qp_pkt_skb = (skb); \
+        int qp_pkt_skb_eth = skb_mac_header_was_set(qp_pkt_skb) && \
+                skb_mac_header_len(qp_pkt_skb) >= ETH_HLEN; \
+        int qp_pkt_skb_start = qp_pkt_skb_eth ? skb_mac_offset(qp_pkt_skb) : \
+                skb_network_offset(qp_pkt_skb); \
+        QP__DUMP_PACKET(QP__PACKET_SKB_GET, qp_pkt_skb, qp_pkt_skb->len - qp_pkt_skb_start, \
+                qp_pkt_skb_eth ? 0 : ntohs(qp_pkt_skb->protocol)); \
+    } while (0)
+
+/* Flow accounting: packet and byte counters per 5-tuple in a fixed-capacity
+ * open-addressing hash table.
+ *
+ * Slots are claimed with a compare-exchange on their tag (the key hash) and
+ * counted with atomic adds. When all QP_FLOW_PROBES slots from the hash
+ * position are taken, the least recently used one is evicted: each slot
+ * remembers the last report interval in which it was hit. Packets of an
+ * evicted flow racing with the eviction may be counted to the new flow.
+ */
+
+/** Number of slots in each flow table, must be a power of two */
+#ifndef QP_FLOW_TABLE_SIZE
+    #define QP_FLOW_TABLE_SIZE 1024
+#endif
+/** Number of slots searched for a flow before evicting one of them */
+#ifndef QP_FLOW_PROBES
+    #define QP_FLOW_PROBES 8
+#endif
+/** Number of flows shown by packet rate and by byte rate in each report */
+#ifndef QP_FLOW_TOPN
+    #define QP_FLOW_TOPN 5
+#endif
+
+/** Tag of a slot whose key is being written */
+#define QP_FLOW_TAG_BUSY 1
+
+struct qp_flow_key {
+    uint8_t saddr[16];
+    uint8_t daddr[16];
+    uint16_t sport;
+    uint16_t dport;
+    /* 4 or 6 */
+    uint8_t family;
+    uint8_t proto;
+    uint8_t reserved[2];
+};
+
+struct qp_flow_slot {
+    /* Hash of the key, zero if unused */
+    unsigned long long tag;
+    unsigned long epoch;
+    struct qp_flow_key key;
+    QP_LONG_COUNTER_T packets;
+    QP_LONG_COUNTER_T bytes;
+    QP_LONG_COUNTER_T last_packets;
+    QP_LONG_COUNTER_T last_bytes;
+};
+
+struct qp_flow_table {
+    /* Incremented by each report */
+    unsigned long epoch;
+    QP_LONG_COUNTER_T packets;
+    QP_LONG_COUNTER_T bytes;
+    QP_LONG_COUNTER_T last_packets;
+    QP_LONG_COUNTER_T last_bytes;
+    QP_LONG_COUNTER_T unparsed;
+    QP_LONG_COUNTER_T evicted;
+    struct qp_flow_slot slots[QP_FLOW_TABLE_SIZE];
+};
+
+/** One flow of a report with its counts since the previous report */
+struct qp_flow_top {
+    struct qp_flow_key key;
+    QP_LONG_COUNTER_T packets;
+    QP_LONG_COUNTER_T bytes;
+};
+
+/** Extract the 5-tuple of a packet which starts with an ethernet header if
+ *  ethertype is 0, otherwise with a header of that protocol.
+ *
+ * Ports are zero for protocols without them and for later fragments.
+ * Returns 0 on success or -1 if this is not a complete IPv4 or IPv6 header.
+ */
+static inline int qp_flow_key_parse(struct qp_flow_key *key,
+        const unsigned char *pkt, unsigned int len, unsigned int ethertype)
+{
+    unsigned int off = 0, i, l4, hlen, proto = ethertype;
+
+    memset(key, 0, sizeof(*key));
+    if (!proto) {
+        if (len < 14)
+            return -1;
+        proto = QP__PACKET_BE16(pkt + 12);
+        off = 14;
+    }
+    for (i = 0; i < QP_PACKET_MAX_VLANS && (proto == 0x8100 || proto == 0x88a8); ++i) {
+        if (off + 4 > len)
+            return -1;
+        proto = QP__PACKET_BE16(pkt + off + 2);
+        off += 4;
+    }
+    if (proto == 0x0800) {
+        if (off + 20 > len || (pkt[off] & 0xf) < 5)
+            return -1;
+        key->family = 4;
+        memcpy(key->saddr, pkt + off + 12, 4);
+        memcpy(key->daddr, pkt + off + 16, 4);
+        key->proto = l4 = pkt[off + 9];
+        if (QP__PACKET_BE16(pkt + off + 6) & 0x1fff)
+            return 0;
+        off += (pkt[off] & 0xf) * 4;
+    } else if (proto == 0x86dd) {
+        if (off + 40 > len)
+            return -1;
+        key->family = 6;
+        memcpy(key->saddr, pkt + off + 8, 16);
+        memcpy(key->daddr, pkt + off + 24, 16);
+        l4 = pkt[off + 6];
+        off += 40;
+        for (i = 0; i < QP_PACKET_MAX_EXTHDRS; ++i) {
+            if (l4 != 0 && l4 != 43 && l4 != 44 && l4 != 51 && l4 != 60)
+                break;
+            if (off + 4 > len)
+                break;
+            if (l4 == 44 && (QP__PACKET_BE16(pkt + off + 2) & 0xfff8)) {
+                key->proto = pkt[off];
+                return 0;
+            }
+            hlen = l4 == 44 ? 8 : l4 == 51 ? (pkt[off + 1] + 2) * 4 : (pkt[off + 1] + 1) * 8;
+            l4 = pkt[off];
+            off += hlen;
+        }
+        key->proto = l4;
+    } else {
+        return -1;
+    }
+    if ((l4 == 6 || l4 == 17 || l4 == 132) && off + 4 <= len) {
+        key->sport = QP__PACKET_BE16(pkt + off);
+        key->dport = QP__PACKET_BE16(pkt + off + 2);
+    }
+
+    return 0;
+}
+
+static inline unsigned long long qp_flow_hash(const struct qp_flow_key *key)
+{
+    unsigned long long words[sizeof(*key) / 8], hash = 0;
+    unsigned int i;
+
+    memcpy(words, key, sizeof(words));
+    for (i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+        hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+
+    /* Zero and QP_FLOW_TAG_BUSY are reserved */
+    return hash < 2 ? hash + 2 : hash;
+}
+
+/** Find or insert the slot of a flow, returns NULL if it lost an eviction race */
+static inline struct qp_flow_slot *qp_flow_slot_get(struct qp_flow_table *table,
+        const struct qp_flow_key *key, unsigned long long hash)
+{
+    struct qp_flow_slot *slot, *victim = NULL;
+    unsigned long long cur, victim_tag = 0;
+    unsigned int i;
+
+    for (i = 0; i < QP_FLOW_PROBES; ++i) {
+        slot = &table->slots[(hash + i) & (QP_FLOW_TABLE_SIZE - 1)];
+        cur = QP_ATOMIC_LOAD_ACQUIRE(&slot->tag);
+        if (!cur && QP_ATOMIC_CAS(&slot->tag, &cur, QP_FLOW_TAG_BUSY)) {
+            slot->key = *key;
+            QP_ATOMIC_STORE_RELEASE(&slot->tag, hash);
+            return slot;
+        }
+        if (cur == hash && !memcmp(&slot->key, key, sizeof(*key)))
+            return slot;
+        if (cur != QP_FLOW_TAG_BUSY && (!victim ||
+                (long)(QP_ATOMIC_LOAD(&slot->epoch) - QP_ATOMIC_LOAD(&victim->epoch)) < 0)) {
+            victim = slot;
+            victim_tag = cur;
+        }
+    }
+    if (!victim || !QP_ATOMIC_CAS(&victim->tag, &victim_tag, QP_FLOW_TAG_BUSY))
+        return NULL;
+    QP_ATOMIC_STORE(&victim->packets, 0);
+    QP_ATOMIC_STORE(&victim->bytes, 0);
+    victim->last_packets = 0;
+    victim->last_bytes = 0;
+    victim->key = *key;
+    QP_ATOMIC_STORE_RELEASE(&victim->tag, hash);
+    QP_ATOMIC_ADD(&table->evicted, 1);
+
+    return victim;
+}
+
+/** Account one packet of len bytes, see qp_flow_key_parse for ethertype */
+static inline void qp_flow_add(struct qp_flow_table *table,
+        const unsigned char *pkt, unsigned int len, unsigned int ethertype)
+{
+    struct qp_flow_key key;
+    struct qp_flow_slot *slot;
+    unsigned long epoch;
+
+    QP_ATOMIC_ADD(&table->packets, 1);
+    QP_ATOMIC_ADD(&table->bytes, len);
+    if (qp_flow_key_parse(&key, pkt, len, ethertype) ||
+            !(slot = qp_flow_slot_get(table, &key, qp_flow_hash(&key)))) {
+        QP_ATOMIC_ADD(&table->unparsed, 1);
+        return;
+    }
+    epoch = QP_ATOMIC_LOAD(&table->epoch);
+    if (QP_ATOMIC_LOAD(&slot->epoch) != epoch)
+        QP_ATOMIC_STORE(&slot->epoch, epoch);
+    QP_ATOMIC_ADD(&slot->packets, 1);
+    QP_ATOMIC_ADD(&slot->bytes, len);
+}
+
+static inline void qp_flow_top_insert(struct qp_flow_top *top, unsigned int *ntop,
+        const struct qp_flow_top *flow, int by_bytes)
+{
+    unsigned int j;
+
+    for (j = *ntop; j > 0; --j) {
+        if (by_bytes ? top[j - 1].bytes >= flow->bytes : top[j - 1].packets >= flow->packets)
+            break;
+        if (j < QP_FLOW_TOPN)
+            top[j] = top[j - 1];
+    }
+    if (j < QP_FLOW_TOPN) {
+        top[j] = *flow;
+        if (*ntop < QP_FLOW_TOPN)
+            ++*ntop;
+    }
+}
+
+/** Collect the flows with the most packets and the most bytes since the
+ *  previous report and start a new interval. Returns the number of flows.
+ */
+static inline unsigned int qp_flow_report(struct qp_flow_table *table,
+        struct qp_flow_top *top_packets, unsigned int *npackets,
+        struct qp_flow_top *top_bytes, unsigned int *nbytes)
+{
+    struct qp_flow_top flow;
+    unsigned int i, nflows = 0;
+
+    *npackets = *nbytes = 0;
+    for (i = 0; i < QP_FLOW_TABLE_SIZE; ++i) {
+        struct qp_flow_slot *slot = &table->slots[i];
+        QP_LONG_COUNTER_T packets, bytes;
+
+        if (QP_ATOMIC_LOAD_ACQUIRE(&slot->tag) < 2)
+            continue;
+        ++nflows;
+        packets = QP_ATOMIC_LOAD(&slot->packets);
+        bytes = QP_ATOMIC_LOAD(&slot->bytes);
+        flow.packets = packets - slot->last_packets;
+        flow.bytes = bytes - slot->last_bytes;
+        slot->last_packets = packets;
+        slot->last_bytes = bytes;
+        if (!flow.packets)
+            continue;
+        flow.key = slot->key;
+        qp_flow_top_insert(top_packets, npackets, &flow, 0);
+        qp_flow_top_insert(top_bytes, nbytes, &flow, 1);
+    }
+    QP_ATOMIC_ADD(&table->epoch, 1);
+
+    return nflows;
+}
+
+/** Format "udp 10.0.0.1:53 > 10.0.0.2:4343" */
+static inline int qp_flow_format(const struct qp_flow_key *key, char *buf, size_t size)
+{
+    const char *proto = key->proto == 6 ? "tcp" : key->proto == 17 ? "udp" :
+            key->proto == 1 ? "icmp" : key->proto == 58 ? "icmpv6" :
+            key->proto == 132 ? "sctp" : NULL;
+    char name[16];
+    int len;
+
+    if (!proto) {
+        snprintf(name, sizeof(name), "proto%u", key->proto);
+        proto = name;
+    }
+    if (key->family == 4)
+        len = snprintf(buf, size, "%s " QP_IPV4_FMT ":%u > " QP_IPV4_FMT ":%u", proto,
+                QP_IPV4_ARG(key->saddr), key->sport, QP_IPV4_ARG(key->daddr), key->dport);
+    else
+        len = snprintf(buf, size, "%s [" QP_IPV6_FMT "]:%u > [" QP_IPV6_FMT "]:%u", proto,
+                QP_IPV6_ARG(key->saddr), key->sport, QP_IPV6_ARG(key->daddr), key->dport);
+
+    return len;
+}
+
+#define QP__FLOW_RATE(cnt, delta_ms) ({ \
+        QP_LONG_COUNTER_T qp_flow_rate = (cnt) * 1000; \
+        do_div(qp_flow_rate, (delta_ms)); \
+        (unsigned long long)qp_flow_rate; \
+    })
+
+#define QP__FLOW_PRINT_TOP(title, top, ntop, delta_ms) do { \
+        char qp_flow_buf[128]; \
+        unsigned int qp_flow_i; \
+        for (qp_flow_i = 0; qp_flow_i < (ntop); ++qp_flow_i) { \
+            qp_flow_format(&(top)[qp_flow_i].key, qp_flow_buf, sizeof(qp_flow_buf)); \
+            QP_LINE_PRINT("\n" title " %s %llu/s %lluB/s", qp_flow_buf, \
+                    QP__FLOW_RATE((top)[qp_flow_i].packets, delta_ms), \
+                    QP__FLOW_RATE((top)[qp_flow_i].bytes, delta_ms)); \
+        } \
+    } while (0)
+
+#define QP__FLOW_ACCOUNT(pkt, len, ethertype) do { \
+        static struct qp_flow_table qp_flow_table; \
+        unsigned long qp_flow_delta_ms; \
+        qp_flow_add(&qp_flow_table, (const unsigned char *)(pkt), (len), (ethertype)); \
+        qp_flow_delta_ms = QP_RATELIMIT(QP_RATELIMIT_INTERVAL); \
+        if (unlikely(qp_flow_delta_ms)) { \
+            QP__DUMP_SITE_DECLARE("flows=%u evicted=%llu unparsed=%llu %llu/s %lluB/s"); \
+            struct qp_flow_top qp_flow_top_packets[QP_FLOW_TOPN]; \
+            struct qp_flow_top qp_flow_top_bytes[QP_FLOW_TOPN]; \
+            unsigned int qp_flow_npackets, qp_flow_nbytes, qp_flow_nflows; \
+            QP_LONG_COUNTER_T qp_flow_packets = QP_ATOMIC_LOAD(&qp_flow_table.packets); \
+            QP_LONG_COUNTER_T qp_flow_bytes = QP_ATOMIC_LOAD(&qp_flow_table.bytes); \
+            qp_flow_nflows = qp_flow_report(&qp_flow_table, \
+                    qp_flow_top_packets, &qp_flow_npackets, \
+                    qp_flow_top_bytes, &qp_flow_nbytes); \
+            /* Only the report is skipped, the flows are still counted */ \
+            QP__DUMP_SITE_CHECK(); \
+            QP_LINE_HOLD(); \
+            QP__DUMP_LINE_PRINT_LOC("flows=%u evicted=%llu unparsed=%llu %llu/s %lluB/s", \
+                    qp_flow_nflows, \
+                    (unsigned long long)QP_ATOMIC_LOAD(&qp_flow_table.evicted), \
+                    (unsigned long long)QP_ATOMIC_LOAD(&qp_flow_table.unparsed), \
+                    QP__FLOW_RATE(qp_flow_packets - qp_flow_table.last_packets, qp_flow_delta_ms), \
+                    QP__FLOW_RATE(qp_flow_bytes - qp_flow_table.last_bytes, qp_flow_delta_ms)); \
+            qp_flow_table.last_packets = qp_flow_packets; \
+            qp_flow_table.last_bytes = qp_flow_bytes; \
+            QP__FLOW_PRINT_TOP("top packets:", qp_flow_top_packets, qp_flow_npackets, \
+                    qp_flow_delta_ms); \
+            QP__FLOW_PRINT_TOP("top bytes:", qp_flow_top_bytes, qp_flow_nbytes, \
+                    qp_flow_delta_ms); \
+            QP_LINE_PRINT("\n"); \
+            QP_LINE_FLUSH(); \
+        } \
+    } while (0)
+
+/** Count packets and bytes per flow at this location, with a periodic report
+ *  of the top #QP_FLOW_TOPN flows by packet rate and by byte rate:
+ *
+ *     flows=N evicted=E unparsed=U pps/s bytesB/s
+ *     top packets: udp 10.0.0.1:53 > 10.0.0.2:4343 pps/s bytesB/s
+ *     ...
+ *     top bytes: ...
+ *
+ * pkt starts with an ethernet header and len is the length of the frame.
+ */
+#define QP_FLOW_ACCOUNT(pkt, len) QP__FLOW_ACCOUNT(pkt, len, 0)
+
+/** Like #QP_FLOW_ACCOUNT for a packet which starts with an IPv4 or IPv6 header */
+#define QP_FLOW_ACCOUNT_IP(pkt, len) QP__FLOW_ACCOUNT(pkt, len, \
+        (len) && (((const unsigned char *)(pkt))[0] >> 4) == 6 ? 0x86dd : 0x0800)
 
 #define QP__VALUE_MASK_ARG(val, mask) \
             ((val) & (mask) ? " "#mask : "")
@@ -943,16 +6560,20 @@
     } while (0)
 
 #define QP_DUMP_SOCKADDR_LL(a) do { \
+        QP__DUMP_SITE_DECLARE( \
+                "sockaddr_ll=%p family=%04hx protocol=%04hx ifindex=%d" \
+                " hatype=%hu pkttype=%hhu halen=%hhu addr"); \
         unsigned int addr_index; \
-        QP_PRINT_LOC( \
+        QP__DUMP_SITE_CHECK(); \
+        QP__DUMP_LINE_PRINT_LOC( \
                 "sockaddr_ll=%p family=%04hx protocol=%04hx ifindex=%d" \
                 " hatype=%hu pkttype=%hhu halen=%hhu addr", \
                 (a), (a)->sll_family, ntohs((a)->sll_protocol), (a)->sll_ifindex, \
                 (a)->sll_hatype, (a)->sll_pkttype, (a)->sll_halen); \
         for (addr_index = 0; addr_index < (a)->sll_halen && addr_index < 8; ++addr_index) { \
-                QP_PRINT("%c%02hhx", addr_index ? ':' : '=', (a)->sll_addr[addr_index]); \
+                QP_LINE_PRINT("%c%02hhx", addr_index ? ':' : '=', (a)->sll_addr[addr_index]); \
         } \
-        QP_PRINT("\n"); \
+        QP_LINE_PRINT("\n"); \
     } while (0)
 
 #define QP_DUMP_SOCKADDR_IN(a) \
@@ -989,12 +6610,14 @@
         QP_DUMP_NLMSGHDR(m); \
         struct rtattr *a = (struct rtattr *)(((u8*)(m)) + (delta)); \
         int alen = (m)->nlmsg_len - (delta); \
+        QP_LINE_HOLD(); \
         while (RTA_OK(a, alen)) { \
-            QP_PRINT_LOC("type=0x%04x len=%d buf=", a->rta_type, a->rta_len); \
-            QP_DUMP_HEX_BYTES(a + 1, a->rta_len); \
-            QP_PRINT("\n"); \
+            QP_LINE_PRINT_LOC("type=0x%04x len=%d buf=", a->rta_type, a->rta_len); \
+            QP__LINE_HEX_BYTES(a + 1, a->rta_len); \
+            QP_LINE_PRINT("\n"); \
             a = RTA_NEXT(a, alen); \
         } \
+        QP_LINE_FLUSH(); \
     } while (0)
 
 #define QP_GETSOCKOPT_INT(fd, level, optname) ({ \
@@ -1095,4 +6718,422 @@
         } \
     } while (0)
 
+#ifdef QP_PROJECT_GLIBC
+/* Packet capture.
+ *
+ * QP_CAPTURE_PACKET appends a raw frame to a pcapng file which can be opened
+ * directly with wireshark or "tcpdump -r". Each frame is an Enhanced Packet
+ * Block with a nanosecond timestamp and a "file:line func" comment.
+ *
+ * The file is preallocated to QP_CAPTURE_FILE_SIZE and mapped shared. Writers
+ * reserve space with an atomic add on the mapping's offset and copy the block
+ * directly into it. The writer whose block does not fit rolls over: previous
+ * files are renamed to "name.1" ... "name.N-1" and a new file is started. Each
+ * file is truncated to the blocks it contains when it is closed, at exit or by
+ * qp_capture_close(). A process which crashes leaves a zero-filled tail which
+ * wireshark reports as an error after the last packet.
+ */
+
+/** Capture file name, can be overridden with the QP_CAPTURE_FILE env var */
+#ifndef QP_CAPTURE_FILE
+    #define QP_CAPTURE_FILE "qp.pcapng"
+#endif
+
+/** Size of each capture file, must be a multiple of the page size */
+#ifndef QP_CAPTURE_FILE_SIZE
+    #define QP_CAPTURE_FILE_SIZE (64 << 20)
+#endif
+
+/** Number of capture files kept, including the one being written */
+#ifndef QP_CAPTURE_FILE_COUNT
+    #define QP_CAPTURE_FILE_COUNT 2
+#endif
+
+/** Maximum number of bytes stored from each frame */
+#ifndef QP_CAPTURE_SNAPLEN
+    #define QP_CAPTURE_SNAPLEN 65535
+#endif
+
+/** Interface of frames starting with an ethernet header */
+#define QP_CAPTURE_IF_ETHERNET 0
+/** Interface of frames starting with an IPv4 or IPv6 header */
+#define QP_CAPTURE_IF_RAW 1
+
+#define QP_PCAPNG_SHB 0x0a0d0d0a
+#define QP_PCAPNG_IDB 1
+#define QP_PCAPNG_EPB 6
+#define QP_PCAPNG_OPT_COMMENT 1
+#define QP_PCAPNG_OPT_TSRESOL 9
+
+#define QP__PCAPNG_ALIGN(len) (((len) + 3) & ~(size_t)3)
+
+struct qp_pcapng_shb {
+    uint32_t type;
+    uint32_t len;
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;
+    uint32_t len_again;
+} __attribute__((packed));
+
+/* Interface description with the if_tsresol option */
+struct qp_pcapng_idb {
+    uint32_t type;
+    uint32_t len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint16_t tsresol_code;
+    uint16_t tsresol_len;
+    uint8_t tsresol;
+    uint8_t tsresol_pad[3];
+    uint32_t end_of_opt;
+    uint32_t len_again;
+};
+
+#define QP__PCAPNG_HEADER_LEN (sizeof(struct qp_pcapng_shb) + 2 * sizeof(struct qp_pcapng_idb))
+
+struct qp_capture_file {
+    char *base;
+    unsigned long size;
+    /* Reservation offset, keeps growing past size when the file is full */
+    unsigned long used;
+    /* Offset of the one reservation which crossed size */
+    unsigned long end;
+    /* Writers between loading the current file and finishing their copy */
+    unsigned long writers;
+    int fd;
+};
+
+struct qp_capture_state {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    struct qp_capture_file *current;
+    unsigned long long dropped;
+    char path[PATH_MAX];
+    /* Alternate between two files so that a stale pointer is never freed */
+    struct qp_capture_file files[2];
+};
+
+QP_GLOBAL struct qp_capture_state qp_capture_state = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Write the section header and one interface description block for each
+ *  QP_CAPTURE_IF_* (ethernet and raw IP linktypes) with nanosecond timestamps.
+ */
+static inline size_t qp_capture_write_header(char *buf)
+{
+    struct qp_pcapng_shb shb = {
+        .type = QP_PCAPNG_SHB,
+        .len = sizeof(shb),
+        .magic = 0x1a2b3c4d,
+        .major = 1,
+        .section_len = -1,
+        .len_again = sizeof(shb),
+    };
+    struct qp_pcapng_idb idb = {
+        .type = QP_PCAPNG_IDB,
+        .len = sizeof(idb),
+        .linktype = 1,
+        .snaplen = QP_CAPTURE_SNAPLEN,
+        .tsresol_code = QP_PCAPNG_OPT_TSRESOL,
+        .tsresol_len = 1,
+        .tsresol = 9,
+        .len_again = sizeof(idb),
+    };
+
+    memcpy(buf, &shb, sizeof(shb));
+    memcpy(buf + sizeof(shb), &idb, sizeof(idb));
+    idb.linktype = 101;
+    memcpy(buf + sizeof(shb) + sizeof(idb), &idb, sizeof(idb));
+
+    return QP__PCAPNG_HEADER_LEN;
+}
+
+/** Shift older files to make room for a new one */
+static inline void qp_capture_rotate_names(const char *path)
+{
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+    int i;
+
+    for (i = QP_CAPTURE_FILE_COUNT - 1; i > 0; --i) {
+        if (i > 1)
+            snprintf(from, sizeof(from), "%s.%d", path, i - 1);
+        else
+            snprintf(from, sizeof(from), "%s", path);
+        snprintf(to, sizeof(to), "%s.%d", path, i);
+        rename(from, to);
+    }
+}
+
+/** Create and map a new file, called with the lock held */
+static inline int qp_capture_file_open(struct qp_capture_file *file, const char *path)
+{
+    char *base;
+    int fd;
+
+    /* Never truncate an inode which may still be mapped by the previous file */
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -errno;
+    if (ftruncate(fd, QP_CAPTURE_FILE_SIZE)) {
+        close(fd);
+        return -errno;
+    }
+    base = mmap(NULL, QP_CAPTURE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -errno;
+    }
+    file->base = base;
+    file->size = QP_CAPTURE_FILE_SIZE;
+    file->used = qp_capture_write_header(base);
+    file->end = file->size;
+    file->fd = fd;
+
+    return 0;
+}
+
+/** Wait for writers of a file which is no longer current, then truncate it
+ *  to the blocks it contains.
+ */
+static inline void qp_capture_file_close(struct qp_capture_file *file)
+{
+    unsigned long len;
+
+    while (__atomic_load_n(&file->writers, __ATOMIC_ACQUIRE))
+        sched_yield();
+    len = file->used < file->end ? file->used : file->end;
+    munmap(file->base, file->size);
+    while (ftruncate(file->fd, len) && errno == EINTR)
+        ;
+    close(file->fd);
+}
+
+/** Replace the current file, called with the lock held */
+static inline int qp_capture_switch(const char *path, int rotate)
+{
+    struct qp_capture_file *old = qp_capture_state.current;
+    struct qp_capture_file *file = old == &qp_capture_state.files[0] ?
+            &qp_capture_state.files[1] : &qp_capture_state.files[0];
+    int ret = 0;
+
+    if (rotate)
+        qp_capture_rotate_names(path);
+    if (path)
+        ret = qp_capture_file_open(file, path);
+    __atomic_store_n(&qp_capture_state.current, path && !ret ? file : NULL,
+            __ATOMIC_SEQ_CST);
+    if (old)
+        qp_capture_file_close(old);
+
+    return ret;
+}
+
+static inline void qp_capture_exit(void)
+{
+    pthread_mutex_lock(&qp_capture_state.lock);
+    qp_capture_switch(NULL, 0);
+    pthread_mutex_unlock(&qp_capture_state.lock);
+}
+
+static inline void qp_capture_init_once(void)
+{
+    const char *path = getenv("QP_CAPTURE_FILE");
+
+    atexit(qp_capture_exit);
+    pthread_mutex_lock(&qp_capture_state.lock);
+    if (!qp_capture_state.current && !qp_capture_state.path[0]) {
+        snprintf(qp_capture_state.path, sizeof(qp_capture_state.path), "%s",
+                path ? path : QP_CAPTURE_FILE);
+        qp_capture_switch(qp_capture_state.path, 0);
+    }
+    pthread_mutex_unlock(&qp_capture_state.lock);
+}
+
+/** Start capturing into path, closing the current file. Returns 0 or -errno */
+static inline int qp_capture_open(const char *path)
+{
+    int ret;
+
+    pthread_mutex_lock(&qp_capture_state.lock);
+    snprintf(qp_capture_state.path, sizeof(qp_capture_state.path), "%s", path);
+    ret = qp_capture_switch(qp_capture_state.path, 0);
+    pthread_mutex_unlock(&qp_capture_state.lock);
+    pthread_once(&qp_capture_state.once, qp_capture_init_once);
+
+    return ret;
+}
+
+/** Finish the current file, later captures are dropped until qp_capture_open */
+static inline void qp_capture_close(void)
+{
+    pthread_once(&qp_capture_state.once, qp_capture_init_once);
+    qp_capture_exit();
+}
+
+/** Roll over after a reservation in file did not fit */
+static inline void qp_capture_roll(struct qp_capture_file *file)
+{
+    pthread_mutex_lock(&qp_capture_state.lock);
+    if (qp_capture_state.current == file)
+        qp_capture_switch(qp_capture_state.path, 1);
+    pthread_mutex_unlock(&qp_capture_state.lock);
+}
+
+/** Get the current file and count the caller as a writer, or NULL */
+static inline struct qp_capture_file *qp_capture_get(void)
+{
+    struct qp_capture_file *file;
+
+    while ((file = __atomic_load_n(&qp_capture_state.current, __ATOMIC_SEQ_CST))) {
+        __atomic_add_fetch(&file->writers, 1, __ATOMIC_SEQ_CST);
+        /* A file switch waits for writers only after unpublishing the file */
+        if (__atomic_load_n(&qp_capture_state.current, __ATOMIC_SEQ_CST) == file)
+            return file;
+        __atomic_sub_fetch(&file->writers, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/** Append one frame as an Enhanced Packet Block, returns 0 or -1 if dropped
+ *
+ * The comment is loc (usually "file:line ") followed by func.
+ */
+static inline int qp_capture_write(unsigned int ifid, const void *buf, size_t len,
+        const char *loc, size_t loc_len, const char *func)
+{
+    struct qp_capture_file *file;
+    struct timespec ts;
+    unsigned long long ns;
+    size_t caplen = len < QP_CAPTURE_SNAPLEN ? len : QP_CAPTURE_SNAPLEN;
+    size_t func_len = strnlen(func, 128);
+    size_t comment_len = loc_len + func_len;
+    uint32_t block_len = 28 + QP__PCAPNG_ALIGN(caplen) +
+            4 + QP__PCAPNG_ALIGN(comment_len) + 4 + 4;
+    unsigned long off;
+    uint32_t hdr[7];
+    uint16_t opt[2] = { QP_PCAPNG_OPT_COMMENT, comment_len };
+    char *pos;
+
+    if (unlikely(block_len > QP_CAPTURE_FILE_SIZE - QP__PCAPNG_HEADER_LEN)) {
+        QP_ATOMIC_ADD(&qp_capture_state.dropped, 1);
+        return -1;
+    }
+    if (unlikely(!qp_capture_state.current))
+        pthread_once(&qp_capture_state.once, qp_capture_init_once);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    while (1) {
+        file = qp_capture_get();
+        if (!file) {
+            QP_ATOMIC_ADD(&qp_capture_state.dropped, 1);
+            return -1;
+        }
+        off = __atomic_fetch_add(&file->used, block_len, __ATOMIC_RELAXED);
+        if (off + block_len <= file->size)
+            break;
+        if (off <= file->size)
+            QP_ATOMIC_STORE(&file->end, off);
+        __atomic_sub_fetch(&file->writers, 1, __ATOMIC_RELEASE);
+        qp_capture_roll(file);
+    }
+
+    /* The file is zero-filled so padding does not need to be written */
+    hdr[0] = QP_PCAPNG_EPB;
+    hdr[1] = block_len;
+    hdr[2] = ifid;
+    hdr[3] = ns >> 32;
+    hdr[4] = ns;
+    hdr[5] = caplen;
+    hdr[6] = len;
+    pos = file->base + off;
+    memcpy(pos, hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+    memcpy(pos, buf, caplen);
+    pos += QP__PCAPNG_ALIGN(caplen);
+    memcpy(pos, opt, sizeof(opt));
+    pos += sizeof(opt);
+    memcpy(pos, loc, loc_len);
+    memcpy(pos + loc_len, func, func_len);
+    pos += QP__PCAPNG_ALIGN(comment_len) + 4;
+    memcpy(pos, &block_len, sizeof(block_len));
+    __atomic_sub_fetch(&file->writers, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+#define QP__CAPTURE_LOC __FILE__ ":" QP__STRINGIFY(__LINE__) " "
+
+/** Capture a frame on one of the QP_CAPTURE_IF_* interfaces */
+#define QP_CAPTURE_PACKET_IF(ifid, buf, len) \
+        qp_capture_write((ifid), (buf), (len), \
+                QP__CAPTURE_LOC, sizeof(QP__CAPTURE_LOC) - 1, __func__)
+#else
+/* Without a filesystem frames are printed as an offset hexdump, which
+ * "text2pcap -n" converts to pcapng. The linktype is printed in the header
+ * line and must be passed with "-l".
+ */
+
+#define QP_CAPTURE_IF_ETHERNET 0
+#define QP_CAPTURE_IF_RAW 1
+
+#define QP__CAPTURE_LINKTYPE(ifid) ((ifid) == QP_CAPTURE_IF_RAW ? 101 : 1)
+
+#define QP__CAPTURE_HEX_LINE(ptr, off, len) do { \
+        char qp_cap_line[QP_HEX_LINE_SIZE]; \
+        qp_hex_format(qp_cap_line, (ptr), 0, (len), 16, 1, QP_HEX_SPACE_AT_ZERO); \
+        QP_PRINT("%06x%s\n", (off), qp_cap_line); \
+    } while (0)
+
+#define QP_CAPTURE_PACKET_IF(ifid, buf, len) do { \
+        QP__DUMP_SITE_DECLARE("capture %u bytes linktype=%d" QP_NL); \
+        const unsigned char *qp_cap_buf = (const unsigned char *)(buf); \
+        unsigned int qp_cap_off, qp_cap_len = (len); \
+        QP__DUMP_SITE_CHECK(); \
+        QP__DUMP_PRINT_LOC("capture %u bytes linktype=%d" QP_NL, qp_cap_len, \
+                QP__CAPTURE_LINKTYPE(ifid)); \
+        for (qp_cap_off = 0; qp_cap_off < qp_cap_len; qp_cap_off += 16) \
+            QP__CAPTURE_HEX_LINE(qp_cap_buf + qp_cap_off, qp_cap_off, \
+                    qp_cap_len - qp_cap_off < 16 ? qp_cap_len - qp_cap_off : 16); \
+    } while (0)
+#endif /* QP_PROJECT_GLIBC */
+
+/** Capture a frame which starts with an ethernet header */
+#define QP_CAPTURE_PACKET(buf, len) QP_CAPTURE_PACKET_IF(QP_CAPTURE_IF_ETHERNET, buf, len)
+/** Capture a frame which starts with an IPv4 or IPv6 header */
+#define QP_CAPTURE_IP_PACKET(buf, len) QP_CAPTURE_PACKET_IF(QP_CAPTURE_IF_RAW, buf, len)
+
+#ifdef QP_PROJECT_LINUX_KERNEL
+/** Capture an skb from its mac header (or network header if there is none),
+ *  including paged data.
+ */
+#define QP_CAPTURE_SKB(skb) do { \
+        struct sk_buff *qp_cap_skb = (skb); \
+        unsigned char qp_cap_tmp[16]; \
+        const unsigned char *qp_cap_ptr; \
+        int qp_cap_eth = skb_mac_header_was_set(qp_cap_skb) && \
+                skb_mac_header_len(qp_cap_skb) >= ETH_HLEN; \
+        int qp_cap_start = qp_cap_eth ? skb_mac_offset(qp_cap_skb) : \
+                skb_network_offset(qp_cap_skb); \
+        unsigned int qp_cap_off, qp_cap_n, qp_cap_len = qp_cap_skb->len - qp_cap_start; \
+        QP_PRINT_LOC("capture skb=%px %u bytes linktype=%d" QP_NL, qp_cap_skb, qp_cap_len, \
+                QP__CAPTURE_LINKTYPE(qp_cap_eth ? QP_CAPTURE_IF_ETHERNET : QP_CAPTURE_IF_RAW)); \
+        for (qp_cap_off = 0; qp_cap_off < qp_cap_len; qp_cap_off += 16) { \
+            qp_cap_n = qp_cap_len - qp_cap_off < 16 ? qp_cap_len - qp_cap_off : 16; \
+            qp_cap_ptr = skb_header_pointer(qp_cap_skb, qp_cap_start + qp_cap_off, \
+                    qp_cap_n, qp_cap_tmp); \
+            if (!qp_cap_ptr) \
+                break; \
+            QP__CAPTURE_HEX_LINE(qp_cap_ptr, qp_cap_off, qp_cap_n); \
+        } \
+    } while (0)
+#endif
+
 #endif // QP_HEADER_INCLUDED
@@ -10,14 +10,27 @@ __maybe_unused static void qp_dump_skb_compile_test(void)
     QP_DUMP_SKB(skb, true);
 }
 
+__maybe_unused static void qp_percpu_compile_test(void)
+{
+    QP_PRINT_RATELIMIT_PERCPU("hello\n");
+}
+
+__maybe_unused static void qp_debugfs_compile_test(void)
+{
+    QP_PROFILE_REGION_BEGIN();
+    QP_PRINT_RATELIMIT("hello\n");
+    QP_PROFILE_REGION_END("debugfs");
+}
+
 static int qp_kmod_test_init(void)
 {
     QP_PRINT_LOC("hello\n");
-    return 0;
+    return QP_DEBUGFS_INIT();
 }
 
 static void qp_kmod_test_exit(void)
 {
+    QP_DEBUGFS_EXIT();
 }
 
 module_init(qp_kmod_test_init)
@@ -0,0 +1,378 @@
+/*
+ * qpdecode: Format binary logs written with QP_BINLOG
+ *
+ * Usage: qpdecode [qp.binlog]
+ *
+ * The site table at the start of the file provides the format strings, the
+ * records only contain site indexes, timestamps and raw argument bytes.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include "qp.h"
+
+#define MAX_ARGS 80
+
+struct decoded_site {
+    char *fmt;
+    char *file;
+    char *func;
+    unsigned int line;
+    unsigned int flags;
+};
+
+struct decoded_arg {
+    int kind;
+    unsigned int size;
+    const char *str;
+    unsigned int str_len;
+    long double real;
+    uint64_t raw;
+};
+
+static int read_file(FILE *fp, char **data, size_t *size)
+{
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap);
+
+    while (buf) {
+        size_t ret = fread(buf + len, 1, cap - len, fp);
+        len += ret;
+        if (len < cap)
+            break;
+        cap *= 2;
+        buf = realloc(buf, cap);
+    }
+    if (!buf || ferror(fp)) {
+        free(buf);
+        return -1;
+    }
+    *data = buf;
+    *size = len;
+
+    return 0;
+}
+
+static char *dup_len(const char *str, size_t len)
+{
+    char *ret = malloc(len + 1);
+
+    memcpy(ret, str, len);
+    ret[len] = 0;
+    return ret;
+}
+
+static int64_t arg_signed(const struct decoded_arg *arg)
+{
+    switch (arg->size) {
+    case 1: return (int8_t)arg->raw;
+    case 2: return (int16_t)arg->raw;
+    case 4: return (int32_t)arg->raw;
+    default: return (int64_t)arg->raw;
+    }
+}
+
+/* Parse one record's arguments, returns number of arguments or -1 */
+static int parse_args(const char *pos, const char *end, struct decoded_arg *args, int max)
+{
+    int nargs = 0;
+
+    while (pos < end && nargs < max) {
+        struct decoded_arg *arg = &args[nargs];
+        unsigned char tag = *pos++;
+
+        memset(arg, 0, sizeof(*arg));
+        arg->kind = tag >> 4;
+        if (arg->kind == QP_BINLOG_ARG_STR) {
+            uint16_t len;
+
+            if (pos + sizeof(len) > end)
+                return -1;
+            memcpy(&len, pos, sizeof(len));
+            pos += sizeof(len);
+            if (pos + len > end)
+                return -1;
+            arg->str = pos;
+            arg->str_len = len;
+            pos += len;
+        } else {
+            arg->size = 1u << (tag & 0xf);
+            if (pos + arg->size > end)
+                return -1;
+            if (arg->kind == QP_BINLOG_ARG_REAL) {
+                if (arg->size == sizeof(float)) {
+                    float val;
+                    memcpy(&val, pos, sizeof(val));
+                    arg->real = val;
+                } else if (arg->size == sizeof(double)) {
+                    double val;
+                    memcpy(&val, pos, sizeof(val));
+                    arg->real = val;
+                } else if (arg->size == sizeof(long double)) {
+                    memcpy(&arg->real, pos, sizeof(arg->real));
+                }
+            } else if (arg->size <= sizeof(arg->raw)) {
+                memcpy(&arg->raw, pos, arg->size);
+            }
+            pos += arg->size;
+        }
+        ++nargs;
+    }
+
+    return nargs;
+}
+
+/* Format using printf-like fmt and decoded arguments */
+static void format_record(FILE *out, const char *fmt,
+        const struct decoded_arg *args, int nargs)
+{
+    int argi = 0;
+
+    while (*fmt) {
+        char spec[64];
+        size_t speclen;
+        const char *start;
+        const struct decoded_arg *arg;
+        int star[2], nstar = 0;
+        char length[3] = "";
+        char conv;
+
+        if (*fmt != '%') {
+            fputc(*fmt++, out);
+            continue;
+        }
+        if (fmt[1] == '%') {
+            fputc('%', out);
+            fmt += 2;
+            continue;
+        }
+
+        /* Flags, width, precision */
+        start = fmt++;
+        while (*fmt && strchr("-+ #0'", *fmt))
+            ++fmt;
+        while (*fmt == '*' || (*fmt >= '0' && *fmt <= '9') || *fmt == '.') {
+            if (*fmt == '*' && nstar < 2)
+                star[nstar++] = argi < nargs ? (int)arg_signed(&args[argi++]) : 0;
+            ++fmt;
+        }
+        /* Length modifiers are rebuilt below */
+        speclen = fmt - start;
+        while (*fmt && strchr("hlLqjzt", *fmt)) {
+            if (strlen(length) < 2)
+                length[strlen(length)] = *fmt;
+            ++fmt;
+        }
+        conv = *fmt;
+        if (!conv || speclen + 4 > sizeof(spec))
+            break;
+        ++fmt;
+        memcpy(spec, start, speclen);
+        spec[speclen] = 0;
+
+        if (conv == 'n' || conv == 'm')
+            continue;
+        if (argi >= nargs) {
+            fputs("<missing>", out);
+            continue;
+        }
+        arg = &args[argi++];
+
+        if (conv == 'c') {
+            /* %lc takes a wint_t, everything else promotes to int */
+            if (!strcmp(length, "l")) {
+                wint_t val = (wint_t)arg->raw;
+                strcat(spec, "lc");
+                if (nstar == 1)
+                    fprintf(out, spec, star[0], val);
+                else
+                    fprintf(out, spec, val);
+            } else {
+                int val = (int)arg->raw;
+                strcat(spec, "c");
+                if (nstar == 1)
+                    fprintf(out, spec, star[0], val);
+                else
+                    fprintf(out, spec, val);
+            }
+        } else if (strchr("diouxX", conv)) {
+            if (!strcmp(length, "hh") || !strcmp(length, "h") || !length[0]) {
+                int val = strchr("di", conv) ? (int)arg_signed(arg) : (int)arg->raw;
+                strncat(spec, length, 2);
+                strncat(spec, &conv, 1);
+                if (nstar == 2)
+                    fprintf(out, spec, star[0], star[1], val);
+                else if (nstar == 1)
+                    fprintf(out, spec, star[0], val);
+                else
+                    fprintf(out, spec, val);
+            } else {
+                long long val = strchr("di", conv) ? (long long)arg_signed(arg) : (long long)arg->raw;
+                strcat(spec, "ll");
+                strncat(spec, &conv, 1);
+                if (nstar == 2)
+                    fprintf(out, spec, star[0], star[1], val);
+                else if (nstar == 1)
+                    fprintf(out, spec, star[0], val);
+                else
+                    fprintf(out, spec, val);
+            }
+        } else if (strchr("eEfFgGaA", conv)) {
+            strcat(spec, "L");
+            strncat(spec, &conv, 1);
+            if (nstar == 2)
+                fprintf(out, spec, star[0], star[1], arg->real);
+            else if (nstar == 1)
+                fprintf(out, spec, star[0], arg->real);
+            else
+                fprintf(out, spec, arg->real);
+        } else if (conv == 's') {
+            char *str = arg->kind == QP_BINLOG_ARG_STR ?
+                    dup_len(arg->str, arg->str_len) : dup_len("<not a string>", 14);
+            strcat(spec, "s");
+            if (nstar == 2)
+                fprintf(out, spec, star[0], star[1], str);
+            else if (nstar == 1)
+                fprintf(out, spec, star[0], str);
+            else
+                fprintf(out, spec, str);
+            free(str);
+        } else if (conv == 'p') {
+            strcat(spec, "p");
+            if (nstar == 1)
+                fprintf(out, spec, star[0], (void *)(uintptr_t)arg->raw);
+            else
+                fprintf(out, spec, (void *)(uintptr_t)arg->raw);
+        } else {
+            fprintf(out, "<bad conversion %c>", conv);
+        }
+    }
+}
+
+static void print_time_header(FILE *out, uint32_t time_header, uint64_t ts)
+{
+    if (time_header == QP_TIME_HEADER_5_6) {
+        fprintf(out, "[%05lu.%06lu] ",
+                (unsigned long)(ts / 1000000000 % 100000),
+                (unsigned long)(ts / 1000 % 1000000));
+    } else if (time_header == QP_TIME_HEADER_4_3) {
+        uint64_t ms = ts / 1000000;
+        fprintf(out, "[%04lu.%03lu] ",
+                (unsigned long)(ms / 1000 % 10000),
+                (unsigned long)(ms % 1000));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct qp_binlog_file_hdr hdr;
+    struct decoded_site *sites;
+    struct decoded_arg args[MAX_ARGS];
+    const char *pos, *end;
+    char *data;
+    size_t size;
+    unsigned int i;
+    FILE *fp = stdin;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [qp.binlog]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2 && !(fp = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (read_file(fp, &data, &size)) {
+        fprintf(stderr, "failed to read input\n");
+        return 1;
+    }
+    if (size < sizeof(hdr)) {
+        fprintf(stderr, "truncated file header\n");
+        return 1;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, QP_BINLOG_MAGIC, sizeof(hdr.magic)) || hdr.version != QP_BINLOG_VERSION) {
+        fprintf(stderr, "not a qp binlog (version %d)\n", QP_BINLOG_VERSION);
+        return 1;
+    }
+    pos = data + sizeof(hdr);
+    end = data + size;
+
+    sites = calloc(hdr.nsites + 1, sizeof(*sites));
+    for (i = 0; i < hdr.nsites; ++i) {
+        struct qp_binlog_site_hdr shdr;
+
+        if (pos + sizeof(shdr) > end)
+            goto truncated;
+        memcpy(&shdr, pos, sizeof(shdr));
+        pos += sizeof(shdr);
+        if (pos + shdr.fmt_len + shdr.file_len + shdr.func_len > end)
+            goto truncated;
+        sites[i].line = shdr.line;
+        sites[i].flags = shdr.flags;
+        sites[i].fmt = dup_len(pos, shdr.fmt_len);
+        pos += shdr.fmt_len;
+        sites[i].file = dup_len(pos, shdr.file_len);
+        pos += shdr.file_len;
+        sites[i].func = dup_len(pos, shdr.func_len);
+        pos += shdr.func_len;
+    }
+
+    while (pos < end) {
+        struct qp_binlog_rec_hdr rec;
+        struct decoded_site *site;
+        int nargs;
+
+        if (pos + sizeof(rec) > end)
+            goto truncated;
+        memcpy(&rec, pos, sizeof(rec));
+        if (rec.len < sizeof(rec) || pos + rec.len > end)
+            goto truncated;
+
+        if (rec.site == QP_BINLOG_SITE_DROPS) {
+            nargs = parse_args(pos + sizeof(rec), pos + rec.len, args, MAX_ARGS);
+            if (nargs == 2)
+                printf("qp_ring: dropped=%llu total_dropped=%llu\n",
+                        (unsigned long long)args[0].raw,
+                        (unsigned long long)args[1].raw);
+            pos += rec.len;
+            continue;
+        }
+        if (rec.site >= hdr.nsites) {
+            fprintf(stderr, "bad site index %u\n", rec.site);
+            return 1;
+        }
+        site = &sites[rec.site];
+
+        nargs = 0;
+        if (site->flags & QP_SITE_LOC) {
+            print_time_header(stdout, hdr.time_header, rec.ts);
+            args[0].kind = QP_BINLOG_ARG_STR;
+            args[0].str = site->func;
+            args[0].str_len = strlen(site->func);
+            args[1].kind = QP_BINLOG_ARG_INT;
+            args[1].size = sizeof(int);
+            args[1].raw = site->line;
+            nargs = 2;
+        }
+        i = parse_args(pos + sizeof(rec), pos + rec.len, args + nargs, MAX_ARGS - nargs);
+        if ((int)i < 0) {
+            fprintf(stderr, "bad record arguments at offset %zu\n", (size_t)(pos - data));
+            return 1;
+        }
+        format_record(stdout, site->fmt, args, nargs + i);
+        if (rec.flags & QP_BINLOG_REC_TRUNCATED)
+            printf("<truncated>\n");
+        pos += rec.len;
+    }
+
+    return 0;
+
+truncated:
+    fprintf(stderr, "truncated input at offset %zu\n", (size_t)(pos - data));
+    return 1;
+}
@@ -0,0 +1,249 @@
+/*
+ * qpstat: Live view of QP counters published with QP_STAT_SHM
+ *
+ * Usage: qpstat [-i interval_ms] [-n count] pid|file
+ *
+ * Maps the statistics segment of a process read-only and prints, every
+ * interval, one line per site sorted by call rate: calls, calls per second,
+ * average duration and duration percentiles over the last interval. The
+ * instrumented process does not take part in any of this.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#define QP_STAT_SHM
+#include "qp.h"
+
+struct site_view {
+    unsigned int idx;
+    unsigned int type;
+    QP_LONG_COUNTER_T count;
+    QP_LONG_COUNTER_T usage;
+    QP_LONG_COUNTER_T last_count;
+    QP_LONG_COUNTER_T last_usage;
+    QP_LONG_COUNTER_T rate;
+    QP_LONG_COUNTER_T hist[QP_HIST_BUCKETS];
+    QP_LONG_COUNTER_T last_hist[QP_HIST_BUCKETS];
+};
+
+static const struct qp_stat_shm_hdr *map_segment(const char *path, size_t *size)
+{
+    const struct qp_stat_shm_hdr *hdr;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s: truncated header\n", path);
+        close(fd);
+        return NULL;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    *size = st.st_size;
+
+    return hdr;
+}
+
+/* The layout must match exactly to read shards and histograms */
+static int check_segment(const struct qp_stat_shm_hdr *hdr, size_t size)
+{
+    if (memcmp(hdr->magic, QP_STAT_SHM_MAGIC, sizeof(hdr->magic))) {
+        fprintf(stderr, "not a qp statistics segment\n");
+        return -1;
+    }
+    /* Pairs with the fence before the magic is written */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (hdr->version != QP_STAT_SHM_VERSION ||
+            hdr->site_size != sizeof(struct qp_stat_shm_site) ||
+            hdr->counter_size != sizeof(QP_LONG_COUNTER_T) ||
+            hdr->thread_slots != QP_THREAD_SLOTS ||
+            hdr->shard_size != sizeof(struct qp_profile_shard) ||
+            hdr->hist_buckets != QP_HIST_BUCKETS ||
+            hdr->hist_sub_bits != QP_HIST_SUB_BITS) {
+        fprintf(stderr, "segment layout version %u does not match qpstat version %u"
+                " (rebuild qpstat with the same qp.h settings)\n",
+                hdr->version, QP_STAT_SHM_VERSION);
+        return -1;
+    }
+    if (hdr->hdr_size + (size_t)hdr->max_sites * hdr->site_size > size) {
+        fprintf(stderr, "truncated segment\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void read_site(const struct qp_stat_shm_site *slot, struct site_view *view)
+{
+    const struct qp_profile_shard *shard;
+    unsigned int i, j;
+
+    view->last_count = view->count;
+    view->last_usage = view->usage;
+    memcpy(view->last_hist, view->hist, sizeof(view->hist));
+    if (view->type == QP_STAT_SITE_RATELIMIT) {
+        view->count = QP_ATOMIC_LOAD(&slot->count);
+        return;
+    }
+    view->count = view->usage = 0;
+    for (i = 0; i < QP_THREAD_SLOTS; ++i) {
+        shard = &slot->shards[i];
+        view->count += QP_ATOMIC_LOAD(&shard->count);
+        view->usage += QP_ATOMIC_LOAD(&shard->usage);
+    }
+    memset(view->hist, 0, sizeof(view->hist));
+    for (i = 0; i < QP_THREAD_SLOTS; ++i) {
+        for (j = 0; j < QP_HIST_BUCKETS; ++j)
+            view->hist[j] += QP_ATOMIC_LOAD(&slot->hist[i][j]);
+    }
+}
+
+/* Read all published sites, new sites start from their current counts */
+static void read_sites(const struct qp_stat_shm_hdr *hdr, struct site_view *views)
+{
+    const struct qp_stat_shm_site *slot;
+    unsigned int i;
+
+    for (i = 0; i < hdr->max_sites && i < QP_ATOMIC_LOAD(&hdr->nsites); ++i) {
+        slot = qp_stat_shm_site((struct qp_stat_shm_hdr *)hdr, i);
+        if (!views[i].type) {
+            views[i].type = QP_ATOMIC_LOAD_ACQUIRE(&slot->type);
+            if (!views[i].type)
+                continue;
+            views[i].idx = i;
+            read_site(slot, &views[i]);
+        }
+        read_site(slot, &views[i]);
+    }
+}
+
+static int cmp_rate(const void *a, const void *b)
+{
+    const struct site_view *va = *(const struct site_view * const *)a;
+    const struct site_view *vb = *(const struct site_view * const *)b;
+
+    if (va->rate != vb->rate)
+        return va->rate < vb->rate ? 1 : -1;
+    return va->idx < vb->idx ? -1 : va->idx > vb->idx;
+}
+
+static void print_sites(const struct qp_stat_shm_hdr *hdr, struct site_view **sorted,
+        unsigned int nviews, unsigned int interval_ms)
+{
+    static const unsigned int pcm[QP_PROFILE_PERCENTILES] = {
+        50000, 90000, 99000, 99900,
+    };
+    const struct qp_stat_shm_site *slot;
+    struct site_view *view;
+    char name[128];
+    QP_LONG_COUNTER_T delta, avg;
+    unsigned int i, j;
+    unsigned int nsites = QP_ATOMIC_LOAD(&hdr->nsites);
+
+    printf("pid %u: %u sites, interval %ums\n", hdr->pid, nviews, interval_ms);
+    /* Sites without a slot are not in the segment, profile ones may not be counted */
+    if (nsites > hdr->max_sites)
+        printf("%u sites not shown, %u of them not counted\n",
+                nsites - hdr->max_sites, QP_ATOMIC_LOAD(&hdr->dropped_sites));
+    printf("%-40s %12s %10s %10s %10s %10s %10s %10s\n", "SITE", "CALLS", "RATE/s",
+            "AVG(ns)", "P50(ns)", "P90(ns)", "P99(ns)", "P99.9(ns)");
+    for (i = 0; i < nviews; ++i) {
+        view = sorted[i];
+        slot = qp_stat_shm_site((struct qp_stat_shm_hdr *)hdr, view->idx);
+        snprintf(name, sizeof(name), "%.*s(%u)", (int)sizeof(slot->func),
+                slot->func, slot->line);
+        printf("%-40s %12llu %10llu", name, view->count, view->rate);
+        if (view->type != QP_STAT_SITE_PROFILE) {
+            printf("\n");
+            continue;
+        }
+        delta = view->count - view->last_count;
+        avg = view->usage - view->last_usage;
+        if (delta)
+            avg /= delta;
+        printf(" %10llu", avg);
+        for (j = 0; j < QP_PROFILE_PERCENTILES; ++j)
+            printf(" %10llu", qp_hist_percentile(view->hist, view->last_hist, pcm[j], ~0ULL));
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int interval_ms = 1000, count = 0, nviews, i, n;
+    const struct qp_stat_shm_hdr *hdr;
+    struct site_view *views, **sorted;
+    char path[PATH_MAX];
+    bool tty = isatty(STDOUT_FILENO);
+    size_t size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 1 != argc)
+        goto usage;
+    if (strspn(argv[optind], "0123456789") == strlen(argv[optind]))
+        snprintf(path, sizeof(path), QP_STAT_SHM_FILE, atoi(argv[optind]));
+    else
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+
+    hdr = map_segment(path, &size);
+    if (!hdr || check_segment(hdr, size))
+        return 1;
+    views = calloc(hdr->max_sites, sizeof(*views));
+    sorted = calloc(hdr->max_sites, sizeof(*sorted));
+    if (!views || !sorted) {
+        perror("calloc");
+        return 1;
+    }
+
+    read_sites(hdr, views);
+    for (n = 0; !count || n < count; ++n) {
+        usleep(interval_ms * 1000);
+        read_sites(hdr, views);
+        nviews = 0;
+        for (i = 0; i < hdr->max_sites; ++i) {
+            if (!views[i].type)
+                continue;
+            views[i].rate = (views[i].count - views[i].last_count) * 1000 / (interval_ms ?: 1);
+            sorted[nviews++] = &views[i];
+        }
+        qsort(sorted, nviews, sizeof(*sorted), cmp_rate);
+        if (tty)
+            printf("\033[H\033[J");
+        print_sites(hdr, sorted, nviews, interval_ms);
+        fflush(stdout);
+        if (kill(hdr->pid, 0) && errno == ESRCH) {
+            fprintf(stderr, "process %u exited\n", hdr->pid);
+            break;
+        }
+    }
+
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-i interval_ms] [-n count] pid|file\n", argv[0]);
+    return 2;
+}
@@ -7,10 +7,15 @@
 #include <linux/udp.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/if_ether.h>
 #endif
 #include "test.h"
 
+static struct print_buffer line_exit_pb;
+
 #define QP_PRINT(str, ...) buffer_print(&pb, str, ##__VA_ARGS__)
+#define QP_LINE_EXIT_PRINT(str, ...) buffer_print(&line_exit_pb, str, ##__VA_ARGS__)
 #include <qp.h>
 
 void print_buffer_init(struct print_buffer *pb)
@@ -70,6 +75,159 @@ START_TEST(test_dump_hex_buffer)
 }
 END_TEST
 
+START_TEST(test_dump_hex_buffer_ascii)
+{
+    const char *str = "Hello, hex world!\x7f";
+    struct print_buffer pb;
+
+    print_buffer_init(&pb);
+    QP_DUMP_HEX_BUFFER_ASCII(str, strlen(str));
+    ck_assert(strstr(pb.buf, ": 48656c6c 6f2c2068 65782077 6f726c64  |Hello, hex world|\n"));
+    ck_assert(strstr(pb.buf, ": 217f" "                                 |!.|\n"));
+}
+END_TEST
+
+START_TEST(test_line_assembly)
+{
+    struct print_buffer pb;
+
+    print_buffer_init(&pb);
+    QP_LINE_PRINT("a=%d", 1);
+    ck_assert_str_eq(pb.buf, "");
+    QP_LINE_PRINT(" b\nc");
+    ck_assert_str_eq(pb.buf, "a=1 b\n");
+    QP_LINE_FLUSH();
+    ck_assert_str_eq(pb.buf, "a=1 b\nc");
+
+    print_buffer_init(&pb);
+    QP_LINE_HOLD();
+    QP_LINE_PRINT("x\n");
+    QP_LINE_PRINT("y\n");
+    ck_assert_str_eq(pb.buf, "");
+    QP_LINE_FLUSH();
+    ck_assert_str_eq(pb.buf, "x\ny\n");
+}
+END_TEST
+
+static void *line_exit_thread(void *arg)
+{
+    struct print_buffer pb;
+
+    print_buffer_init(&pb);
+    QP_LINE_PRINT("partial %d", 1);
+    return arg;
+}
+
+START_TEST(test_line_assembly_thread_exit)
+{
+    pthread_t thread;
+
+    print_buffer_init(&line_exit_pb);
+    ck_assert_int_eq(pthread_create(&thread, NULL, line_exit_thread, NULL), 0);
+    pthread_join(thread, NULL);
+    ck_assert_str_eq(line_exit_pb.buf, "partial 1");
+}
+END_TEST
+
+START_TEST(test_line_assembly_long)
+{
+    struct print_buffer pb;
+    static char str[QP_LINE_SIZE + 100];
+
+    memset(str, 'x', sizeof(str) - 1);
+    print_buffer_init(&pb);
+    QP_LINE_PRINT("a\nb");
+    QP_LINE_PRINT("%s", str);
+    /* One record longer than the line buffer, truncated by buffer_print */
+    ck_assert_int_eq(pb.curptr - pb.buf, sizeof(str) + 2);
+    ck_assert(!strncmp(pb.buf, "a\nbxxx", 6));
+    ck_assert_int_eq(qp_line_self.len, 0);
+}
+END_TEST
+
+static void __attribute__((noinline)) test_sym_target(void)
+{
+    __asm__ __volatile__("");
+}
+
+START_TEST(test_dump_symbol)
+{
+    struct print_buffer pb;
+    char buf[QP_SYM_LINE_SIZE];
+    unsigned long long misses;
+
+    print_buffer_init(&pb);
+    QP_DUMP_SYMBOL(test_sym_target);
+    ck_assert(strstr(pb.buf, "test_sym_target=") != NULL);
+    ck_assert(strstr(pb.buf, "(test_sym_target+0) [0x") != NULL);
+
+    /* Second lookup is served from the cache */
+    misses = qp_sym_state.misses;
+    qp_sym_format((const void *)test_sym_target, buf, sizeof(buf));
+    ck_assert_int_eq(qp_sym_state.misses, misses);
+    ck_assert(strstr(buf, "(test_sym_target+0) [0x") != NULL);
+}
+END_TEST
+
+static void __attribute__((noinline)) test_stack_record_here(void)
+{
+    QP_STACK_RECORD();
+}
+
+START_TEST(test_stack_record)
+{
+    struct print_buffer pb;
+    struct qp_stack stack;
+    unsigned long seq, lost = 0;
+
+    while (qp_stack_log_next(&stack, &seq, &lost))
+        ;
+    test_stack_record_here();
+    print_buffer_init(&pb);
+    QP_STACK_REPORT();
+    ck_assert(strstr(pb.buf, "recorded at test_stack_record_here(") != NULL);
+    ck_assert(strstr(pb.buf, "[0]: ") != NULL);
+    ck_assert(strstr(pb.buf, "(test_stack_record_here+0x") != NULL);
+    ck_assert(!qp_stack_log_next(&stack, &seq, &lost));
+}
+END_TEST
+
+static volatile unsigned long test_sampler_sink;
+
+static void __attribute__((noinline)) test_sampler_busy(void)
+{
+    unsigned long i;
+
+    for (i = 0; i < 100000000; ++i)
+        test_sampler_sink += i;
+}
+
+/* Test bodies are named by libcheck, samples are matched on this frame */
+static void __attribute__((noinline)) test_sampler_run(void)
+{
+    test_sampler_busy();
+}
+
+START_TEST(test_sampler)
+{
+    struct print_buffer pb;
+
+    ck_assert_int_eq(QP_SAMPLER_START(1000), 0);
+    ck_assert_int_eq(QP_SAMPLER_START(1000), -EBUSY);
+    test_sampler_run();
+    QP_SAMPLER_STOP();
+
+    print_buffer_init(&pb);
+    QP_SAMPLER_REPORT();
+    ck_assert(strstr(pb.buf, "sampler hz=1000 samples=") != NULL);
+    ck_assert(strstr(pb.buf, ";test_sampler_run;test_sampler_busy ") != NULL);
+
+    /* Periods of a second or more */
+    ck_assert_int_eq(QP_SAMPLER_START(1), 0);
+    QP_SAMPLER_STOP();
+}
+END_TEST
+
 #ifdef __unix__
 START_TEST(test_run_system)
 {
@@ -192,6 +350,75 @@ START_TEST(test_dump_var_ptr)
 }
 END_TEST
 
+START_TEST(test_dump_var_types)
+{
+    struct print_buffer pb;
+    enum { RED, GREEN = 5 } color = GREEN;
+    struct { unsigned char a, b; } pair = { 1, 0xab };
+    long val_long = -1234567890123L;
+    unsigned short val_ushort = 65535;
+    uint64_t val_u64 = UINT64_MAX;
+    double val_double = 0.25;
+    void *val_null = NULL;
+    int arr[3] = { 1, -2, 3 };
+    char name[8] = "a\"b";
+    int big[100];
+    int i;
+
+    for (i = 0; i < 100; ++i)
+        big[i] = 100000 + i;
+    print_buffer_init(&pb);
+    QP_DUMP_VAR(val_long);
+    ck_assert(strstr(pb.buf, "val_long=-1234567890123\n"));
+    QP_DUMP_VAR(val_ushort);
+    ck_assert(strstr(pb.buf, "val_ushort=65535\n"));
+    QP_DUMP_VAR(val_u64);
+    ck_assert(strstr(pb.buf, "val_u64=18446744073709551615\n"));
+    QP_DUMP_VAR(val_double);
+    ck_assert(strstr(pb.buf, "val_double=0.25\n"));
+    QP_DUMP_VAR(val_null);
+    ck_assert(strstr(pb.buf, "val_null=(nil)\n"));
+    QP_DUMP_VAR(color);
+    ck_assert(strstr(pb.buf, "color=5\n"));
+    QP_DUMP_VAR(pair);
+    ck_assert(strstr(pb.buf, "pair=<01 ab>\n"));
+    QP_DUMP_VAR(arr);
+    ck_assert(strstr(pb.buf, "arr=[1, -2, 3]\n"));
+    QP_DUMP_VAR(name);
+    ck_assert(strstr(pb.buf, "name=\"a\\\"b\"\n"));
+    /* Evaluated once */
+    QP_DUMP_VAR(i++);
+    ck_assert_int_eq(i, 101);
+
+    print_buffer_init(&pb);
+    QP_DUMP_VAR(big);
+    ck_assert(strstr(pb.buf, "big=[100000, 100001, "));
+    ck_assert(strstr(pb.buf, ", ...]\n"));
+    ck_assert_int_lt(strlen(pb.buf), QP_DUMP_VAR_SIZE + 64);
+}
+END_TEST
+
+START_TEST(test_dump_vars)
+{
+    struct print_buffer pb;
+    int count = 3;
+    bool done = false;
+    short vals[2] = { -1, 1 };
+    int big[100];
+
+    memset(big, 0, sizeof(big));
+    print_buffer_init(&pb);
+    QP_DUMP_VARS(count, done, vals, count * 2);
+    ck_assert(strstr(pb.buf, "): count=3 done=false vals=[-1, 1] count * 2=6\n"));
+
+    /* Variables that do not fit are left out as a whole */
+    print_buffer_init(&pb);
+    QP_DUMP_VARS(count, big, count);
+    ck_assert(strstr(pb.buf, "): count=3 big=[0, 0, "));
+    ck_assert(strstr(pb.buf, ", ...] ...\n"));
+}
+END_TEST
+
 START_TEST(test_dump_udphdr)
 {
     struct print_buffer pb;
@@ -207,6 +434,236 @@ START_TEST(test_dump_udphdr)
     ck_assert(strstr(pb.buf, "sport=53 dport=4343 len=128 csum=0x5678"));
 }
 END_TEST
+
+START_TEST(test_dump_packet)
+{
+    struct print_buffer pb;
+    unsigned char frame[] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x81, 0x00, 0x20, 0x64, 0x08, 0x00,
+        0x45, 0x00, 0x00, 0x24, 0x12, 0x34, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,
+        10, 0, 0, 1, 10, 0, 0, 2,
+        0x00, 0x35, 0x10, 0xf7, 0x00, 0x0c, 0x00, 0x00,
+        'p', 'i', 'n', 'g',
+    };
+
+    print_buffer_init(&pb);
+    QP_DUMP_PACKET(frame, sizeof(frame));
+    ck_assert(strstr(pb.buf, "packet len=50 ethhdr="));
+    ck_assert(strstr(pb.buf, " src_mac=02:00:00:00:00:01 vlan=100 prio=1 iphdr="));
+    ck_assert(strstr(pb.buf, " saddr=10.0.0.1 daddr=10.0.0.2 udphdr="));
+    ck_assert(strstr(pb.buf, " sport=53 dport=4343 len=12 csum=0 payload=4\n"));
+    ck_assert(strchr(pb.buf, '\n') == pb.curptr - 1);
+
+    /* Never read past len */
+    print_buffer_init(&pb);
+    QP_DUMP_PACKET(frame, sizeof(frame) - 8);
+    ck_assert(strstr(pb.buf, " daddr=10.0.0.2 truncated=udp\n"));
+}
+END_TEST
+
+START_TEST(test_dump_packet_ipv6)
+{
+    struct print_buffer pb;
+    unsigned char frame[14 + 40 + 8 + 20] = {
+        [12] = 0x86, 0xdd,
+        [14] = 0x60, [18] = 0x00, 28, 0, 64,
+        [14 + 40] = 6, 0,
+        [14 + 48] = 0x00, 0x50, 0x9c, 0x40, [14 + 60] = 0x50, 0x12,
+    };
+
+    print_buffer_init(&pb);
+    QP_DUMP_PACKET(frame, sizeof(frame));
+    ck_assert(strstr(pb.buf, " nexthdr=0x0 hop_limit=64 "));
+    ck_assert(strstr(pb.buf, " exthdr=0 tcphdr="));
+    ck_assert(strstr(pb.buf, " sport=80 dport=40000 "));
+    ck_assert(strstr(pb.buf, " SYN"));
+    ck_assert(strstr(pb.buf, " payload=0\n"));
+
+    print_buffer_init(&pb);
+    QP_DUMP_PACKET(frame, sizeof(frame) - 1);
+    ck_assert(strstr(pb.buf, " exthdr=0 truncated=tcp\n"));
+}
+END_TEST
+
+#define RATELIMIT_THREADS 8
+
+static int ratelimit_shared(void)
+{
+    return !!QP_RATELIMIT(1000);
+}
+
+static void *ratelimit_worker(void *arg)
+{
+    int *wins = arg;
+    int i;
+
+    for (i = 0; i < 10000; ++i)
+        *wins += ratelimit_shared();
+    return NULL;
+}
+
+START_TEST(test_ratelimit_threads)
+{
+    pthread_t threads[RATELIMIT_THREADS];
+    int wins[RATELIMIT_THREADS] = {0};
+    int i, total = 0;
+
+    for (i = 0; i < RATELIMIT_THREADS; ++i)
+        pthread_create(&threads[i], NULL, ratelimit_worker, &wins[i]);
+    for (i = 0; i < RATELIMIT_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        total += wins[i];
+    }
+    /* Exactly one winner for the first interval */
+    ck_assert_int_eq(total, 1);
+}
+END_TEST
+
+START_TEST(test_print_ratelimit)
+{
+    struct print_buffer pb;
+    int i;
+
+    print_buffer_init(&pb);
+    for (i = 0; i < 3; ++i)
+        QP_PRINT_RATELIMIT("hello\n");
+    ck_assert(strstr(pb.buf, "cnt=1 rate="));
+    ck_assert(strstr(pb.buf, "/s: hello\n"));
+    ck_assert(!strstr(strstr(pb.buf, "cnt=") + 1, "cnt="));
+}
+END_TEST
+
+static QP_PERCPU_COUNTER_DEFINE(percpu_counter);
+
+static void *percpu_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < 10000; ++i)
+        QP_PERCPU_COUNTER_ADD(percpu_counter, 1);
+    return arg;
+}
+
+START_TEST(test_percpu_counter)
+{
+    pthread_t threads[RATELIMIT_THREADS];
+    struct print_buffer pb;
+    int i;
+
+    for (i = 0; i < RATELIMIT_THREADS; ++i)
+        pthread_create(&threads[i], NULL, percpu_worker, NULL);
+    for (i = 0; i < RATELIMIT_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    ck_assert_int_eq(QP_PERCPU_COUNTER_SUM(percpu_counter), RATELIMIT_THREADS * 10000);
+
+    print_buffer_init(&pb);
+    QP_PRINT_RATELIMIT_PERCPU("hello\n");
+    ck_assert(strstr(pb.buf, " cnt=1 total=1 rate="));
+}
+END_TEST
+
+static struct qp_key_hist key_hist;
+
+static void *key_hist_worker(void *arg)
+{
+    int i, j;
+
+    /* Key 1000000 + i is hit i times by each thread */
+    for (i = 1; i <= 10; ++i)
+        for (j = 0; j < i; ++j)
+            qp_key_hist_add(&key_hist, 1000000 + i);
+    return arg;
+}
+
+START_TEST(test_key_hist)
+{
+    pthread_t threads[RATELIMIT_THREADS];
+    struct print_buffer pb;
+    char top[256];
+    int i;
+
+    for (i = 0; i < RATELIMIT_THREADS; ++i)
+        pthread_create(&threads[i], NULL, key_hist_worker, NULL);
+    for (i = 0; i < RATELIMIT_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    ck_assert_int_eq(key_hist.total, RATELIMIT_THREADS * 55);
+    ck_assert_int_eq(qp_key_hist_summary(&key_hist, 1000, top, sizeof(top)), 10);
+    ck_assert_str_eq(top, "1000010:80.000/s,1000009:72.000/s,1000008:64.000/s,"
+            "1000007:56.000/s,1000006:48.000/s,1000005:40.000/s,"
+            "1000004:32.000/s,1000003:24.000/s");
+    ck_assert_int_eq(qp_key_hist_summary(&key_hist, 1000, top, sizeof(top)), 10);
+    ck_assert_str_eq(top, "");
+
+    print_buffer_init(&pb);
+    QP_PRINT_KEY_HIST_RATELIMIT(~0ULL - 1, "hello\n");
+    ck_assert(strstr(pb.buf, "cnt=1 rate="));
+    ck_assert(strstr(pb.buf, " keys=1 overflow=0 top=18446744073709551614:"));
+}
+END_TEST
+
+static struct qp_flow_table flow_table;
+
+START_TEST(test_flow_account)
+{
+    struct qp_flow_top top_packets[QP_FLOW_TOPN], top_bytes[QP_FLOW_TOPN];
+    unsigned int npackets, nbytes, i;
+    struct print_buffer pb;
+    char buf[128];
+    unsigned char frame[14 + 4 + 20 + 8] = {
+        [12] = 0x81, 0x00, 0x00, 0x64, 0x08, 0x00,
+        [18] = 0x45, [27] = 17, [30] = 10, 0, 0, 1, 10, 0, 0, 2,
+        [38] = 0x00, 0x35, 0x10, 0xf7,
+    };
+    unsigned char packet6[40 + 8] = {
+        [0] = 0x60, [6] = 6, [8] = 0x20, [23] = 1, [24] = 0x20, [39] = 2,
+        [40] = 0x00, 0x50, 0x9c, 0x40,
+    };
+
+    /* Flow with source port 53 + i has 10 * (i + 1) packets of 100 * (11 - i) bytes */
+    for (i = 0; i < 10; ++i) {
+        unsigned int j;
+
+        frame[39] = 0x35 + i;
+        for (j = 0; j < 10 * (i + 1); ++j)
+            qp_flow_add(&flow_table, frame, 100 * (11 - i), 0);
+    }
+    qp_flow_add(&flow_table, packet6, sizeof(packet6), 0x86dd);
+    qp_flow_add(&flow_table, frame, 10, 0);
+    ck_assert_int_eq(flow_table.unparsed, 1);
+    ck_assert_int_eq(qp_flow_report(&flow_table, top_packets, &npackets, top_bytes, &nbytes), 11);
+    ck_assert_int_eq(npackets, QP_FLOW_TOPN);
+    ck_assert_int_eq(top_packets[0].packets, 100);
+    ck_assert_int_eq(top_packets[0].bytes, 20000);
+    qp_flow_format(&top_packets[0].key, buf, sizeof(buf));
+    ck_assert_str_eq(buf, "udp 10.0.0.1:62 > 10.0.0.2:4343");
+    ck_assert_int_eq(top_bytes[0].bytes, 36000);
+    ck_assert_int_eq(top_bytes[0].key.sport, 58);
+    ck_assert_int_eq(top_bytes[QP_FLOW_TOPN - 1].bytes, 32000);
+
+    /* Only flows with packets since the last report are shown */
+    qp_flow_add(&flow_table, packet6, sizeof(packet6), 0x86dd);
+    ck_assert_int_eq(qp_flow_report(&flow_table, top_packets, &npackets, top_bytes, &nbytes), 11);
+    ck_assert_int_eq(npackets, 1);
+    qp_flow_format(&top_packets[0].key, buf, sizeof(buf));
+    ck_assert_str_eq(buf, "tcp [2000:0000:0000:0000:0000:0000:0000:0001]:80 > "
+            "[2000:0000:0000:0000:0000:0000:0000:0002]:40000");
+
+    /* Old flows are evicted when the table is full */
+    for (i = 0; i < 2 * QP_FLOW_TABLE_SIZE; ++i) {
+        frame[38] = i >> 8;
+        frame[39] = i;
+        qp_flow_add(&flow_table, frame, 100, 0);
+    }
+    ck_assert_int_gt(flow_table.evicted, 0);
+
+    print_buffer_init(&pb);
+    QP_FLOW_ACCOUNT(frame, sizeof(frame));
+    ck_assert(strstr(pb.buf, "flows=1 evicted=0 unparsed=0 "));
+    ck_assert(strstr(pb.buf, "\ntop packets: udp 10.0.0.1:2047 > 10.0.0.2:4343 "));
+    ck_assert(strstr(pb.buf, "\ntop bytes: udp 10.0.0.1:2047 > 10.0.0.2:4343 "));
+}
+END_TEST
 #endif
 
 Suite *suite_create_main(void)
@@ -217,6 +674,13 @@ Suite *suite_create_main(void)
     tcase_add_test(tc, test_dump_mac);
     tcase_add_test(tc, test_dump_hex);
     tcase_add_test(tc, test_dump_hex_buffer);
+    tcase_add_test(tc, test_dump_hex_buffer_ascii);
+    tcase_add_test(tc, test_line_assembly);
+    tcase_add_test(tc, test_line_assembly_thread_exit);
+    tcase_add_test(tc, test_line_assembly_long);
+    tcase_add_test(tc, test_dump_symbol);
+    tcase_add_test(tc, test_stack_record);
+    tcase_add_test(tc, test_sampler);
     #ifdef __unix__
     tcase_add_test(tc, test_run_system);
     tcase_add_test(tc, test_run_system_print_exit_status);
@@ -227,7 +691,16 @@ Suite *suite_create_main(void)
     tcase_add_test(tc, test_dump_ipv6_hdr);
     tcase_add_test(tc, test_dump_var);
     tcase_add_test(tc, test_dump_var_ptr);
+    tcase_add_test(tc, test_dump_var_types);
+    tcase_add_test(tc, test_dump_vars);
     tcase_add_test(tc, test_dump_udphdr);
+    tcase_add_test(tc, test_dump_packet);
+    tcase_add_test(tc, test_dump_packet_ipv6);
+    tcase_add_test(tc, test_ratelimit_threads);
+    tcase_add_test(tc, test_print_ratelimit);
+    tcase_add_test(tc, test_percpu_counter);
+    tcase_add_test(tc, test_key_hist);
+    tcase_add_test(tc, test_flow_account);
     #endif
     suite_add_tcase(s, tc);
 
@@ -243,6 +716,15 @@ int main(void)
     srunner_add_suite(sr, suite_create_main());
     srunner_add_suite(sr, suite_create_time_header_4_3());
     srunner_add_suite(sr, suite_create_time_header_5_6());
+    srunner_add_suite(sr, suite_create_ring());
+    srunner_add_suite(sr, suite_create_binlog());
+    srunner_add_suite(sr, suite_create_dyndbg());
+    srunner_add_suite(sr, suite_create_timebase());
+    srunner_add_suite(sr, suite_create_profile());
+    srunner_add_suite(sr, suite_create_perf());
+    srunner_add_suite(sr, suite_create_capture());
+    srunner_add_suite(sr, suite_create_stat());
+    srunner_add_suite(sr, suite_create_output_json());
 
     srunner_run_all(sr, CK_NORMAL);
     ntests_failed = srunner_ntests_failed(sr);
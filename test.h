@@ -18,5 +18,14 @@ int buffer_print(struct print_buffer *pb, const char *fmt, ...);
 
 Suite *suite_create_time_header_4_3(void);
 Suite *suite_create_time_header_5_6(void);
+Suite *suite_create_ring(void);
+Suite *suite_create_binlog(void);
+Suite *suite_create_dyndbg(void);
+Suite *suite_create_timebase(void);
+Suite *suite_create_profile(void);
+Suite *suite_create_perf(void);
+Suite *suite_create_capture(void);
+Suite *suite_create_stat(void);
+Suite *suite_create_output_json(void);
 
 #endif // QP_TEST_H_INCLUDE
@@ -0,0 +1,89 @@
+//
+// Check QP_BINLOG
+//
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QP_BINLOG
+#define QP_RING_NO_DRAIN_THREAD
+#include <qp.h>
+
+static size_t binlog_read(const char *path, char *buf, size_t size)
+{
+    FILE *fp;
+    size_t len;
+
+    qp_ring_flush();
+    fp = fopen(path, "rb");
+    ck_assert(fp);
+    len = fread(buf, 1, size, fp);
+    fclose(fp);
+    return len;
+}
+
+START_TEST(test_binlog_print_loc)
+{
+    const char *fmt = "hello %d %s\n";
+    char path[] = "/tmp/qp_test_binlog_XXXXXX";
+    char buf[16384];
+    struct qp_binlog_file_hdr hdr;
+    struct qp_binlog_site_hdr shdr;
+    struct qp_binlog_rec_hdr rec;
+    const char *pos;
+    size_t len;
+    unsigned int i, site_index = ~0u, site_flags = 0;
+    int val;
+
+    close(mkstemp(path));
+    setenv("QP_BINLOG_FILE", path, 1);
+    QP_PRINT_LOC("hello %d %s\n", 42, "world");
+    len = binlog_read(path, buf, sizeof(buf));
+    unlink(path);
+
+    ck_assert_int_ge(len, sizeof(hdr));
+    memcpy(&hdr, buf, sizeof(hdr));
+    ck_assert(!memcmp(hdr.magic, QP_BINLOG_MAGIC, 8));
+    ck_assert_int_ge(hdr.nsites, 1);
+
+    /* Find the site by format */
+    pos = buf + sizeof(hdr);
+    for (i = 0; i < hdr.nsites; ++i) {
+        memcpy(&shdr, pos, sizeof(shdr));
+        pos += sizeof(shdr);
+        /* Other test files also define sites in the same table */
+        if (shdr.fmt_len >= strlen(fmt) &&
+                !memcmp(pos + shdr.fmt_len - strlen(fmt), fmt, strlen(fmt)) &&
+                shdr.file_len == strlen(__FILE__) &&
+                !memcmp(pos + shdr.fmt_len, __FILE__, shdr.file_len)) {
+            site_index = i;
+            site_flags = shdr.flags;
+        }
+        pos += shdr.fmt_len + shdr.file_len + shdr.func_len;
+    }
+    ck_assert_int_ne(site_index, ~0u);
+    ck_assert(site_flags & QP_SITE_LOC);
+
+    /* Single record with an int and a string copied by value */
+    memcpy(&rec, pos, sizeof(rec));
+    ck_assert_int_eq(rec.site, site_index);
+    ck_assert_int_eq(rec.len, sizeof(rec) + 5 + 3 + 5);
+    ck_assert_int_eq(pos + rec.len - buf, len);
+    pos += sizeof(rec);
+    ck_assert_int_eq(pos[0], (QP_BINLOG_ARG_INT << 4) | 2);
+    memcpy(&val, pos + 1, sizeof(val));
+    ck_assert_int_eq(val, 42);
+    ck_assert_int_eq(pos[5], QP_BINLOG_ARG_STR << 4);
+    ck_assert(!memcmp(pos + 8, "world", 5));
+}
+END_TEST
+
+Suite *suite_create_binlog(void)
+{
+    Suite *s = suite_create("binlog");
+    TCase *tc = tcase_create("binlog");
+    tcase_add_test(tc, test_binlog_print_loc);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
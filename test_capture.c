@@ -0,0 +1,147 @@
+//
+// Check QP_CAPTURE_PACKET
+//
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QP_CAPTURE_FILE_SIZE 4096
+#include <qp.h>
+
+struct capture_file {
+    char buf[QP_CAPTURE_FILE_SIZE];
+    size_t len;
+    unsigned int packets;
+    /* Offset of the last enhanced packet block */
+    size_t last;
+};
+
+static void capture_read(const char *path, struct capture_file *cf)
+{
+    struct qp_pcapng_shb shb;
+    struct qp_pcapng_idb idb;
+    uint32_t block[2], len_again;
+    size_t pos;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    ck_assert(fp);
+    cf->len = fread(cf->buf, 1, sizeof(cf->buf), fp);
+    fclose(fp);
+    cf->packets = 0;
+    cf->last = 0;
+
+    ck_assert_int_ge(cf->len, QP__PCAPNG_HEADER_LEN);
+    memcpy(&shb, cf->buf, sizeof(shb));
+    ck_assert_int_eq(shb.type, QP_PCAPNG_SHB);
+    ck_assert_int_eq(shb.magic, 0x1a2b3c4d);
+    memcpy(&idb, cf->buf + sizeof(shb), sizeof(idb));
+    ck_assert_int_eq(idb.type, QP_PCAPNG_IDB);
+    ck_assert_int_eq(idb.linktype, 1);
+    ck_assert_int_eq(idb.tsresol, 9);
+    memcpy(&idb, cf->buf + sizeof(shb) + sizeof(idb), sizeof(idb));
+    ck_assert_int_eq(idb.linktype, 101);
+
+    /* Blocks must chain exactly up to the end of the file */
+    for (pos = QP__PCAPNG_HEADER_LEN; pos < cf->len; pos += block[1]) {
+        ck_assert_int_le(pos + sizeof(block), cf->len);
+        memcpy(block, cf->buf + pos, sizeof(block));
+        ck_assert_int_eq(block[0], QP_PCAPNG_EPB);
+        ck_assert_int_eq(block[1] % 4, 0);
+        ck_assert_int_le(pos + block[1], cf->len);
+        memcpy(&len_again, cf->buf + pos + block[1] - 4, 4);
+        ck_assert_int_eq(len_again, block[1]);
+        cf->last = pos;
+        ++cf->packets;
+    }
+    ck_assert_int_eq(pos, cf->len);
+}
+
+START_TEST(test_capture_packet)
+{
+    char path[] = "/tmp/qp_test_capture_XXXXXX";
+    unsigned char frame[60] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02 };
+    unsigned char packet[21] = { 0x45, 0x00, 0x00, 0x15 };
+    struct capture_file cf;
+    uint32_t epb[7];
+    uint16_t opt[2];
+    unsigned long long now, ts;
+    const char *comment;
+    size_t pos;
+
+    close(mkstemp(path));
+    ck_assert_int_eq(qp_capture_open(path), 0);
+    now = time(NULL);
+    QP_CAPTURE_PACKET(frame, sizeof(frame));
+    QP_CAPTURE_IP_PACKET(packet, sizeof(packet));
+    qp_capture_close();
+    capture_read(path, &cf);
+    unlink(path);
+    ck_assert_int_eq(cf.packets, 2);
+
+    pos = QP__PCAPNG_HEADER_LEN;
+    memcpy(epb, cf.buf + pos, sizeof(epb));
+    ck_assert_int_eq(epb[2], QP_CAPTURE_IF_ETHERNET);
+    ck_assert_int_eq(epb[5], sizeof(frame));
+    ck_assert_int_eq(epb[6], sizeof(frame));
+    ts = ((unsigned long long)epb[3] << 32 | epb[4]) / 1000000000;
+    ck_assert(ts >= now && ts <= now + 1);
+    ck_assert(!memcmp(cf.buf + pos + sizeof(epb), frame, sizeof(frame)));
+    memcpy(opt, cf.buf + pos + sizeof(epb) + sizeof(frame), sizeof(opt));
+    ck_assert_int_eq(opt[0], QP_PCAPNG_OPT_COMMENT);
+    comment = cf.buf + pos + sizeof(epb) + sizeof(frame) + sizeof(opt);
+    ck_assert(!strncmp(comment, __FILE__ ":", strlen(__FILE__ ":")));
+    ck_assert(!memcmp(comment + opt[1] - strlen(__func__), __func__, strlen(__func__)));
+
+    pos = cf.last;
+    memcpy(epb, cf.buf + pos, sizeof(epb));
+    ck_assert_int_eq(epb[2], QP_CAPTURE_IF_RAW);
+    ck_assert_int_eq(epb[5], sizeof(packet));
+    ck_assert(!memcmp(cf.buf + pos + sizeof(epb), packet, sizeof(packet)));
+    /* Padding after the odd length packet is zero */
+    ck_assert_int_eq(cf.buf[pos + sizeof(epb) + sizeof(packet)], 0);
+}
+END_TEST
+
+START_TEST(test_capture_roll)
+{
+    char path[] = "/tmp/qp_test_capture_XXXXXX";
+    char old_path[sizeof(path) + 2];
+    unsigned char frame[100];
+    struct capture_file cf, old_cf;
+    unsigned int i;
+
+    close(mkstemp(path));
+    snprintf(old_path, sizeof(old_path), "%s.1", path);
+    ck_assert_int_eq(qp_capture_open(path), 0);
+    memset(frame, 0, sizeof(frame));
+    for (i = 0; i < 100; ++i) {
+        frame[0] = i;
+        ck_assert_int_eq(QP_CAPTURE_PACKET(frame, sizeof(frame)), 0);
+    }
+    qp_capture_close();
+    ck_assert_int_eq(QP_CAPTURE_PACKET(frame, sizeof(frame)), -1);
+    capture_read(path, &cf);
+    capture_read(old_path, &old_cf);
+    unlink(path);
+    unlink(old_path);
+
+    /* Only the last two files are kept, the newest has the last frame */
+    ck_assert_int_ge(cf.packets, 1);
+    ck_assert_int_ge(old_cf.packets, 10);
+    ck_assert_int_lt(cf.packets + old_cf.packets, 100);
+    ck_assert_int_eq((unsigned char)cf.buf[cf.last + 28], 99);
+    ck_assert_int_eq((unsigned char)old_cf.buf[old_cf.last + 28], 99 - cf.packets);
+}
+END_TEST
+
+Suite *suite_create_capture(void)
+{
+    Suite *s = suite_create("capture");
+    TCase *tc = tcase_create("capture");
+    tcase_add_test(tc, test_capture_packet);
+    tcase_add_test(tc, test_capture_roll);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,95 @@
+//
+// Check QP_DYNAMIC_DEBUG
+//
+#include "test.h"
+
+#define QP_DYNAMIC_DEBUG
+#define QP_PRINT(str, ...) buffer_print(&pb, str, ##__VA_ARGS__)
+#include <qp.h>
+
+static void dyndbg_print(struct print_buffer *pbp, int i)
+{
+    struct print_buffer pb;
+
+    print_buffer_init(&pb);
+    QP_PRINT_LOC("dyndbg %d\n", i);
+    *pbp = pb;
+}
+
+START_TEST(test_dyndbg_default_off)
+{
+    struct print_buffer pb;
+
+    dyndbg_print(&pb, 1);
+    ck_assert_str_eq(pb.buf, "");
+}
+END_TEST
+
+START_TEST(test_dyndbg_control)
+{
+    struct print_buffer pb;
+
+    ck_assert_int_eq(qp_dyndbg_control("file test_dyndbg.c func dyndbg_print +p"), 1);
+    dyndbg_print(&pb, 2);
+    ck_assert(strstr(pb.buf, "dyndbg_print"));
+    ck_assert(strstr(pb.buf, "dyndbg 2\n"));
+
+    ck_assert_int_eq(qp_dyndbg_control("func dyndbg_* -p"), 1);
+    dyndbg_print(&pb, 3);
+    ck_assert_str_eq(pb.buf, "");
+
+    ck_assert_int_eq(qp_dyndbg_control("file nomatch.c +p"), 0);
+    ck_assert_int_eq(qp_dyndbg_control("func dyndbg_print"), -EINVAL);
+    ck_assert_int_eq(qp_dyndbg_control("bogus +p"), -EINVAL);
+}
+END_TEST
+
+static void dump_site(struct print_buffer *pbp)
+{
+    static const unsigned char data[20] = {1, 2, 3};
+    struct print_buffer pb;
+
+    print_buffer_init(&pb);
+    QP_DUMP_HEX_BUFFER(data, sizeof(data));
+    *pbp = pb;
+}
+
+START_TEST(test_dyndbg_dump)
+{
+    struct print_buffer pb;
+
+    /* The body of a disabled dump is skipped along with its header */
+    dump_site(&pb);
+    ck_assert_str_eq(pb.buf, "");
+
+    ck_assert_int_eq(qp_dyndbg_control("func dump_site +p"), 1);
+    dump_site(&pb);
+    ck_assert(strstr(pb.buf, "dump_site("));
+    ck_assert(strstr(pb.buf, "DUMP 20 bytes from "));
+    ck_assert(strstr(pb.buf, "01020300 00000000"));
+}
+END_TEST
+
+START_TEST(test_dyndbg_env)
+{
+    struct print_buffer pb;
+
+    /* Queries from the environment apply to sites evaluated later */
+    setenv("QP_DYNDBG", "file test_dyn*.c line 1-100 +p", 1);
+    dyndbg_print(&pb, 4);
+    ck_assert(strstr(pb.buf, "dyndbg 4\n"));
+}
+END_TEST
+
+Suite *suite_create_dyndbg(void)
+{
+    Suite *s = suite_create("dyndbg");
+    TCase *tc = tcase_create("dyndbg");
+    tcase_add_test(tc, test_dyndbg_default_off);
+    tcase_add_test(tc, test_dyndbg_control);
+    tcase_add_test(tc, test_dyndbg_dump);
+    tcase_add_test(tc, test_dyndbg_env);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,101 @@
+//
+// Check QP_OUTPUT_JSON
+//
+#include "test.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <linux/udp.h>
+
+#define QP_OUTPUT_FORMAT QP_OUTPUT_JSON
+#define QP_PRINT(str, ...) buffer_print(&pb, str, ##__VA_ARGS__)
+#include <qp.h>
+
+START_TEST(test_output_json)
+{
+    struct print_buffer pb;
+    struct udphdr udp = {
+        .source = htons(1234),
+        .dest = htons(53),
+        .len = htons(20),
+    };
+    char expected[256];
+    unsigned int count = 7;
+    void *ptr = NULL;
+    int arr[2] = { 1, -2 };
+    char name[4] = "a\"b";
+    const char *rate;
+    int line;
+
+    print_buffer_init(&pb);
+    line = __LINE__ + 1;
+    QP_PRINT_LOC("say \"%s\"\\\n", "hi\tthere");
+    snprintf(expected, sizeof(expected),
+            "{\"func\":\"%s\",\"line\":%d,\"msg\":\"say \\\"hi\\tthere\\\"\\\\\"}\n",
+            __func__, line);
+    ck_assert_str_eq(pb.buf, expected);
+
+    print_buffer_init(&pb);
+    line = __LINE__ + 1;
+    QP_DUMP_VAR(count);
+    snprintf(expected, sizeof(expected),
+            "{\"func\":\"%s\",\"line\":%d,\"val\":7,\"var\":\"count\"}\n", __func__, line);
+    ck_assert_str_eq(pb.buf, expected);
+
+    print_buffer_init(&pb);
+    line = __LINE__ + 1;
+    QP_DUMP_VARS(count, ptr, arr, name);
+    snprintf(expected, sizeof(expected),
+            "{\"func\":\"%s\",\"line\":%d,\"count\":7,\"ptr\":\"(nil)\","
+            "\"arr\":[1,-2],\"name\":\"a\\\"b\"}\n", __func__, line);
+    ck_assert_str_eq(pb.buf, expected);
+
+    print_buffer_init(&pb);
+    line = __LINE__ + 1;
+    QP_PRINT_RATELIMIT("first\n");
+    snprintf(expected, sizeof(expected),
+            "{\"func\":\"%s\",\"line\":%d,\"cnt\":1,\"rate\":", __func__, line);
+    ck_assert(!strncmp(pb.buf, expected, strlen(expected)));
+    /* The first interval starts at boot, the rate depends on the uptime */
+    rate = pb.buf + strlen(expected);
+    rate += strspn(rate, "0123456789");
+    ck_assert(rate > pb.buf + strlen(expected));
+    ck_assert(rate[0] == '.' && strspn(rate + 1, "0123456789") == 3);
+    ck_assert_str_eq(rate + 4, ",\"msg\":\"first\"}\n");
+
+    print_buffer_init(&pb);
+    QP_DUMP_UDP_HDR(&udp);
+    ck_assert(strstr(pb.buf, ",\"udphdr\":\"0x"));
+    ck_assert(strstr(pb.buf, "\",\"sport\":1234,\"dport\":53,\"len\":20,\"csum\":\"0\"}\n"));
+}
+END_TEST
+
+START_TEST(test_output_json_truncated)
+{
+    struct print_buffer pb;
+    char *msg = calloc(1, QP_REC_SIZE * 2);
+    size_t len;
+
+    ck_assert(msg);
+    memset(msg, '"', QP_REC_SIZE * 2 - 1);
+    print_buffer_init(&pb);
+    QP_PRINT_LOC("%s\n", msg);
+    free(msg);
+    len = strlen(pb.buf);
+    ck_assert_int_lt(len, QP_REC_SIZE);
+    /* Escapes are never split and the record is still closed */
+    ck_assert(!strcmp(pb.buf + len - 5, "\\\"\"}\n"));
+}
+END_TEST
+
+Suite *suite_create_output_json(void)
+{
+    Suite *s = suite_create("output_json");
+    TCase *tc = tcase_create("output_json");
+    tcase_add_test(tc, test_output_json);
+    tcase_add_test(tc, test_output_json_truncated);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,72 @@
+//
+// Check QP_PROFILE_PERF
+//
+#include "test.h"
+#include <stdio.h>
+
+#define QP_RATELIMIT_INTERVAL 1
+#define QP_PROFILE_PERF
+#define QP_PRINT(str, ...) buffer_print(&perf_pb, str, ##__VA_ARGS__)
+#include <qp.h>
+
+static struct print_buffer perf_pb;
+static volatile unsigned long perf_sink;
+
+static void perf_sleep_region(void)
+{
+    QP_PROFILE_REGION_BEGIN();
+    usleep(20000);
+    QP_PROFILE_REGION_END("sleep");
+}
+
+static void perf_spin_region(void)
+{
+    QP_NANOTIME_T start = QP_NANOTIME_NOW();
+    QP_PROFILE_REGION_BEGIN();
+    while (QP_NANOTIME_NOW() - start < 20000000)
+        ++perf_sink;
+    QP_PROFILE_REGION_END("spin");
+}
+
+static unsigned long long perf_field(const char *field)
+{
+    const char *pos = strstr(perf_pb.buf, field);
+
+    ck_assert(pos != NULL);
+    return strtoull(pos + strlen(field), NULL, 10);
+}
+
+START_TEST(test_perf_sleep)
+{
+    print_buffer_init(&perf_pb);
+    perf_sleep_region();
+    ck_assert(strstr(perf_pb.buf, " per call (") != NULL);
+    ck_assert_int_ge(perf_field("offcpu_avg="), 15000000);
+    ck_assert_int_lt(perf_field("oncpu_avg="), 5000000);
+    /* Context switches are only counted with kernel events */
+    if (strstr(perf_pb.buf, "(perf) sleep"))
+        ck_assert_int_ge(perf_field(" cs="), 1);
+    else
+        ck_assert(strstr(perf_pb.buf, " cs=- ") != NULL);
+}
+END_TEST
+
+START_TEST(test_perf_spin)
+{
+    print_buffer_init(&perf_pb);
+    perf_spin_region();
+    ck_assert_int_ge(perf_field("oncpu_avg="), 10000000);
+    ck_assert(strstr(perf_pb.buf, " spin\n") != NULL);
+}
+END_TEST
+
+Suite *suite_create_perf(void)
+{
+    Suite *s = suite_create("perf");
+    TCase *tc = tcase_create("perf");
+    tcase_add_test(tc, test_perf_sleep);
+    tcase_add_test(tc, test_perf_spin);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,145 @@
+//
+// Check QP_PROFILE_REGION
+//
+#include "test.h"
+#include <stdio.h>
+
+#define QP_RATELIMIT_INTERVAL 50
+#define QP_PROFILE_SLOW_NS 20000000
+#define QP_PRINT(str, ...) buffer_print(&profile_pb, str, ##__VA_ARGS__)
+#include <qp.h>
+
+#define PROFILE_THREADS 8
+#define PROFILE_ITERS 1000
+
+static struct print_buffer profile_pb;
+
+static void profile_region(void)
+{
+    QP_PROFILE_REGION_BEGIN();
+    QP_PROFILE_REGION_END("test");
+}
+
+static void *profile_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < PROFILE_ITERS; ++i)
+        profile_region();
+    return arg;
+}
+
+START_TEST(test_profile_threads)
+{
+    pthread_t threads[PROFILE_THREADS];
+    char *last, *pos;
+    int i;
+
+    print_buffer_init(&profile_pb);
+    profile_region();
+    ck_assert(strstr(profile_pb.buf, "calls=1 "));
+    ck_assert(strstr(profile_pb.buf, "test\n"));
+    ck_assert(strstr(profile_pb.buf, " p99.9="));
+    ck_assert(strstr(profile_pb.buf, " lifetime p50="));
+
+    for (i = 0; i < PROFILE_THREADS; ++i)
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, profile_worker, NULL), 0);
+    for (i = 0; i < PROFILE_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+
+    /* Exited threads released their slots */
+    ck_assert(qp_thread_slots.used[0] == 1ULL << qp_thread_slot());
+
+    usleep(100000);
+    profile_region();
+    for (last = pos = profile_pb.buf; (pos = strstr(pos, "calls=")); last = pos++)
+        ;
+    ck_assert_int_eq(strtoull(last + 6, NULL, 10), PROFILE_THREADS * PROFILE_ITERS + 2);
+
+    /* Shards are per-CPU in the kernel, histograms are allocated separately */
+    ck_assert_int_eq(sizeof(struct qp_profile_shard), 64);
+}
+END_TEST
+
+START_TEST(test_profile_hist_buckets)
+{
+    QP_LONG_COUNTER_T hist[QP_HIST_BUCKETS] = {0};
+    unsigned long long val;
+    unsigned int bucket;
+
+    for (val = 0; val < (1ULL << QP_HIST_OCTAVES); val = val * 5 / 4 + 1) {
+        bucket = qp_hist_bucket(val);
+        ck_assert_int_le(qp_hist_bucket_low(bucket), val);
+        ck_assert_int_ge(qp_hist_bucket_high(bucket), val);
+        /* Relative error bounded by sub-bucket width */
+        ck_assert_int_le(qp_hist_bucket_high(bucket) - qp_hist_bucket_low(bucket),
+                val >> QP_HIST_SUB_BITS);
+    }
+    ck_assert_int_eq(qp_hist_bucket(~0ULL), QP_HIST_BUCKETS - 1);
+
+    for (val = 1; val <= 1000; ++val)
+        ++hist[qp_hist_bucket(val)];
+    ck_assert_int_le(qp_hist_percentile(hist, NULL, 50000, 1000), 500 + 500 / QP_HIST_SUB);
+    ck_assert_int_ge(qp_hist_percentile(hist, NULL, 50000, 1000), 500);
+    ck_assert_int_ge(qp_hist_percentile(hist, NULL, 99900, 1000), 999);
+    ck_assert_int_eq(qp_hist_percentile(hist, NULL, 99900, 1000), 1000);
+}
+END_TEST
+
+static void __attribute__((noinline)) profile_slow_region(int sleep_us)
+{
+    QP_PROFILE_REGION_BEGIN();
+    usleep(sleep_us);
+    QP_PROFILE_REGION_END("slow");
+}
+
+/* Test bodies are named by libcheck, stacks are matched on this frame */
+static void __attribute__((noinline)) profile_slow_caller(void)
+{
+    unsigned int i;
+
+    /* Same call site, so both slow instances share one stack */
+    for (i = 0; i < 3; ++i)
+        profile_slow_region(i < 2 ? 30000 : 0);
+}
+
+START_TEST(test_profile_slow_stacks)
+{
+    struct qp_stack_agg entry;
+    char buf[QP_STACK_AGG_LINE_SIZE];
+    unsigned int i, found = 0;
+
+    print_buffer_init(&profile_pb);
+    profile_slow_caller();
+
+    for (i = 0; i < QP_PROFILE_SLOW_STACKS; ++i) {
+        if (!qp_slow_stack_get(i, &entry))
+            continue;
+        qp_stack_agg_format(&entry, buf, sizeof(buf));
+        if (!strstr(buf, ";profile_slow_region "))
+            continue;
+        ++found;
+        ck_assert_int_eq(entry.count, 2);
+        ck_assert_int_ge(entry.total_ns, 2 * QP_PROFILE_SLOW_NS);
+        ck_assert(strstr(buf, ";profile_slow_caller;profile_slow_region ") != NULL);
+    }
+    ck_assert_int_eq(found, 1);
+
+    print_buffer_init(&profile_pb);
+    QP_PROFILE_SLOW_DUMP();
+    ck_assert(strstr(profile_pb.buf, "slow stacks=") != NULL);
+    ck_assert(strstr(profile_pb.buf, ";profile_slow_region ") != NULL);
+}
+END_TEST
+
+Suite *suite_create_profile(void)
+{
+    Suite *s = suite_create("profile");
+    TCase *tc = tcase_create("profile");
+    tcase_add_test(tc, test_profile_threads);
+    tcase_add_test(tc, test_profile_hist_buckets);
+    tcase_add_test(tc, test_profile_slow_stacks);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
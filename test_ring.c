@@ -0,0 +1,131 @@
+//
+// Check QP_PRINT_IMPL_RING
+//
+#include "test.h"
+#include <stdio.h>
+#include <unistd.h>
+
+#define QP_PRINT QP_PRINT_IMPL_RING
+#define QP_RING_SLOTS 16
+#define QP_RING_NO_DRAIN_THREAD
+#include <qp.h>
+
+static int ring_pipe_setup(int fds[2])
+{
+    ck_assert_int_eq(pipe(fds), 0);
+    qp_ring_set_fd(fds[1]);
+    return fds[0];
+}
+
+static void ring_pipe_read(int fd, char *buf, size_t size)
+{
+    ssize_t len;
+
+    qp_ring_flush();
+    len = read(fd, buf, size - 1);
+    ck_assert_int_ge(len, 0);
+    buf[len] = 0;
+}
+
+START_TEST(test_ring_print)
+{
+    char buf[4096];
+    int fds[2];
+
+    ring_pipe_setup(fds);
+    QP_PRINT_LOC("hello %d\n", 42);
+    ring_pipe_read(fds[0], buf, sizeof(buf));
+    ck_assert(strstr(buf, "test_ring_print"));
+    ck_assert(strstr(buf, "hello 42\n"));
+    ck_assert(!strstr(buf, "dropped"));
+}
+END_TEST
+
+START_TEST(test_ring_truncated)
+{
+    char msg[QP_RING_MSG_SIZE * 2];
+    char buf[4096];
+    char *nl;
+    int fds[2];
+
+    ring_pipe_setup(fds);
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = 0;
+    QP_PRINT("%s\n", msg);
+    QP_PRINT("next\n");
+    ring_pipe_read(fds[0], buf, sizeof(buf));
+    /* The long line is cut but still ends, without a NUL in the stream */
+    nl = strchr(buf, '\n');
+    ck_assert(nl != NULL);
+    ck_assert_int_ge(nl - buf, QP_RING_MSG_SIZE - 1);
+    ck_assert_int_lt(nl - buf, sizeof(msg) - 1);
+    ck_assert(memchr(buf, 0, nl - buf) == NULL);
+    ck_assert_str_eq(nl + 1, "next\n");
+}
+END_TEST
+
+START_TEST(test_ring_drop_new)
+{
+    char buf[4096];
+    int fds[2];
+    int i;
+
+    ring_pipe_setup(fds);
+    qp_ring_set_overflow(QP_RING_OVERFLOW_DROP_NEW);
+    for (i = 0; i < QP_RING_SLOTS + 5; ++i)
+        QP_PRINT("msg %d\n", i);
+    ring_pipe_read(fds[0], buf, sizeof(buf));
+    ck_assert(strstr(buf, "msg 0\n"));
+    ck_assert(!strstr(buf, "msg 16\n"));
+    ck_assert(strstr(buf, " dropped=5 "));
+}
+END_TEST
+
+START_TEST(test_ring_drop_old)
+{
+    char buf[4096];
+    int fds[2];
+    int i;
+
+    ring_pipe_setup(fds);
+    qp_ring_set_overflow(QP_RING_OVERFLOW_DROP_OLD);
+    for (i = 0; i < QP_RING_SLOTS + 5; ++i)
+        QP_PRINT("msg %d\n", i);
+    ring_pipe_read(fds[0], buf, sizeof(buf));
+    ck_assert(!strstr(buf, "msg 4\n"));
+    ck_assert(strstr(buf, "msg 5\n"));
+    ck_assert(strstr(buf, "msg 20\n"));
+    ck_assert(strstr(buf, " dropped=5 "));
+}
+END_TEST
+
+START_TEST(test_ring_block)
+{
+    char buf[4096];
+    int fds[2];
+    int i;
+
+    ring_pipe_setup(fds);
+    qp_ring_set_overflow(QP_RING_OVERFLOW_BLOCK);
+    for (i = 0; i < QP_RING_SLOTS + 5; ++i)
+        QP_PRINT("msg %d\n", i);
+    ring_pipe_read(fds[0], buf, sizeof(buf));
+    ck_assert(strstr(buf, "msg 0\n"));
+    ck_assert(strstr(buf, "msg 20\n"));
+    ck_assert(!strstr(buf, "dropped"));
+}
+END_TEST
+
+Suite *suite_create_ring(void)
+{
+    Suite *s = suite_create("ring");
+    TCase *tc = tcase_create("ring");
+    tcase_add_test(tc, test_ring_print);
+    tcase_add_test(tc, test_ring_truncated);
+    tcase_add_test(tc, test_ring_drop_new);
+    tcase_add_test(tc, test_ring_drop_old);
+    tcase_add_test(tc, test_ring_block);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,220 @@
+//
+// Check the site registry and QP_SNAPSHOT
+//
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QP_STAT_SITE_PRINT_DEFAULT 0
+#define QP_STAT_SHM
+#define QP_STAT_SHM_FILE "/tmp/qp_test_stat.%d"
+/* Exactly the ratelimit and profile sites of stat_run */
+#define QP_STAT_SHM_SITES 2
+#define QP_PRINT(str, ...) buffer_print(&stat_pb, str, ##__VA_ARGS__)
+#include <qp.h>
+
+static struct print_buffer stat_pb;
+
+static void stat_ratelimit(void)
+{
+    QP_PRINT_RATELIMIT("ratelimit" QP_NL);
+}
+
+static void stat_region(void)
+{
+    QP_PROFILE_REGION_BEGIN();
+    QP_PROFILE_REGION_END("region");
+}
+
+static void stat_region_late(void)
+{
+    QP_PROFILE_REGION_BEGIN();
+    QP_PROFILE_REGION_END("late");
+}
+
+static void *stat_late_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < 1000; ++i)
+        stat_region_late();
+    return arg;
+}
+
+static void stat_hist(unsigned int val)
+{
+    QP_PRINT_HIST_RATELIMIT(val, 8, "hist" QP_NL);
+}
+
+static void stat_run(void)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i)
+        stat_ratelimit();
+    stat_region();
+    stat_region();
+    stat_hist(1);
+    stat_hist(4);
+    stat_hist(1);
+}
+
+/* Find the snapshot line of func and check its counters */
+static void stat_check(const char *buf, const char *func, const char *counters)
+{
+    const char *line = strstr(buf, func);
+    const char *end;
+
+    ck_assert_msg(line, "no snapshot of %s in:\n%s", func, buf);
+    end = strchr(line, '\n');
+    ck_assert(end);
+    line = strstr(line, "): ");
+    ck_assert(line && line < end);
+    ck_assert_msg(!strncmp(line + 3, counters, strlen(counters)),
+            "%s: %.*s", func, (int)(end - line), line);
+}
+
+START_TEST(test_snapshot_print)
+{
+    print_buffer_init(&stat_pb);
+    stat_run();
+    /* Periodic reports are disabled */
+    ck_assert_str_eq(stat_pb.buf, "");
+
+    QP_SNAPSHOT();
+    ck_assert(strstr(stat_pb.buf, "snapshot\n"));
+    stat_check(stat_pb.buf, "stat_ratelimit(", "cnt=3");
+    stat_check(stat_pb.buf, "stat_region(", "calls=2 usage=");
+    stat_check(stat_pb.buf, "stat_hist(", "cnt[1]=2 cnt[4]=1\n");
+}
+END_TEST
+
+START_TEST(test_snapshot_signal)
+{
+    char path[] = "/tmp/qp_test_stat_XXXXXX";
+    char buf[4096];
+    ssize_t len;
+    int fd;
+
+    stat_run();
+    fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    /* The file stays open for the snapshot at exit */
+    unlink(path);
+    ck_assert_int_eq(qp_snapshot_install(fd), 0);
+    raise(QP_SNAPSHOT_SIGNAL);
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    ck_assert_int_gt(len, 0);
+    buf[len] = '\0';
+    stat_check(buf, "stat_ratelimit(", "cnt=3");
+    stat_check(buf, "stat_region(", "calls=2 ");
+    stat_check(buf, "stat_hist(", "cnt[1]=2 cnt[4]=1\n");
+}
+END_TEST
+
+START_TEST(test_stat_append)
+{
+    char buf[8];
+
+    /* Signal-safe formatting truncates and returns lengths like snprintf */
+    ck_assert_int_eq(qp_stat_append_dec(buf, sizeof(buf), 0, "cnt=", 123, ""), 7);
+    ck_assert_str_eq(buf, "cnt=123");
+    ck_assert_int_eq(qp_stat_append_dec(buf, sizeof(buf), 7, " p50=", 18446744073709551615ULL, "ns"),
+            34);
+    ck_assert_str_eq(buf, "cnt=123");
+    ck_assert_int_eq(qp_stat_append_dec(buf, sizeof(buf), 0, "x=", 0, "ns"), 5);
+    ck_assert_str_eq(buf, "x=0ns");
+    ck_assert_int_eq(qp_stat_append_dec(buf, sizeof(buf), 0, "", 123456789, ""), 9);
+    ck_assert_str_eq(buf, "1234567");
+}
+END_TEST
+
+START_TEST(test_stat_shm_env)
+{
+    char expected[64];
+
+    /* Only "%d" is replaced, the rest is used verbatim */
+    setenv("QP_STAT_SHM_FILE", "/tmp/qp_test_stat_env.%s%n.%d", 1);
+    stat_run();
+    snprintf(expected, sizeof(expected), "/tmp/qp_test_stat_env.%%s%%n.%d", getpid());
+    ck_assert_str_eq(qp_stat_shm_state.path, expected);
+    ck_assert(qp_stat_shm_state.hdr != NULL);
+    ck_assert_int_eq(access(expected, R_OK), 0);
+}
+END_TEST
+
+START_TEST(test_stat_shm_full)
+{
+    pthread_t threads[4];
+    int i;
+
+    /* The segment is full, the site counts on the heap from its first hit */
+    stat_run();
+    for (i = 0; i < 4; ++i)
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, stat_late_worker, NULL), 0);
+    for (i = 0; i < 4; ++i)
+        pthread_join(threads[i], NULL);
+    print_buffer_init(&stat_pb);
+    QP_SNAPSHOT();
+    stat_check(stat_pb.buf, "stat_region_late(", "calls=4000 ");
+    ck_assert_int_eq(qp_stat_shm_state.hdr->nsites, 3);
+}
+END_TEST
+
+START_TEST(test_stat_shm)
+{
+    const struct qp_stat_shm_hdr *hdr;
+    const struct qp_stat_shm_site *slot;
+    QP_LONG_COUNTER_T calls;
+    unsigned int i, j, found = 0;
+    struct stat st;
+    int fd;
+
+    stat_run();
+    fd = open(qp_stat_shm_state.path, O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(fstat(fd, &st), 0);
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    ck_assert(hdr != MAP_FAILED);
+    ck_assert(!memcmp(hdr->magic, QP_STAT_SHM_MAGIC, sizeof(hdr->magic)));
+    ck_assert_int_eq(hdr->version, QP_STAT_SHM_VERSION);
+    ck_assert_int_eq(hdr->pid, getpid());
+    ck_assert_int_eq(hdr->site_size, sizeof(*slot));
+    ck_assert_int_ge(st.st_size, hdr->hdr_size + hdr->max_sites * hdr->site_size);
+
+    /* Histogram sites are not exported */
+    ck_assert_int_eq(hdr->nsites, 2);
+    for (i = 0; i < hdr->nsites; ++i) {
+        slot = qp_stat_shm_site((struct qp_stat_shm_hdr *)hdr, i);
+        if (slot->type == QP_STAT_SITE_RATELIMIT) {
+            ck_assert_str_eq(slot->func, "stat_ratelimit");
+            ck_assert_int_eq(slot->count, 3);
+            ++found;
+        } else if (slot->type == QP_STAT_SITE_PROFILE) {
+            ck_assert_str_eq(slot->func, "stat_region");
+            for (j = 0, calls = 0; j < QP_THREAD_SLOTS; ++j)
+                calls += slot->shards[j].count;
+            ck_assert_int_eq(calls, 2);
+            ++found;
+        }
+    }
+    ck_assert_int_eq(found, 2);
+    munmap((void *)hdr, st.st_size);
+}
+END_TEST
+
+Suite *suite_create_stat(void)
+{
+    Suite *s = suite_create("stat");
+    TCase *tc = tcase_create("stat");
+    tcase_add_test(tc, test_snapshot_print);
+    tcase_add_test(tc, test_snapshot_signal);
+    tcase_add_test(tc, test_stat_append);
+    tcase_add_test(tc, test_stat_shm);
+    tcase_add_test(tc, test_stat_shm_full);
+    tcase_add_test(tc, test_stat_shm_env);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
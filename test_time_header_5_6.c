@@ -3,6 +3,7 @@
 //
 #include "test.h"
 #include <sys/time.h>
+#include <ctype.h>
 
 #define QP_TIME_HEADER QP_TIME_HEADER_5_6
 #define QP_PRINT(str, ...) buffer_print(&pb, str, ##__VA_ARGS__)
@@ -11,6 +12,7 @@
 START_TEST(test_time_header_5_6)
 {
     struct print_buffer pb;
+    int i;
     print_buffer_init(&pb);
     QP_PRINT_LOC("hello\n");
     //fprintf(stderr, "OUT: %s", pb.buf);
@@ -18,6 +20,9 @@ START_TEST(test_time_header_5_6)
     ck_assert_int_eq(pb.buf[13], ']');
     ck_assert_int_eq(pb.buf[14], ' ');
     ck_assert_int_eq(pb.buf[QP_TIME_HEADER_LEN - 1], ' ');
+    ck_assert_int_eq(pb.buf[6], '.');
+    for (i = 1; i < 13; ++i)
+        ck_assert(i == 6 || isdigit(pb.buf[i]));
     ck_assert(strstr(pb.buf, "test_time_header_5_6"));
     ck_assert(strstr(pb.buf, "hello\n"));
 }
@@ -0,0 +1,49 @@
+//
+// Check QP_TIMEBASE
+//
+#include "test.h"
+
+#define QP_TIMEBASE QP_TIMEBASE_TSC
+#include <qp.h>
+
+START_TEST(test_timebase_monotonic)
+{
+    QP_NANOTIME_T prev = QP_NANOTIME_NOW(), now;
+    int i;
+
+    for (i = 0; i < 100000; ++i) {
+        now = QP_NANOTIME_NOW();
+        ck_assert(now >= prev);
+        prev = now;
+    }
+}
+END_TEST
+
+START_TEST(test_timebase_tsc_matches_clock)
+{
+    QP_NANOTIME_T clock_ns, ns;
+    long long diff;
+
+    /* Either calibrated or fallback to the clock */
+    ns = QP_NANOTIME_NOW();
+    clock_ns = QP_NANOTIME_NOW_CLOCK();
+#ifdef __x86_64__
+    ck_assert_int_ne(qp_tsc_state.state, 0);
+#endif
+    diff = (long long)(clock_ns - ns);
+    ck_assert_int_ge(diff, -1000000);
+    ck_assert_int_le(diff, 1000000);
+    ck_assert_int_le(QP_MILITIME_NOW() - clock_ns / 1000000, 1000);
+}
+END_TEST
+
+Suite *suite_create_timebase(void)
+{
+    Suite *s = suite_create("timebase");
+    TCase *tc = tcase_create("timebase");
+    tcase_add_test(tc, test_timebase_monotonic);
+    tcase_add_test(tc, test_timebase_tsc_matches_clock);
+    suite_add_tcase(s, tc);
+
+    return s;
+}